@@ -0,0 +1,134 @@
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <format>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+
+#include "crc32c.hpp"
+#include "dataPackage.hpp"
+#include "selfSignedCertificate.hpp"
+
+/*
+ * Measures what the CRC32C trailer of a data package costs per frame, in CPU
+ * time.
+ *
+ * A frame is checksummed by its sender and verified by its receiver, so an
+ * echo round trip checksums four frames. The baseline is the CPU time of the
+ * same round trip without checksums: framing, TLS 1.3 in both directions and
+ * the socket calls over loopback TCP, including the time spent in the kernel,
+ * all on one thread. It leaves out JSON and the command itself, so the share
+ * printed here is an upper bound of what the checksum costs the server.
+ */
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr std::array<std::size_t, 5> frame_sizes{32, 300, 4096, 16384,
+                                                 65536};
+constexpr auto run_time = std::chrono::milliseconds(300);
+constexpr double target_share = 1.0;
+
+// Runs func until run_time has passed and returns the nanoseconds of CPU
+// time per call. std::clock() counts user and kernel time of the process,
+// which only runs this thread.
+template <class Func> double measure(Func &&func) {
+  std::size_t calls = 0;
+  const auto start = clock_type::now();
+  const std::clock_t cpu_start = std::clock();
+  do {
+    for (int i = 0; i < 64; ++i) {
+      func();
+    }
+    calls += 64;
+  } while (clock_type::now() - start < run_time);
+  const double cpu_ns = static_cast<double>(std::clock() - cpu_start) * 1e9 /
+                        CLOCKS_PER_SEC;
+  return cpu_ns / static_cast<double>(calls);
+}
+
+} // namespace
+
+int main() {
+  asio::io_context io_context;
+  asio::ssl::context server_context(asio::ssl::context::tlsv13_server);
+  asio::ssl::context client_context(asio::ssl::context::tlsv13_client);
+  qls::benchmark::useSelfSignedCertificate(server_context);
+
+  asio::ip::tcp::acceptor acceptor(
+      io_context, {asio::ip::make_address("127.0.0.1"), 0});
+  asio::ssl::stream<asio::ip::tcp::socket> server(io_context, server_context);
+  asio::ssl::stream<asio::ip::tcp::socket> client(io_context, client_context);
+  client.lowest_layer().connect(acceptor.local_endpoint());
+  acceptor.accept(server.lowest_layer());
+
+  // A whole 64 KiB frame has to fit into the socket buffers because both
+  // ends are driven from this thread
+  for (auto *socket : {&server.lowest_layer(), &client.lowest_layer()}) {
+    socket->set_option(asio::ip::tcp::no_delay(true));
+    socket->set_option(asio::socket_base::send_buffer_size(1 << 20));
+    socket->set_option(asio::socket_base::receive_buffer_size(1 << 20));
+  }
+
+  // Both handshakes need the other side, so they run asynchronously
+  server.async_handshake(asio::ssl::stream_base::server,
+                         [](const std::error_code &) {});
+  client.async_handshake(asio::ssl::stream_base::client,
+                         [](const std::error_code &) {});
+  io_context.run();
+
+  std::cout << std::format("{:>8} {:>12} {:>16} {:>10} {:>8}\n", "frame",
+                           "crc32c (ns)", "round trip (ns)", "share (%)",
+                           "< 1%");
+  std::cout << std::format("{:>8} {:>12} {:>16}\n", "", "CPU", "CPU");
+
+  std::string received;
+  std::uint32_t checksum = 0;
+  for (std::size_t frame_size : frame_sizes) {
+    const std::size_t data_size =
+        frame_size - qls::DataPackage::header_size;
+    const std::string data(data_size, 'x');
+    const auto header = qls::DataPackage::makeHeader(data_size);
+    std::string frame(header.data(), header.size());
+    frame += data;
+
+    const double crc_ns =
+        measure([&]() { checksum ^= qls::crc32c(frame, checksum); });
+
+    received.resize(frame_size);
+    auto send_frame = [&](asio::ssl::stream<asio::ip::tcp::socket> &stream) {
+      auto header = qls::DataPackage::makeHeader(data_size);
+      std::array<asio::const_buffer, 2> buffers{
+          asio::buffer(header), asio::buffer(data)};
+      asio::write(stream, buffers);
+    };
+    auto receive_frame =
+        [&](asio::ssl::stream<asio::ip::tcp::socket> &stream) {
+          asio::read(stream, asio::buffer(received));
+          auto view = qls::DataPackageView::fromString(received);
+          checksum += static_cast<std::uint32_t>(view.getData().size());
+        };
+    const double round_trip_ns = measure([&]() {
+      send_frame(client);
+      receive_frame(server);
+      send_frame(server);
+      receive_frame(client);
+    });
+
+    // Both ends checksum the frames they send and verify those they get
+    const double share = 4 * crc_ns / round_trip_ns * 100;
+    std::cout << std::format("{:>8} {:>12.1f} {:>16.0f} {:>10.2f} {:>8}\n",
+                             frame_size, crc_ns, round_trip_ns, share,
+                             share < target_share ? "yes" : "no");
+  }
+
+  // Keeps the checksums from being optimized away
+  return checksum == 1 ? 1 : 0;
+}
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <latch>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+
+#include "selfSignedCertificate.hpp"
+
+/*
+ * Compares the io backends asio can be built with (QLS_USE_IO_URING) on the
+ * traffic of a chat server: many idle TLS connections and fewer busy ones.
+ *
+ *   IoBackendBenchmark server [port] [threads]
+ *   IoBackendBenchmark client <host> [port] [idle] [busy] [seconds] [threads]
+ *
+ * The server echoes fixed-size messages over TLS 1.3 and reports its CPU
+ * time per echo and its memory every few seconds. The client opens the idle
+ * connections (50000 by default), then the busy ones (5000 by default), which
+ * send a message and wait for the echo in a loop. Connections are spread over
+ * port_num consecutive ports so a single client address doesn't run out of
+ * ephemeral ports. Build the server once per backend and run the same client
+ * against both, preferably from another machine.
+ */
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+using asio::use_awaitable;
+using asio::ip::tcp;
+using ssl_stream = asio::ssl::stream<tcp::socket>;
+
+constexpr std::uint16_t default_port = 55600;
+constexpr std::size_t port_num = 4;
+constexpr std::size_t default_idle_num = 50000;
+constexpr std::size_t default_busy_num = 5000;
+constexpr std::size_t default_seconds = 30;
+constexpr std::size_t message_size = 256;
+constexpr std::size_t connect_concurrency = 256;
+constexpr auto report_interval = std::chrono::seconds(5);
+
+std::string_view backendName() {
+#if defined(ASIO_HAS_IO_URING) && defined(ASIO_DISABLE_EPOLL)
+  return "io_uring";
+#else
+  return "epoll";
+#endif
+}
+
+std::size_t argument(int argc, char *argv[], int index, std::size_t fallback) {
+  return argc > index ? std::strtoull(argv[index], nullptr, 10) : fallback;
+}
+
+// Every connection takes a descriptor on each end
+void raiseFileLimit(std::size_t needed) {
+  rlimit limit{};
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < needed) {
+    std::cerr << std::format("warning: only {} file descriptors, {} needed\n",
+                             limit.rlim_cur, needed);
+  }
+}
+
+double cpuSeconds() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  auto seconds = [](const timeval &time) {
+    return static_cast<double>(time.tv_sec) +
+           static_cast<double>(time.tv_usec) / 1e6;
+  };
+  return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+}
+
+std::size_t residentMiB() {
+  std::ifstream statm("/proc/self/statm");
+  std::size_t pages = 0;
+  std::size_t resident = 0;
+  statm >> pages >> resident;
+  return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE)) /
+         (1024 * 1024);
+}
+
+// Runs an io_context on threads until the object is destroyed
+class IoThreads {
+public:
+  IoThreads(asio::io_context &io_context, std::size_t thread_num)
+      : m_io_context(io_context), m_work(io_context.get_executor()) {
+    for (std::size_t i = 0; i < std::max<std::size_t>(thread_num, 1); ++i) {
+      m_threads.emplace_back([&io_context]() { io_context.run(); });
+    }
+  }
+  ~IoThreads() noexcept { m_io_context.stop(); }
+
+private:
+  asio::io_context &m_io_context;
+  asio::executor_work_guard<asio::io_context::executor_type> m_work;
+  std::vector<std::jthread> m_threads;
+};
+
+// ---------------------------------------------------------------- server
+
+struct ServerStats {
+  std::atomic<std::size_t> connections = 0;
+  std::atomic<std::uint64_t> echoes = 0;
+};
+
+asio::awaitable<void> serveConnection(ssl_stream stream, ServerStats &stats) {
+  bool counted = false;
+  try {
+    co_await stream.async_handshake(asio::ssl::stream_base::server,
+                                    use_awaitable);
+    stats.connections.fetch_add(1, std::memory_order_relaxed);
+    counted = true;
+    std::array<char, message_size> buffer;
+    while (true) {
+      co_await asio::async_read(stream, asio::buffer(buffer), use_awaitable);
+      co_await asio::async_write(stream, asio::buffer(buffer), use_awaitable);
+      stats.echoes.fetch_add(1, std::memory_order_relaxed);
+    }
+  } catch (const std::exception &) {
+    // The client closed the connection
+  }
+  if (counted) {
+    stats.connections.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+asio::awaitable<void> acceptConnections(tcp::acceptor acceptor,
+                                        asio::ssl::context &context,
+                                        ServerStats &stats) {
+  while (true) {
+    try {
+      tcp::socket socket = co_await acceptor.async_accept(use_awaitable);
+      co_spawn(acceptor.get_executor(),
+               serveConnection(ssl_stream(std::move(socket), context), stats),
+               asio::detached);
+    } catch (const std::exception &e) {
+      std::cerr << std::format("accept failed: {}\n", e.what());
+    }
+  }
+}
+
+asio::awaitable<void> report(const ServerStats &stats) {
+  asio::steady_timer timer(co_await asio::this_coro::executor);
+  double last_cpu = cpuSeconds();
+  std::uint64_t last_echoes = 0;
+  while (true) {
+    timer.expires_after(report_interval);
+    co_await timer.async_wait(use_awaitable);
+    const double cpu = cpuSeconds();
+    const std::uint64_t echoes = stats.echoes.load(std::memory_order_relaxed);
+    const double interval =
+        std::chrono::duration<double>(report_interval).count();
+    const auto new_echoes = static_cast<double>(echoes - last_echoes);
+    std::cout << std::format(
+        "{:>7} connections {:>10.0f} echoes/s {:>8.2f} us CPU/echo "
+        "{:>6.1f} cores {:>7} MiB\n",
+        stats.connections.load(std::memory_order_relaxed),
+        new_echoes / interval,
+        new_echoes > 0 ? (cpu - last_cpu) * 1e6 / new_echoes : 0.0,
+        (cpu - last_cpu) / interval, residentMiB()) << std::flush;
+    last_cpu = cpu;
+    last_echoes = echoes;
+  }
+}
+
+int runServer(std::uint16_t port, std::size_t thread_num) {
+  raiseFileLimit(default_idle_num + default_busy_num + 64);
+  asio::ssl::context context(asio::ssl::context::tlsv13_server);
+  qls::benchmark::useSelfSignedCertificate(context);
+
+  asio::io_context io_context;
+  ServerStats stats;
+  for (std::size_t i = 0; i < port_num; ++i) {
+    tcp::acceptor acceptor(
+        io_context,
+        {tcp::v4(), static_cast<std::uint16_t>(port + i)});
+    acceptor.listen(asio::socket_base::max_listen_connections);
+    co_spawn(io_context,
+             acceptConnections(std::move(acceptor), context, stats),
+             asio::detached);
+  }
+  co_spawn(io_context, report(stats), asio::detached);
+
+  std::cout << std::format("{} backend, {} threads, ports {}-{}\n",
+                           backendName(), thread_num, port,
+                           port + port_num - 1)
+            << std::flush;
+  auto stopped = std::make_shared<std::latch>(1);
+  asio::signal_set signals(io_context, SIGINT, SIGTERM);
+  signals.async_wait([stopped](auto, auto) { stopped->count_down(); });
+  IoThreads threads(io_context, thread_num);
+  stopped->wait();
+  return 0;
+}
+
+// ---------------------------------------------------------------- client
+
+struct ClientStats {
+  std::atomic<std::uint64_t> round_trips = 0;
+  std::atomic<std::uint64_t> latency_ns = 0;
+  // Round trips by the bit width of their latency in microseconds
+  std::array<std::atomic<std::uint64_t>, 32> histogram{};
+};
+
+// Opens connections into streams, connect_concurrency at a time
+std::size_t openConnections(asio::io_context &io_context,
+                            asio::ssl::context &context,
+                            const std::vector<tcp::endpoint> &endpoints,
+                            std::vector<std::unique_ptr<ssl_stream>> &streams) {
+  std::atomic<std::size_t> next = 0;
+  std::atomic<std::size_t> failed = 0;
+  // Shared so it outlives the last count_down()
+  auto done = std::make_shared<std::latch>(
+      static_cast<std::ptrdiff_t>(connect_concurrency));
+  for (std::size_t i = 0; i < connect_concurrency; ++i) {
+    co_spawn(
+        io_context,
+        [&, done]() -> asio::awaitable<void> {
+          for (std::size_t index = next.fetch_add(1); index < streams.size();
+               index = next.fetch_add(1)) {
+            try {
+              auto stream = std::make_unique<ssl_stream>(io_context, context);
+              co_await stream->lowest_layer().async_connect(
+                  endpoints[index % endpoints.size()], use_awaitable);
+              co_await stream->async_handshake(
+                  asio::ssl::stream_base::client, use_awaitable);
+              streams[index] = std::move(stream);
+            } catch (const std::exception &) {
+              failed.fetch_add(1, std::memory_order_relaxed);
+            }
+          }
+          done->count_down();
+        },
+        asio::detached);
+  }
+  done->wait();
+  return failed.load();
+}
+
+asio::awaitable<void> echoLoop(ssl_stream &stream, ClientStats &stats,
+                               const std::atomic<bool> &running) {
+  std::array<char, message_size> buffer{};
+  try {
+    while (running.load(std::memory_order_relaxed)) {
+      const auto start = clock_type::now();
+      co_await asio::async_write(stream, asio::buffer(buffer), use_awaitable);
+      co_await asio::async_read(stream, asio::buffer(buffer), use_awaitable);
+      const auto latency =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              clock_type::now() - start)
+              .count();
+      stats.round_trips.fetch_add(1, std::memory_order_relaxed);
+      stats.latency_ns.fetch_add(static_cast<std::uint64_t>(latency),
+                                 std::memory_order_relaxed);
+      const auto bucket = std::min<std::size_t>(
+          std::bit_width(static_cast<std::uint64_t>(latency) / 1000),
+          stats.histogram.size() - 1);
+      stats.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+  } catch (const std::exception &) {
+    // Counted as missing round trips
+  }
+}
+
+// Upper bound in microseconds of the latency of a share of round trips
+std::uint64_t percentile(const ClientStats &stats, double share) {
+  const auto total = stats.round_trips.load();
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < stats.histogram.size(); ++i) {
+    seen += stats.histogram[i].load();
+    if (static_cast<double>(seen) >= share * static_cast<double>(total)) {
+      return std::uint64_t(1) << i;
+    }
+  }
+  return std::uint64_t(1) << (stats.histogram.size() - 1);
+}
+
+int runClient(std::string_view host, std::uint16_t port, std::size_t idle_num,
+              std::size_t busy_num, std::size_t seconds,
+              std::size_t thread_num) {
+  raiseFileLimit(idle_num + busy_num + 64);
+  asio::ssl::context context(asio::ssl::context::tlsv13_client);
+
+  std::vector<tcp::endpoint> endpoints;
+  for (std::size_t i = 0; i < port_num; ++i) {
+    endpoints.emplace_back(asio::ip::make_address(host),
+                           static_cast<std::uint16_t>(port + i));
+  }
+
+  // The threads are stopped first and the io_context is destroyed last
+  asio::io_context io_context;
+  std::vector<std::unique_ptr<ssl_stream>> idle(idle_num);
+  std::vector<std::unique_ptr<ssl_stream>> busy(busy_num);
+  ClientStats stats;
+  std::atomic<bool> running = true;
+  IoThreads threads(io_context, thread_num);
+
+  auto start = clock_type::now();
+  std::size_t failed = openConnections(io_context, context, endpoints, idle);
+  std::cout << std::format(
+      "{} idle connections open in {:.1f} s, {} failed\n", idle_num - failed,
+      std::chrono::duration<double>(clock_type::now() - start).count(),
+      failed);
+
+  failed = openConnections(io_context, context, endpoints, busy);
+  std::cout << std::format("{} busy connections open, {} failed\n",
+                           busy_num - failed, failed);
+
+  auto done = std::make_shared<std::latch>(
+      static_cast<std::ptrdiff_t>(busy_num));
+  for (auto &stream : busy) {
+    if (!stream) {
+      done->count_down();
+      continue;
+    }
+    co_spawn(
+        io_context,
+        [&stream = *stream, &stats, &running,
+         done]() -> asio::awaitable<void> {
+          co_await echoLoop(stream, stats, running);
+          done->count_down();
+        },
+        asio::detached);
+  }
+
+  start = clock_type::now();
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  running = false;
+  const std::chrono::duration<double> elapsed = clock_type::now() - start;
+  done->wait();
+
+  const auto round_trips = stats.round_trips.load();
+  std::cout << std::format(
+      "{:.0f} round trips/s, mean {:.0f} us, p50 < {} us, p99 < {} us\n",
+      static_cast<double>(round_trips) / elapsed.count(),
+      round_trips ? static_cast<double>(stats.latency_ns.load()) /
+                        static_cast<double>(round_trips) / 1000
+                  : 0.0,
+      percentile(stats, 0.5), percentile(stats, 0.99));
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const std::string_view mode = argc > 1 ? argv[1] : "";
+  const std::size_t hardware_threads =
+      std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+  try {
+    if (mode == "server") {
+      return runServer(
+          static_cast<std::uint16_t>(argument(argc, argv, 2, default_port)),
+          argument(argc, argv, 3, hardware_threads));
+    }
+    if (mode == "client" && argc > 2) {
+      return runClient(
+          argv[2],
+          static_cast<std::uint16_t>(argument(argc, argv, 3, default_port)),
+          argument(argc, argv, 4, default_idle_num),
+          argument(argc, argv, 5, default_busy_num),
+          argument(argc, argv, 6, default_seconds),
+          argument(argc, argv, 7, hardware_threads));
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+  }
+
+  std::cerr << "usage: IoBackendBenchmark server [port] [threads]\n"
+               "       IoBackendBenchmark client <host> [port] [idle] [busy] "
+               "[seconds] [threads]\n";
+  return 1;
+}
@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <memory_resource>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "threadLocalPool.hpp"
+
+/*
+ * Measures allocation throughput of the memory resources packages can use
+ * when many io threads allocate at once.
+ *
+ * In the first mode every thread keeps a working set of blocks of frame-like
+ * sizes and keeps replacing one of them, like an io thread that receives
+ * frames while older ones are still being processed. In the second mode the
+ * threads form a ring and every block is freed by the next thread, like a
+ * frame received on one io thread and released on a worker or another
+ * connection's thread. Blocks are handed over in batches through a mailbox
+ * with a lock, one lock per batch_size blocks. Usage: PoolBenchmark [threads]
+ */
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr std::size_t default_thread_num = 12;
+constexpr std::size_t working_set = 64;
+constexpr std::size_t operations_per_thread = 2'000'000;
+constexpr std::array<std::size_t, 8> block_sizes{64,   128,  300,   512,
+                                                 1024, 4096, 16384, 65536};
+
+// Blocks handed to the next thread at once, and how many batches it may
+// have waiting before the thread handing them over has to wait
+constexpr std::size_t batch_size = 64;
+constexpr std::size_t max_pending_batches = 8;
+static_assert(operations_per_thread % batch_size == 0);
+
+enum class FreeMode { SameThread, NextThread };
+
+struct Block {
+  void *ptr = nullptr;
+  std::size_t size = 0;
+};
+
+using Batch = std::array<Block, batch_size>;
+
+// Batches allocated by the previous thread in the ring
+struct Mailbox {
+  std::mutex mutex;
+  std::vector<Batch> batches;
+};
+
+// A small xorshift keeps the random sizes out of the measurement
+std::uint32_t nextRandom(std::uint32_t &seed) noexcept {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+void runThread(std::pmr::memory_resource *resource, std::uint32_t seed) {
+  std::array<Block, working_set> blocks{};
+
+  for (std::size_t i = 0; i < operations_per_thread; ++i) {
+    Block &block = blocks[nextRandom(seed) % working_set];
+    if (block.ptr != nullptr) {
+      resource->deallocate(block.ptr, block.size, alignof(std::max_align_t));
+    }
+    block.size = block_sizes[nextRandom(seed) % block_sizes.size()];
+    block.ptr = resource->allocate(block.size, alignof(std::max_align_t));
+    // Touch the block like a frame being received into it
+    static_cast<char *>(block.ptr)[0] = static_cast<char>(i);
+  }
+  for (const Block &block : blocks) {
+    if (block.ptr != nullptr) {
+      resource->deallocate(block.ptr, block.size, alignof(std::max_align_t));
+    }
+  }
+}
+
+// Frees the batches in a mailbox, spare is swapped in so that neither side
+// allocates. Returns false if there were none.
+bool freeBatches(std::pmr::memory_resource *resource, Mailbox &mailbox,
+                 std::vector<Batch> &spare) {
+  {
+    std::lock_guard lock(mailbox.mutex);
+    if (mailbox.batches.empty()) {
+      return false;
+    }
+    mailbox.batches.swap(spare);
+  }
+  for (const Batch &batch : spare) {
+    for (const Block &block : batch) {
+      resource->deallocate(block.ptr, block.size, alignof(std::max_align_t));
+    }
+  }
+  spare.clear();
+  return true;
+}
+
+void runRingThread(std::pmr::memory_resource *resource, std::uint32_t seed,
+                   Mailbox &own, Mailbox &next,
+                   std::atomic<std::size_t> &running_threads) {
+  std::vector<Batch> spare;
+  spare.reserve(max_pending_batches);
+  Batch batch{};
+  for (std::size_t i = 0; i < operations_per_thread; ++i) {
+    Block &block = batch[i % batch_size];
+    block.size = block_sizes[nextRandom(seed) % block_sizes.size()];
+    block.ptr = resource->allocate(block.size, alignof(std::max_align_t));
+    static_cast<char *>(block.ptr)[0] = static_cast<char>(i);
+    if (i % batch_size != batch_size - 1) {
+      continue;
+    }
+
+    // While the next thread is behind, free what the previous one sent
+    while (true) {
+      {
+        std::lock_guard lock(next.mutex);
+        if (next.batches.size() < max_pending_batches) {
+          next.batches.push_back(batch);
+          break;
+        }
+      }
+      if (!freeBatches(resource, own, spare)) {
+        std::this_thread::yield();
+      }
+    }
+    freeBatches(resource, own, spare);
+  }
+
+  // Keeps freeing until the previous thread has sent everything, it may be
+  // waiting for room in the mailbox
+  running_threads.fetch_sub(1, std::memory_order_acq_rel);
+  while (running_threads.load(std::memory_order_acquire) != 0) {
+    if (!freeBatches(resource, own, spare)) {
+      std::this_thread::yield();
+    }
+  }
+  freeBatches(resource, own, spare);
+}
+
+// Returns millions of allocations per second over all threads
+double measure(std::pmr::memory_resource *resource, std::size_t thread_num,
+               FreeMode mode) {
+  std::barrier start_barrier(static_cast<std::ptrdiff_t>(thread_num + 1));
+  std::atomic<std::size_t> running_threads = thread_num;
+  std::vector<Mailbox> mailboxes(mode == FreeMode::NextThread ? thread_num
+                                                              : 0);
+  for (Mailbox &mailbox : mailboxes) {
+    mailbox.batches.reserve(max_pending_batches);
+  }
+  std::vector<std::jthread> threads;
+  threads.reserve(thread_num);
+  for (std::size_t i = 0; i < thread_num; ++i) {
+    threads.emplace_back([&, i]() {
+      const auto seed = static_cast<std::uint32_t>(i * 2654435761U + 1);
+      start_barrier.arrive_and_wait();
+      if (mode == FreeMode::SameThread) {
+        runThread(resource, seed);
+      } else {
+        runRingThread(resource, seed, mailboxes[i],
+                      mailboxes[(i + 1) % thread_num], running_threads);
+      }
+    });
+  }
+
+  start_barrier.arrive_and_wait();
+  const auto start = clock_type::now();
+  threads.clear();
+  const std::chrono::duration<double> elapsed = clock_type::now() - start;
+  return static_cast<double>(operations_per_thread * thread_num) /
+         elapsed.count() / 1e6;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::size_t thread_num = default_thread_num;
+  if (argc > 1) {
+    thread_num = std::max<std::size_t>(std::strtoul(argv[1], nullptr, 10), 1);
+  }
+
+  std::pmr::synchronized_pool_resource synchronized_pool;
+  const std::array<std::pair<std::string_view, std::pmr::memory_resource *>, 3>
+      resources{{{"synchronized_pool_resource", &synchronized_pool},
+                 {"new_delete_resource", std::pmr::new_delete_resource()},
+                 {"thread_local_pool_resource",
+                  qls::thread_local_pool_resource()}}};
+
+  std::cout << std::format("{} threads, {} hardware threads\n", thread_num,
+                           std::thread::hardware_concurrency());
+  for (const auto &[mode, title] :
+       {std::pair{FreeMode::SameThread, "freed by the allocating thread"},
+        std::pair{FreeMode::NextThread, "freed by the next thread"}}) {
+    std::cout << title << '\n';
+    for (const auto &[name, resource] : resources) {
+      std::cout << std::format("  {:<28} {:>8.2f} M allocations/s\n", name,
+                               measure(resource, thread_num, mode));
+    }
+  }
+  return 0;
+}
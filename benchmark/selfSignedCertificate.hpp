@@ -0,0 +1,50 @@
+#ifndef SELF_SIGNED_CERTIFICATE_HPP
+#define SELF_SIGNED_CERTIFICATE_HPP
+
+#include <memory>
+#include <stdexcept>
+
+#include <asio/ssl.hpp>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+namespace qls::benchmark {
+
+/**
+ * @brief Loads a throwaway self-signed P-256 certificate into a context.
+ * @details Lets the benchmarks run TLS without certificate files.
+ * @param context The server context.
+ */
+inline void useSelfSignedCertificate(asio::ssl::context &context) {
+  struct PkeyDeleter {
+    void operator()(EVP_PKEY *pkey) const noexcept { EVP_PKEY_free(pkey); }
+  };
+  struct X509Deleter {
+    void operator()(X509 *x509) const noexcept { X509_free(x509); }
+  };
+
+  std::unique_ptr<EVP_PKEY, PkeyDeleter> pkey(EVP_EC_gen("P-256"));
+  std::unique_ptr<X509, X509Deleter> x509(X509_new());
+  if (!pkey || !x509) {
+    throw std::runtime_error("could not create a certificate");
+  }
+
+  X509_gmtime_adj(X509_getm_notBefore(x509.get()), 0);
+  X509_gmtime_adj(X509_getm_notAfter(x509.get()), 24 * 60 * 60);
+  X509_set_pubkey(x509.get(), pkey.get());
+  X509_NAME *name = X509_get_subject_name(x509.get());
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             reinterpret_cast<const unsigned char *>("bench"),
+                             -1, -1, 0);
+  X509_set_issuer_name(x509.get(), name);
+  X509_sign(x509.get(), pkey.get(), EVP_sha256());
+
+  if (SSL_CTX_use_certificate(context.native_handle(), x509.get()) != 1 ||
+      SSL_CTX_use_PrivateKey(context.native_handle(), pkey.get()) != 1) {
+    throw std::runtime_error("could not use the certificate");
+  }
+}
+
+} // namespace qls::benchmark
+
+#endif // !SELF_SIGNED_CERTIFICATE_HPP
@@ -1,6 +1,7 @@
 #include "init.h"
 
 #include <bit>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
@@ -10,6 +11,8 @@
 #include "input.h"
 #include "manager.h"
 #include "network.h"
+#include "session_ticket_keys.hpp"
+#include "workerPool.hpp"
 
 extern Log::Logger serverLogger;
 extern qini::INIObject serverIni;
@@ -26,6 +29,12 @@ void Init::createConfig() {
     qini::INIObject ini;
     ini["server"]["host"] = "0.0.0.0";
     ini["server"]["port"] = std::to_string(Network::port_num);
+    ini["server"]["sharded_io"] = "false";
+    ini["server"]["kcp"] = "false";
+    ini["server"]["checksum"] = "false";
+    ini["server"]["worker_threads"] = "0";
+    ini["server"]["worker_queue_limit"] =
+        std::to_string(WorkerPool::default_max_queue_depth);
 
     ini["mysql"]["host"] = "127.0.0.1";
     ini["mysql"]["port"] = std::to_string(3306);
@@ -35,6 +44,11 @@ void Init::createConfig() {
     ini["ssl"]["certificate_file"] = "certs.pem";
     ini["ssl"]["password"] = "";
     ini["ssl"]["key_file"] = "key.pem";
+    ini["ssl"]["ticket_key_rotation"] = std::to_string(
+        session_ticket_keys::default_rotation_interval.count());
+    ini["ssl"]["ktls"] = "false";
+
+    ini["file"]["spool_path"] = "./spool";
 
     outfile << qini::INIWriter::fastWrite(ini);
   }
@@ -129,6 +143,17 @@ int init() {
             serverIni["ssl"]["certificate_file"]);
         ssl_context->use_private_key_file(serverIni["ssl"]["key_file"],
                                           asio::ssl::context::pem);
+
+        // Session tickets let reconnecting clients skip the full handshake
+        std::chrono::seconds rotation_interval =
+            session_ticket_keys::default_rotation_interval;
+        if (!serverIni["ssl"]["ticket_key_rotation"].empty()) {
+          rotation_interval = std::chrono::seconds(
+              std::stoll(serverIni["ssl"]["ticket_key_rotation"]));
+        }
+        session_ticket_keys::install(
+            ssl_context->native_handle(),
+            std::make_shared<session_ticket_keys>(rotation_interval));
         return ssl_context;
       });
       serverLogger.info("TLS configuration set successfully");
@@ -169,6 +194,22 @@ int init() {
       }
     }).detach();
 
+    serverNetwork.setShardedMode(serverIni["server"]["sharded_io"] == "true");
+    serverLogger.info("IO shards: ", serverNetwork.get_shard_count());
+    serverLogger.info("IO backend: ", Network::io_backend);
+    serverNetwork.setKernelTlsMode(serverIni["ssl"]["ktls"] == "true");
+    serverLogger.info("kTLS: ", serverIni["ssl"]["ktls"] == "true"
+                                    ? "enabled if supported"
+                                    : "disabled");
+    serverNetwork.setKcpMode(serverIni["server"]["kcp"] == "true");
+    serverLogger.info("KCP: ", serverIni["server"]["kcp"] == "true"
+                                   ? "enabled"
+                                   : "disabled");
+    serverNetwork.setChecksumMode(serverIni["server"]["checksum"] == "true");
+    serverLogger.info("CRC32C checksums: ",
+                      serverIni["server"]["checksum"] == "true"
+                          ? "granted when asked for"
+                          : "disabled");
     serverLogger.info(
         "Server listener starting at address: ", serverIni["server"]["host"],
         ":", serverIni["server"]["port"]);
@@ -1,14 +1,28 @@
 #include "JsonMsgProcess.h"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <format>
+#include <memory_resource>
+#include <ranges>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "JsonMsgProcessCommand.h"
+#include "JsonMsgRequest.h"
+#include "binaryCodec.hpp"
 #include "definition.hpp"
 #include "manager.h"
 #include "regexMatch.hpp"
 #include "returnStateMessage.hpp"
 
 #include "userid.hpp"
+#include "zstdCodec.hpp"
 #include <logger.hpp>
 #include <string>
 #include <string_view>
@@ -18,60 +32,196 @@ extern Log::Logger serverLogger;
 
 namespace qls {
 
+// -----------------------------------------------------------------------------------------------
+// Command table
+// -----------------------------------------------------------------------------------------------
+
+namespace {
+
+// Functions JsonMessageProcessImpl handles itself instead of a command
+enum class BuiltinFunction : std::uint8_t {
+  Command,
+  Login,
+  SetHeartbeatInterval,
+  SetPipelining,
+  DownloadFile,
+  Batch
+};
+
+struct CommandEntry {
+  std::string_view name;
+  BuiltinFunction function = BuiltinFunction::Command;
+  JsonMessageCommand *command = nullptr;
+  // Code of the command in Binary packages, 0 for none
+  std::uint32_t binary_code = 0;
+};
+
+RegisterCommand register_command;
+HasUserCommand has_user_command;
+SearchUserCommand search_user_command;
+AddFriendCommand add_friend_command;
+AddGroupCommand add_group_command;
+GetFriendListCommand get_friend_list_command;
+GetGroupListCommand get_group_list_command;
+SendFriendMessageCommand send_friend_message_command;
+SendGroupMessageCommand send_group_message_command;
+AcceptFriendVerificationCommand accept_friend_verification_command;
+GetFriendVerificationListCommand get_friend_verification_list_command;
+AcceptGroupVerificationCommand accept_group_verification_command;
+GetGroupVerificationListCommand get_group_verification_list_command;
+RejectFriendVerificationCommand reject_friend_verification_command;
+RejectGroupVerificationCommand reject_group_verification_command;
+CreateGroupCommand create_group_command;
+RemoveGroupCommand remove_group_command;
+LeaveGroupCommand leave_group_command;
+RemoveFriendCommand remove_friend_command;
+UploadFileCommand upload_file_command;
+ShareFileCommand share_file_command;
+
+constexpr std::array command_entries = {
+    CommandEntry{.name = "login", .function = BuiltinFunction::Login},
+    CommandEntry{.name = "set_heartbeat_interval",
+                 .function = BuiltinFunction::SetHeartbeatInterval},
+    CommandEntry{.name = "set_pipelining",
+                 .function = BuiltinFunction::SetPipelining},
+    CommandEntry{.name = "download_file",
+                 .function = BuiltinFunction::DownloadFile},
+    CommandEntry{.name = "batch", .function = BuiltinFunction::Batch},
+    CommandEntry{.name = "register", .command = &register_command},
+    CommandEntry{.name = "has_user", .command = &has_user_command},
+    CommandEntry{.name = "search_user", .command = &search_user_command},
+    CommandEntry{.name = "add_friend", .command = &add_friend_command},
+    CommandEntry{.name = "add_group", .command = &add_group_command},
+    CommandEntry{.name = "get_friend_list",
+                 .command = &get_friend_list_command},
+    CommandEntry{.name = "get_group_list", .command = &get_group_list_command},
+    CommandEntry{.name = "send_friend_message",
+                 .command = &send_friend_message_command,
+                 .binary_code = 1},
+    CommandEntry{.name = "send_group_message",
+                 .command = &send_group_message_command,
+                 .binary_code = 2},
+    CommandEntry{.name = "accept_friend_verification",
+                 .command = &accept_friend_verification_command},
+    CommandEntry{.name = "get_friend_verification_list",
+                 .command = &get_friend_verification_list_command},
+    CommandEntry{.name = "accept_group_verification",
+                 .command = &accept_group_verification_command},
+    CommandEntry{.name = "get_group_verification_list",
+                 .command = &get_group_verification_list_command},
+    CommandEntry{.name = "reject_friend_verification",
+                 .command = &reject_friend_verification_command},
+    CommandEntry{.name = "reject_group_verification",
+                 .command = &reject_group_verification_command},
+    CommandEntry{.name = "create_group", .command = &create_group_command},
+    CommandEntry{.name = "remove_group", .command = &remove_group_command},
+    CommandEntry{.name = "leave_group", .command = &leave_group_command},
+    CommandEntry{.name = "remove_friend", .command = &remove_friend_command},
+    CommandEntry{.name = "upload_file", .command = &upload_file_command},
+    CommandEntry{.name = "share_file", .command = &share_file_command},
+};
+
+// FNV-1a with a seed mixed into the offset basis
+constexpr std::uint32_t hashCommandName(std::string_view name,
+                                        std::uint32_t seed) noexcept {
+  std::uint32_t hash = 2166136261U ^ seed;
+  for (const char c : name) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 16777619U;
+  }
+  return hash ^ (hash >> 16);
+}
+
+constexpr std::size_t command_table_size =
+    std::bit_ceil(command_entries.size() * 2);
+constexpr std::uint8_t no_command = 0xff;
+constexpr std::uint32_t max_command_seed = 1U << 16;
+static_assert(command_entries.size() < no_command);
+
+// Slots index command_entries, empty slots hold no_command
+struct CommandTable {
+  std::uint32_t seed = 0;
+  std::array<std::uint8_t, command_table_size> slots{};
+};
+
+// Tries seeds until every name gets a slot of its own
+constexpr CommandTable command_table = []() {
+  CommandTable table;
+  for (; table.seed < max_command_seed; ++table.seed) {
+    table.slots.fill(no_command);
+    bool collided = false;
+    for (std::size_t i = 0; i < command_entries.size() && !collided; ++i) {
+      auto &slot = table.slots[hashCommandName(command_entries[i].name,
+                                               table.seed) %
+                               command_table_size];
+      collided = slot != no_command;
+      slot = static_cast<std::uint8_t>(i);
+    }
+    if (!collided) {
+      break;
+    }
+  }
+  return table;
+}();
+static_assert(command_table.seed < max_command_seed,
+              "Command names must be unique");
+
+// Binary packages index this table with the code directly
+constexpr auto binary_command_table = []() {
+  constexpr std::uint32_t max_code = std::ranges::max(
+      command_entries | std::views::transform(&CommandEntry::binary_code));
+  std::array<JsonMessageCommand *, max_code + 1> table{};
+  for (const auto &entry : command_entries) {
+    if (entry.binary_code != 0) {
+      table[entry.binary_code] = entry.command;
+    }
+  }
+  return table;
+}();
+
+// Finds a built-in function with one hash and one comparison
+const CommandEntry *findCommandEntry(std::string_view name) noexcept {
+  const auto index = command_table.slots[hashCommandName(name,
+                                                         command_table.seed) %
+                                         command_table_size];
+  if (index == no_command || command_entries[index].name != name) {
+    return nullptr;
+  }
+  return &command_entries[index];
+}
+
+// Built-in commands are static, so they are handed out without an owner and
+// the pointer never touches a reference count
+std::shared_ptr<JsonMessageCommand>
+borrowCommand(JsonMessageCommand *command) noexcept {
+  return {std::shared_ptr<JsonMessageCommand>(), command};
+}
+
+} // namespace
+
 // -----------------------------------------------------------------------------------------------
 // JsonMessageProcessCommandList
 // -----------------------------------------------------------------------------------------------
 
+/**
+ * @brief Commands registered at runtime, e.g. by plugins.
+ * @details Built-in functions are dispatched through the perfect hash table
+ * made at compile time, without locks. This list is only searched for names
+ * that aren't built in, and can't shadow a built-in name.
+ */
 class JsonMessageProcessCommandList {
 public:
-  JsonMessageProcessCommandList() {
-    auto init_command =
-        [&](std::string_view function_name,
-            const std::shared_ptr<JsonMessageCommand> &command_ptr) -> bool {
-      if (m_function_map.find(function_name) != m_function_map.cend() ||
-          !command_ptr) {
-        return false;
-      }
-
-      m_function_map.emplace(function_name, command_ptr);
-      return true;
-    };
-
-    init_command("register", std::make_shared<RegisterCommand>());
-    init_command("has_user", std::make_shared<HasUserCommand>());
-    init_command("search_user", std::make_shared<SearchUserCommand>());
-    init_command("add_friend", std::make_shared<AddFriendCommand>());
-    init_command("add_group", std::make_shared<AddGroupCommand>());
-    init_command("get_friend_list", std::make_shared<GetFriendListCommand>());
-    init_command("get_group_list", std::make_shared<GetGroupListCommand>());
-    init_command("send_friend_message",
-                 std::make_shared<SendFriendMessageCommand>());
-    init_command("send_group_message",
-                 std::make_shared<SendGroupMessageCommand>());
-    init_command("accept_friend_verification",
-                 std::make_shared<AcceptFriendVerificationCommand>());
-    init_command("get_friend_verification_list",
-                 std::make_shared<GetFriendVerificationListCommand>());
-    init_command("accept_group_verification",
-                 std::make_shared<AcceptGroupVerificationCommand>());
-    init_command("get_group_verification_list",
-                 std::make_shared<GetGroupVerificationListCommand>());
-    init_command("reject_friend_verification",
-                 std::make_shared<RejectFriendVerificationCommand>());
-    init_command("reject_group_verification",
-                 std::make_shared<RejectGroupVerificationCommand>());
-    init_command("create_group", std::make_shared<CreateGroupCommand>());
-    init_command("remove_group", std::make_shared<RemoveGroupCommand>());
-    init_command("leave_group", std::make_shared<LeaveGroupCommand>());
-    init_command("remove_friend", std::make_shared<RemoveFriendCommand>());
-  }
+  JsonMessageProcessCommandList() = default;
   ~JsonMessageProcessCommandList() = default;
 
   bool addCommand(std::string_view function_name,
-                  const std::shared_ptr<JsonMessageCommand> &command_ptr);
-  bool hasCommand(std::string_view function_name) const;
+                  std::shared_ptr<JsonMessageCommand> command_ptr);
+  /**
+   * @brief Gets a runtime command.
+   * @return The command, null if there is none with this name.
+   */
   std::shared_ptr<JsonMessageCommand>
-  getCommand(std::string_view function_name);
+  getCommand(std::string_view function_name) const;
   bool removeCommand(std::string_view function_name);
 
 private:
@@ -83,44 +233,34 @@ private:
 
 bool JsonMessageProcessCommandList::addCommand(
     std::string_view function_name,
-    const std::shared_ptr<JsonMessageCommand> &command_ptr) {
-  if (hasCommand(function_name) || !command_ptr) {
+    std::shared_ptr<JsonMessageCommand> command_ptr) {
+  if (!command_ptr || findCommandEntry(function_name)) {
     return false;
   }
 
-  std::unique_lock unique_lock1(m_function_map_mutex);
-  m_function_map.emplace(function_name, command_ptr);
-  return true;
+  std::unique_lock lock(m_function_map_mutex);
+  return m_function_map.emplace(function_name, std::move(command_ptr))
+      .second;
 }
 
-bool JsonMessageProcessCommandList::hasCommand(
+std::shared_ptr<JsonMessageCommand> JsonMessageProcessCommandList::getCommand(
     std::string_view function_name) const {
   std::shared_lock lock(m_function_map_mutex);
-  return m_function_map.find(function_name) != m_function_map.cend();
-}
-
-std::shared_ptr<JsonMessageCommand>
-JsonMessageProcessCommandList::getCommand(std::string_view function_name) {
-  std::shared_lock lock(m_function_map_mutex);
   auto iter = m_function_map.find(function_name);
   if (iter == m_function_map.cend()) {
-    throw std::system_error(make_error_code(qls_errc::null_pointer));
+    return nullptr;
   }
   return iter->second;
 }
 
 bool JsonMessageProcessCommandList::removeCommand(
     std::string_view function_name) {
-  if (!hasCommand(function_name)) {
-    return false;
-  }
-
-  std::unique_lock unique_lock1(m_function_map_mutex);
-  auto itor = m_function_map.find(function_name);
-  if (itor == m_function_map.end()) {
+  std::unique_lock lock(m_function_map_mutex);
+  auto iter = m_function_map.find(function_name);
+  if (iter == m_function_map.end()) {
     return false;
   }
-  m_function_map.erase(itor);
+  m_function_map.erase(iter);
   return true;
 }
 
@@ -140,20 +280,57 @@ public:
   UserID getLocalUserID() const;
 
   asio::awaitable<qjson::JObject>
-  processJsonMessage(const qjson::JObject &json,
-                     const SocketService &socket_service);
+  processJsonMessage(std::string_view data,
+                     const SocketService &socket_service,
+                     SocketService::RequestSequence sequence,
+                     bool in_batch = false);
+
+  asio::awaitable<std::string>
+  processBinaryMessage(std::string_view data,
+                       const SocketService &socket_service);
 
   qjson::JObject login(const UserID &user_id, std::string_view password,
-                       std::string_view device,
+                       std::string_view device, std::string_view compression,
+                       bool binary_protocol,
                        const SocketService &socket_service);
 
   static qjson::JObject login(std::string_view email, std::string_view password,
                               std::string_view device);
 
+  static qjson::JObject
+  setHeartbeatInterval(long long interval, const SocketService &socket_service);
+
+  static qjson::JObject setPipelining(long long max_requests,
+                                      const SocketService &socket_service);
+
+  static qjson::JObject
+  downloadFile(const UserID &user_id, long long file_id, long long offset,
+               const SocketService &socket_service,
+               SocketService::RequestSequence sequence);
+
 private:
+  // Requests a batch may carry
+  constexpr static std::size_t max_batch_size = 16;
+
+  asio::awaitable<qjson::JObject>
+  processBatch(const JsonParameter &requests,
+               const SocketService &socket_service,
+               SocketService::RequestSequence sequence);
+
+  static asio::awaitable<qjson::JObject>
+  executeCommand(std::shared_ptr<JsonMessageCommand> command_ptr,
+                 UserID user_id, const JsonParameters &param);
+
+  // Runs work that would block the io thread on the worker pool
+  template <typename Function>
+  static asio::awaitable<qjson::JObject> runOnWorkerPool(Function function);
+
+  static std::string makeBinaryResult(const qjson::JObject &result);
+
   UserID m_user_id;
   mutable std::shared_mutex m_user_id_mutex;
 
+public:
   static JsonMessageProcessCommandList m_jmpc_list;
 };
 
@@ -164,6 +341,17 @@ JsonMessageProcess::JsonMessageProcess(UserID user_id)
 
 JsonMessageProcess::~JsonMessageProcess() = default;
 
+bool JsonMessageProcess::registerCommand(
+    std::string_view function_name,
+    std::shared_ptr<JsonMessageCommand> command_ptr) {
+  return JsonMessageProcessImpl::m_jmpc_list.addCommand(
+      function_name, std::move(command_ptr));
+}
+
+bool JsonMessageProcess::unregisterCommand(std::string_view function_name) {
+  return JsonMessageProcessImpl::m_jmpc_list.removeCommand(function_name);
+}
+
 qjson::JObject
 JsonMessageProcessImpl::getUserPublicInfo(const UserID &user_id) {
   // Return user's public information
@@ -187,104 +375,138 @@ UserID JsonMessageProcessImpl::getLocalUserID() const {
 }
 
 asio::awaitable<qjson::JObject> JsonMessageProcessImpl::processJsonMessage(
-    const qjson::JObject &json, const SocketService &socket_service) {
+    std::string_view data, const SocketService &socket_service,
+    SocketService::RequestSequence sequence, bool in_batch) {
   try {
+    serverLogger.debug("Json body: ", std::string(data));
+    // The function is looked up as soon as it is parsed, so only the
+    // parameters its options name are kept. Built-in functions need no
+    // lock, only other names reach the runtime command list.
+    const CommandEntry *entry = nullptr;
+    std::shared_ptr<JsonMessageCommand> command_ptr;
+    JsonRequest request;
+    const auto status = request.parse(
+        data,
+        [&](std::string_view function_name) -> const JsonRequest::Options * {
+          entry = findCommandEntry(function_name);
+          command_ptr = entry ? borrowCommand(entry->command)
+                              : JsonMessageProcessImpl::m_jmpc_list.getCommand(
+                                    function_name);
+          return command_ptr ? &command_ptr->getOption() : nullptr;
+        });
     // Check whether the json pack is valid
-    serverLogger.debug("Json body: ", json.to_string());
-    if (json.getType() != qjson::JDict) {
+    switch (status) {
+    case JsonRequest::Success:
+      break;
+    case JsonRequest::InvalidJson:
+      co_return makeErrorMessage("Invalid json data!");
+    case JsonRequest::NotDict:
       co_return makeErrorMessage("The data body must be json dictory type!");
-    } else if (!json.hasMember("function")) {
+    case JsonRequest::LostFunction:
       co_return makeErrorMessage(
           "\"function\" must be included in json dictory!");
-    } else if (!json.hasMember("parameters")) {
+    case JsonRequest::LostParameters:
       co_return makeErrorMessage(
           "\"parameters\" must be included in json dictory!");
-    } else if (json["function"].getType() != qjson::JString) {
+    case JsonRequest::FunctionNotString:
       co_return makeErrorMessage("\"function\" must be string type!");
-    } else if (json["parameters"].getType() != qjson::JDict) {
+    case JsonRequest::ParametersNotDict:
       co_return makeErrorMessage("\"parameters\" must be dictory type!");
     }
-    std::string function_name = json["function"].getString();
-    qjson::JObject param = json["parameters"];
+    const JsonParameters &param = request.getParameters();
+    const BuiltinFunction function =
+        entry ? entry->function : BuiltinFunction::Command;
+
+    // Requests that change the state of the connection always wait for the
+    // requests before them and hold back the ones after them until they have
+    // finished, as do batches, which may carry such requests. Others only
+    // wait if the client asked for it.
+    const bool changes_state =
+        function == BuiltinFunction::Login ||
+        function == BuiltinFunction::SetHeartbeatInterval ||
+        function == BuiltinFunction::SetPipelining;
+    if (!in_batch && !changes_state && function != BuiltinFunction::Batch) {
+      socket_service.release_later_requests(sequence);
+    }
+    if (request.isOrdered() || changes_state) {
+      co_await socket_service.wait_for_earlier_requests(sequence);
+    }
 
     // Check if user has logined
     {
       std::shared_lock shared_lock1(m_user_id_mutex);
       // Check if userid == -1
-      if (m_user_id == UserID(-1) && function_name != "login" &&
-          (!m_jmpc_list.hasCommand(function_name) ||
-           static_cast<bool>(
-               m_jmpc_list.getCommand(function_name)->getCommandType() &
-               JsonMessageCommand::NormalType))) {
+      if (m_user_id == UserID(-1) && function != BuiltinFunction::Login &&
+          function != BuiltinFunction::SetHeartbeatInterval &&
+          function != BuiltinFunction::SetPipelining &&
+          function != BuiltinFunction::Batch &&
+          (!command_ptr ||
+           static_cast<bool>(command_ptr->getCommandType() &
+                             JsonMessageCommand::LoginType))) {
         co_return makeErrorMessage("You haven't logged in!");
       }
     }
 
-    if (function_name == "login") {
-      co_return login(UserID(param["user_id"].getInt()),
-                      param["password"].getString(),
-                      param["device"].getString(), socket_service);
+    switch (function) {
+    case BuiltinFunction::Login: {
+      // Compression is optional, older clients don't send it
+      const std::string_view compression =
+          param["compression"].is(qjson::JString)
+              ? param["compression"].getString()
+              : std::string_view();
+      const bool binary_protocol =
+          param["binary"].is(qjson::JBool) && param["binary"].getBool();
+      // Checking the password hashes it
+      co_return co_await runOnWorkerPool([&]() {
+        return login(UserID(param["user_id"].getInt()),
+                     param["password"].getString(),
+                     param["device"].getString(), compression,
+                     binary_protocol, socket_service);
+      });
+    }
+    case BuiltinFunction::SetHeartbeatInterval:
+      co_return setHeartbeatInterval(param["interval"].getInt(),
+                                     socket_service);
+    case BuiltinFunction::SetPipelining:
+      co_return setPipelining(param["max_requests"].getInt(), socket_service);
+    case BuiltinFunction::DownloadFile:
+      // Opens the file
+      co_return co_await runOnWorkerPool([&]() {
+        return downloadFile(getLocalUserID(), param["file_id"].getInt(),
+                            param["offset"].getInt(), socket_service,
+                            sequence);
+      });
+    case BuiltinFunction::Batch:
+      if (in_batch) {
+        co_return makeErrorMessage("A batch can't contain another batch!");
+      }
+      co_return co_await processBatch(param["requests"], socket_service,
+                                      sequence);
+    case BuiltinFunction::Command:
+      break;
     }
 
-    if (!m_jmpc_list.hasCommand(function_name)) {
+    if (!command_ptr) {
       co_return makeErrorMessage(
           "There isn't a function that matches the name!");
     }
 
-    // Find the command that matches the function name
-    auto command_ptr = m_jmpc_list.getCommand(function_name);
-    const qjson::dict_t &param_dict = param.getDict();
     // Check whether the type of json values match the options
     const auto &options = command_ptr->getOption();
     for (const auto &[name, type] : options) {
-      auto local_iter = param_dict.find(std::string_view(name));
-      if (local_iter == param_dict.cend()) {
+      const JsonParameter &value = param[name];
+      if (value.getType() == JsonParameter::Missing) {
         auto fmt = std::format("Lost a parameter: {}.", name);
         co_return makeErrorMessage(fmt);
       }
-      if (local_iter->second.getType() != type) {
+      if (!value.is(type)) {
         auto fmt = std::format("Wrong parameter type: {}.", name);
         co_return makeErrorMessage(fmt);
       }
     }
 
-    UserID user_id;
-    {
-      // Get the ID of this user
-      std::shared_lock id_lock(m_user_id_mutex);
-      user_id = m_user_id;
-    }
-
-    // This function is used to execute the command asynchronously
-    auto async_invoke = [](auto executor,
-                           std::shared_ptr<JsonMessageCommand> command_ptr,
-                           const UserID &user_id, qjson::JObject param,
-                           auto &&token) {
-      return asio::async_initiate<decltype(token),
-                                  void(std::error_code, qjson::JObject)>(
-          [](auto handler, auto executor,
-             std::shared_ptr<JsonMessageCommand> command_ptr, UserID user_id,
-             qjson::JObject param) {
-            asio::post(executor, [handler = std::move(handler),
-                                  command_ptr = std::move(command_ptr),
-                                  user_id = std::move(user_id),
-                                  param = std::move(param)]() mutable {
-              try {
-                handler({}, command_ptr->execute(user_id, std::move(param)));
-              } catch (const std::system_error &e) {
-                handler(e.code(), qjson::JObject{});
-              } catch (...) {
-                handler(std::error_code(asio::error::fault), qjson::JObject{});
-              }
-            });
-          },
-          token, std::move(executor), std::move(command_ptr), user_id,
-          std::move(param));
-    };
-
-    co_return co_await async_invoke(co_await asio::this_coro::executor,
-                                    std::move(command_ptr), user_id,
-                                    std::move(param), asio::use_awaitable);
+    co_return co_await executeCommand(std::move(command_ptr),
+                                      getLocalUserID(), param);
   } catch (const std::exception &e) {
 #ifndef _DEBUG
     co_return makeErrorMessage("Unknown error occured!");
@@ -295,9 +517,142 @@ asio::awaitable<qjson::JObject> JsonMessageProcessImpl::processJsonMessage(
   }
 }
 
+asio::awaitable<qjson::JObject> JsonMessageProcessImpl::processBatch(
+    const JsonParameter &requests, const SocketService &socket_service,
+    SocketService::RequestSequence sequence) {
+  if (!requests.is(qjson::JList)) {
+    co_return makeErrorMessage("\"requests\" must be list type!");
+  }
+  std::array<std::byte, 256> buffer;
+  std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size());
+  const auto entries = requests.getList(&arena);
+  if (entries.empty() || entries.size() > max_batch_size) {
+    co_return makeErrorMessage(std::format(
+        "A batch must carry 1 to {} requests!", max_batch_size));
+  }
+
+  // The requests run one after another in the order of the list, each one
+  // answers like a request of its own, and all answers go back in one
+  // response. A failed request doesn't stop the others.
+  auto returnJson = makeSuccessMessage("Successfully processed a batch!");
+  for (std::size_t i = 0; i < entries.size(); ++i) {
+    const std::string_view entry = entries[i];
+    if (i != 0) {
+      // The package paid for the first request, each other one costs a
+      // message of its own
+      co_await socket_service.limit_message_rate();
+    }
+    returnJson["results"].push_back(
+        co_await processJsonMessage(entry, socket_service, sequence, true));
+  }
+  co_return returnJson;
+}
+
+asio::awaitable<std::string> JsonMessageProcessImpl::processBinaryMessage(
+    std::string_view data, const SocketService &socket_service) {
+  try {
+    BinaryReader reader(data);
+    const std::uint64_t binary_code = reader.readVarint();
+    auto command_ptr = borrowCommand(
+        binary_code < binary_command_table.size()
+            ? binary_command_table[static_cast<std::size_t>(binary_code)]
+            : nullptr);
+    if (!command_ptr) {
+      co_return makeBinaryResult(
+          makeErrorMessage("There isn't a function that matches the code!"));
+    }
+
+    const UserID user_id = getLocalUserID();
+    if (user_id == UserID(-1) &&
+        static_cast<bool>(command_ptr->getCommandType() &
+                          JsonMessageCommand::LoginType)) {
+      co_return makeBinaryResult(makeErrorMessage("You haven't logged in!"));
+    }
+
+    // The fields follow in the order of the command's options, so the
+    // options are the schema of both encodings
+    JsonParameters param;
+    for (const auto &[name, type] : command_ptr->getOption()) {
+      switch (type) {
+      case qjson::JInt:
+        param.add(name, JsonParameter(
+                            static_cast<long long>(reader.readSigned())));
+        break;
+      case qjson::JString:
+        param.add(name, JsonParameter(reader.readString()));
+        break;
+      case qjson::JBool:
+        param.add(name, JsonParameter(reader.readBool()));
+        break;
+      default:
+        co_return makeBinaryResult(
+            makeErrorMessage("The function has no binary encoding!"));
+      }
+    }
+    if (!reader.empty()) {
+      throw std::system_error(qls_errc::invalid_data);
+    }
+
+    co_return makeBinaryResult(
+        co_await executeCommand(std::move(command_ptr), user_id, param));
+  } catch (const std::system_error &e) {
+    if (e.code() == qls_errc::invalid_data) {
+      co_return makeBinaryResult(makeErrorMessage("Invalid binary data!"));
+    }
+    co_return makeBinaryResult(makeErrorMessage("Unknown error occured!"));
+  } catch (const std::exception &) {
+    co_return makeBinaryResult(makeErrorMessage("Unknown error occured!"));
+  }
+}
+
+asio::awaitable<qjson::JObject> JsonMessageProcessImpl::executeCommand(
+    std::shared_ptr<JsonMessageCommand> command_ptr, UserID user_id,
+    const JsonParameters &param) {
+  if (command_ptr->getCostType() == JsonMessageCommand::CheapCost) {
+    // Cheap commands run inline on the connection
+    co_return command_ptr->execute(std::move(user_id), param);
+  }
+  // The parameters stay alive, the caller waits for the result
+  co_return co_await runOnWorkerPool(
+      [&command_ptr, &user_id, &param]() {
+        return command_ptr->execute(user_id, param);
+      });
+}
+
+template <typename Function>
+asio::awaitable<qjson::JObject>
+JsonMessageProcessImpl::runOnWorkerPool(Function function) {
+  auto &worker_pool = serverManager.getServerWorkerPool();
+  try {
+    co_return co_await worker_pool.async_run(std::move(function));
+  } catch (const std::system_error &e) {
+    if (e.code() != qls_errc::server_busy) {
+      throw;
+    }
+    serverLogger.warning("Worker pool is full (",
+                         worker_pool.get_queue_depth(), " pending, ",
+                         worker_pool.get_rejected_tasks(), " rejected)");
+    co_return makeErrorMessage("The server is busy, try again later!");
+  }
+}
+
+std::string JsonMessageProcessImpl::makeBinaryResult(
+    const qjson::JObject &result) {
+  // Binary commands only answer with their state and message
+  const auto state = result["state"].getString() == "success"
+                         ? BinaryResultState::Success
+                         : BinaryResultState::Error;
+  BinaryWriter writer;
+  writer.writeVarint(static_cast<std::uint32_t>(state))
+      .writeString(result["message"].getString());
+  return writer.release();
+}
+
 qjson::JObject
 JsonMessageProcessImpl::login(const UserID &user_id, std::string_view password,
                               std::string_view device,
+                              std::string_view compression,
+                              bool binary_protocol,
                               const SocketService &socket_service) {
   if (!serverManager.hasUser(user_id)) {
     return makeErrorMessage("The user ID or password is wrong!");
@@ -323,6 +678,16 @@ JsonMessageProcessImpl::login(const UserID &user_id, std::string_view password,
     }
 
     auto returnJson = makeSuccessMessage("Successfully logged in!");
+    if (compression == ZstdCodec::name) {
+      // This response is already sent compressed
+      socket_service.get_connection_ptr()->set_compression(true);
+      returnJson["compression"] = ZstdCodec::name;
+    }
+    if (binary_protocol) {
+      // Pushed messages are sent as Binary packages from now on
+      socket_service.get_connection_ptr()->set_binary_protocol(true);
+      returnJson["binary"] = true;
+    }
     std::unique_lock lock(m_user_id_mutex);
     this->m_user_id = user_id;
 
@@ -345,6 +710,63 @@ qjson::JObject JsonMessageProcessImpl::login(std::string_view email,
   return makeErrorMessage("This function is incomplete.");
 }
 
+qjson::JObject JsonMessageProcessImpl::setHeartbeatInterval(
+    long long interval, const SocketService &socket_service) {
+  // Idle clients may send fewer heartbeats, the connection's timeout grows
+  // with the interval
+  const auto seconds = std::chrono::seconds(std::clamp<long long>(
+      interval, SocketService::min_heart_beat_interval.count(),
+      SocketService::max_heart_beat_interval.count()));
+  socket_service.get_connection_ptr()->set_heartbeat_interval(seconds);
+
+  auto returnJson = makeSuccessMessage("Successfully set heartbeat interval!");
+  returnJson["interval"] = static_cast<long long>(seconds.count());
+  return returnJson;
+}
+
+qjson::JObject JsonMessageProcessImpl::setPipelining(
+    long long max_requests, const SocketService &socket_service) {
+  // Later requests no longer wait for this one, their responses may arrive
+  // in any order
+  const std::size_t accepted =
+      socket_service.set_max_requests(static_cast<std::size_t>(
+          std::clamp<long long>(max_requests, 1,
+                                static_cast<long long>(
+                                    SocketService::max_pipelined_requests))));
+
+  auto returnJson = makeSuccessMessage("Successfully set pipelining!");
+  returnJson["max_requests"] = static_cast<long long>(accepted);
+  return returnJson;
+}
+
+qjson::JObject JsonMessageProcessImpl::downloadFile(
+    const UserID &user_id, long long file_id, long long offset,
+    const SocketService &socket_service,
+    SocketService::RequestSequence sequence) {
+  if (file_id <= 0 || offset < 0 ||
+      offset % static_cast<long long>(FileManager::chunk_size) != 0) {
+    return makeErrorMessage("Invalid parameters!");
+  }
+
+  auto &file_manager = serverManager.getServerFileManager();
+  try {
+    // The file is read from disk while it is being sent, after this response
+    const auto first_chunk = static_cast<std::uint32_t>(
+        offset / static_cast<long long>(FileManager::chunk_size));
+    socket_service.send_after_response(
+        sequence,
+        file_manager.makeDownload(user_id, file_id, first_chunk,
+                                  serverManager.getServerWorkerPool()));
+    auto returnJson = makeSuccessMessage("Successfully started a download!");
+    returnJson["file_id"] = file_id;
+    returnJson["file_size"] =
+        static_cast<long long>(file_manager.getFileSize(file_id));
+    return returnJson;
+  } catch (const std::system_error &e) {
+    return makeErrorMessage(e.code().message());
+  }
+}
+
 // -----------------------------------------------------------------------------------------------
 // json process
 // -----------------------------------------------------------------------------------------------
@@ -354,9 +776,17 @@ UserID JsonMessageProcess::getLocalUserID() const {
 }
 
 asio::awaitable<qjson::JObject>
-JsonMessageProcess::processJsonMessage(const qjson::JObject &json,
-                                       const SocketService &socket_service) {
-  co_return co_await m_process->processJsonMessage(json, socket_service);
+JsonMessageProcess::processJsonMessage(
+    std::string_view data, const SocketService &socket_service,
+    SocketService::RequestSequence sequence) {
+  co_return co_await m_process->processJsonMessage(data, socket_service,
+                                                   sequence);
+}
+
+asio::awaitable<std::string>
+JsonMessageProcess::processBinaryMessage(std::string_view data,
+                                         const SocketService &socket_service) {
+  co_return co_await m_process->processBinaryMessage(data, socket_service);
 }
 
 } // namespace qls
@@ -4,12 +4,15 @@
 #include <Json.h>
 #include <asio.hpp>
 #include <memory>
+#include <string>
+#include <string_view>
 
 #include "socketFunctions.h"
 #include "userid.hpp"
 
 namespace qls {
 
+class JsonMessageCommand;
 class JsonMessageProcessImpl;
 
 class JsonMessageProcess final {
@@ -17,10 +20,34 @@ public:
   JsonMessageProcess(UserID user_id);
   ~JsonMessageProcess();
 
+  /**
+   * @brief Registers a command at runtime, e.g. from a plugin
+   * @details Built-in commands are looked up without a lock, registered ones
+   * only when a name isn't built in. May be called from any thread.
+   * @param function_name Name clients call the command by
+   * @param command_ptr The command
+   * @return false if the command is null or the name is already taken
+   */
+  static bool registerCommand(std::string_view function_name,
+                              std::shared_ptr<JsonMessageCommand> command_ptr);
+
+  /**
+   * @brief Removes a command registered with registerCommand
+   * @details Requests that already looked the command up keep it until they
+   * have finished.
+   * @param function_name Name of the command
+   * @return false if no command was registered with this name
+   */
+  static bool unregisterCommand(std::string_view function_name);
+
   UserID getLocalUserID() const;
   asio::awaitable<qjson::JObject>
-  processJsonMessage(const qjson::JObject &json,
-                     const SocketService &socket_service);
+  processJsonMessage(std::string_view data,
+                     const SocketService &socket_service,
+                     SocketService::RequestSequence sequence);
+  asio::awaitable<std::string>
+  processBinaryMessage(std::string_view data,
+                       const SocketService &socket_service);
 
 private:
   std::unique_ptr<JsonMessageProcessImpl> m_process;
@@ -3,6 +3,7 @@
 #include <logger.hpp>
 #include <unordered_set>
 
+#include "JsonMsgRequest.h"
 #include "groupid.hpp"
 #include "manager.h"
 #include "regexMatch.hpp"
@@ -15,9 +16,9 @@ extern Log::Logger serverLogger;
 namespace qls {
 
 qjson::JObject RegisterCommand::execute(UserID executor,
-                                        qjson::JObject parameters) {
-  std::string email = parameters["email"].getString();
-  std::string password = parameters["password"].getString();
+                                        const JsonParameters &parameters) {
+  std::string email(parameters["email"].getString());
+  std::string password(parameters["password"].getString());
 
   if (!RegexMatch::emailMatch(email)) {
     return makeErrorMessage("Email is invalid");
@@ -37,7 +38,7 @@ qjson::JObject RegisterCommand::execute(UserID executor,
 }
 
 qjson::JObject HasUserCommand::execute(UserID executor,
-                                       qjson::JObject parameters) {
+                                       const JsonParameters &parameters) {
   bool has_user = serverManager.hasUser(UserID(parameters["user_id"].getInt()));
   auto returnJson = makeSuccessMessage("Successfully get a result!");
   returnJson["has_user"] = has_user;
@@ -45,12 +46,12 @@ qjson::JObject HasUserCommand::execute(UserID executor,
 }
 
 qjson::JObject SearchUserCommand::execute(UserID executor,
-                                          qjson::JObject parameters) {
+                                          const JsonParameters &parameters) {
   return makeErrorMessage("This function is incomplete.");
 }
 
 qjson::JObject AddFriendCommand::execute(UserID executor,
-                                         qjson::JObject parameters) {
+                                         const JsonParameters &parameters) {
   UserID user_id = UserID(parameters["user_id"].getInt());
 
   if (!serverManager.hasUser(user_id)) {
@@ -68,7 +69,7 @@ qjson::JObject AddFriendCommand::execute(UserID executor,
 
 qjson::JObject
 AcceptFriendVerificationCommand::execute(UserID executor,
-                                         qjson::JObject parameters) {
+                                         const JsonParameters &parameters) {
   UserID user_id = UserID(parameters["user_id"].getInt());
 
   if (!serverManager.hasUser(user_id)) {
@@ -84,7 +85,7 @@ AcceptFriendVerificationCommand::execute(UserID executor,
 
 qjson::JObject
 RejectFriendVerificationCommand::execute(UserID executor,
-                                         qjson::JObject parameters) {
+                                         const JsonParameters &parameters) {
   UserID user_id = UserID(parameters["user_id"].getInt());
 
   if (!serverManager.hasUser(user_id)) {
@@ -101,7 +102,7 @@ RejectFriendVerificationCommand::execute(UserID executor,
 }
 
 qjson::JObject GetFriendListCommand::execute(UserID executor,
-                                             qjson::JObject parameters) {
+                                             const JsonParameters &parameters) {
   auto set = serverManager.getUser(executor)->getFriendList();
   qjson::JObject returnJson =
       makeSuccessMessage("Successfully obtained friend list!");
@@ -116,7 +117,7 @@ qjson::JObject GetFriendListCommand::execute(UserID executor,
 
 qjson::JObject
 GetFriendVerificationListCommand::execute(UserID executor,
-                                          qjson::JObject parameters) {
+                                          const JsonParameters &parameters) {
   auto map = serverManager.getUser(executor)->getFriendVerificationList();
   qjson::JObject localVector;
   for (const auto &[user_id, user_struct] : map) {
@@ -139,7 +140,7 @@ GetFriendVerificationListCommand::execute(UserID executor,
 }
 
 qjson::JObject RemoveFriendCommand::execute(UserID executor,
-                                            qjson::JObject parameters) {
+                                            const JsonParameters &parameters) {
   UserID user_id = UserID(parameters["user_id"].getInt());
 
   if (!serverManager.hasUser(user_id)) {
@@ -156,7 +157,7 @@ qjson::JObject RemoveFriendCommand::execute(UserID executor,
 }
 
 qjson::JObject AddGroupCommand::execute(UserID executor,
-                                        qjson::JObject parameters) {
+                                        const JsonParameters &parameters) {
   GroupID group_id = GroupID(parameters["group_id"].getInt());
 
   if (!serverManager.hasGroupRoom(group_id)) {
@@ -174,7 +175,7 @@ qjson::JObject AddGroupCommand::execute(UserID executor,
 
 qjson::JObject
 AcceptGroupVerificationCommand::execute(UserID executor,
-                                        qjson::JObject parameters) {
+                                        const JsonParameters &parameters) {
   GroupID group_id = GroupID(parameters["group_id"].getInt());
   UserID user_id = UserID(parameters["user_id"].getInt());
 
@@ -188,7 +189,7 @@ AcceptGroupVerificationCommand::execute(UserID executor,
 
 qjson::JObject
 RejectGroupVerificationCommand::execute(UserID executor,
-                                        qjson::JObject parameters) {
+                                        const JsonParameters &parameters) {
   GroupID group_id = GroupID(parameters["group_id"].getInt());
   UserID user_id = UserID(parameters["user_id"].getInt());
 
@@ -201,7 +202,7 @@ RejectGroupVerificationCommand::execute(UserID executor,
 }
 
 qjson::JObject GetGroupListCommand::execute(UserID executor,
-                                            qjson::JObject parameters) {
+                                            const JsonParameters &parameters) {
   auto set = std::move(serverManager.getUser(executor)->getGroupList());
   qjson::JObject returnJson =
       makeSuccessMessage("Successfully obtained group list!");
@@ -217,7 +218,7 @@ qjson::JObject GetGroupListCommand::execute(UserID executor,
 
 qjson::JObject
 GetGroupVerificationListCommand::execute(UserID executor,
-                                         qjson::JObject parameters) {
+                                         const JsonParameters &parameters) {
   auto map =
       std::move(serverManager.getUser(executor)->getGroupVerificationList());
   auto returnJson =
@@ -237,10 +238,11 @@ GetGroupVerificationListCommand::execute(UserID executor,
   return returnJson;
 }
 
-qjson::JObject SendFriendMessageCommand::execute(UserID executor,
-                                                 qjson::JObject parameters) {
+qjson::JObject
+SendFriendMessageCommand::execute(UserID executor,
+                                  const JsonParameters &parameters) {
   UserID user_id = UserID(parameters["user_id"].getInt());
-  std::string msg = parameters["message"].getString();
+  std::string msg(parameters["message"].getString());
 
   if (!serverManager.hasUser(user_id)) {
     return makeErrorMessage("UserID is invalid!");
@@ -261,10 +263,11 @@ qjson::JObject SendFriendMessageCommand::execute(UserID executor,
   return makeSuccessMessage("Successfully sent a message!");
 }
 
-qjson::JObject SendGroupMessageCommand::execute(UserID executor,
-                                                qjson::JObject parameters) {
+qjson::JObject
+SendGroupMessageCommand::execute(UserID executor,
+                                 const JsonParameters &parameters) {
   GroupID group_id = GroupID(parameters["group_id"].getInt());
-  std::string msg = parameters["message"].getString();
+  std::string msg(parameters["message"].getString());
 
   if (!serverManager.hasGroupRoom(group_id)) {
     return makeErrorMessage("GroupID is invalid!");
@@ -282,7 +285,7 @@ qjson::JObject SendGroupMessageCommand::execute(UserID executor,
 }
 
 qjson::JObject CreateGroupCommand::execute(UserID executor,
-                                           qjson::JObject parameters) {
+                                           const JsonParameters &parameters) {
   try {
     GroupID group_id = serverManager.getUser(executor)->createGroup();
     qjson::JObject json = makeSuccessMessage("Successfully create a group!");
@@ -294,7 +297,7 @@ qjson::JObject CreateGroupCommand::execute(UserID executor,
 }
 
 qjson::JObject RemoveGroupCommand::execute(UserID executor,
-                                           qjson::JObject parameters) {
+                                           const JsonParameters &parameters) {
   GroupID group_id = GroupID(parameters["group_id"].getInt());
   if (!serverManager.getUser(executor)->removeGroup(group_id)) {
     return makeErrorMessage("Failed to remove a group!");
@@ -303,7 +306,7 @@ qjson::JObject RemoveGroupCommand::execute(UserID executor,
 }
 
 qjson::JObject LeaveGroupCommand::execute(UserID executor,
-                                          qjson::JObject parameters) {
+                                          const JsonParameters &parameters) {
   GroupID group_id = GroupID(parameters["group_id"].getInt());
   if (!serverManager.getUser(executor)->leaveGroup(group_id)) {
     return makeErrorMessage("Failed to leave a group!");
@@ -311,4 +314,43 @@ qjson::JObject LeaveGroupCommand::execute(UserID executor,
   return makeSuccessMessage("Successfully left a group!");
 }
 
+qjson::JObject UploadFileCommand::execute(UserID executor,
+                                          const JsonParameters &parameters) {
+  const long long file_id = parameters["file_id"].getInt();
+  const long long file_size = parameters["file_size"].getInt();
+  if (file_id < 0 || file_size < 0) {
+    return makeErrorMessage("Invalid parameters!");
+  }
+
+  try {
+    // The chunks are sent as FileStream packages after this response
+    const auto [id, offset] = serverManager.getServerFileManager().startUpload(
+        executor, file_id, static_cast<std::uint64_t>(file_size));
+    qjson::JObject json = makeSuccessMessage("Successfully started an upload!");
+    json["file_id"] = id;
+    json["offset"] = static_cast<long long>(offset);
+    return json;
+  } catch (const std::system_error &e) {
+    return makeErrorMessage(e.code().message());
+  }
+}
+
+qjson::JObject ShareFileCommand::execute(UserID executor,
+                                         const JsonParameters &parameters) {
+  const long long file_id = parameters["file_id"].getInt();
+  const UserID user_id(parameters["user_id"].getInt());
+  if (!serverManager.hasUser(user_id)) {
+    return makeErrorMessage("UserID is invalid!");
+  }
+
+  try {
+    // Only the uploader may share a file
+    serverManager.getServerFileManager().shareFile(executor, file_id,
+                                                   user_id);
+    return makeSuccessMessage("Successfully shared a file!");
+  } catch (const std::system_error &e) {
+    return makeErrorMessage(e.code().message());
+  }
+}
+
 } // namespace qls
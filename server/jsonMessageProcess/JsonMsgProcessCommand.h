@@ -10,6 +10,8 @@
 
 namespace qls {
 
+class JsonParameters;
+
 class JsonMessageCommand {
 public:
   enum CommandType : std::int8_t {
@@ -17,6 +19,12 @@ public:
     LoginType = 1   // Use it if the function need to login.
   };
 
+  enum CostType : std::int8_t {
+    CheapCost = 0,   // Runs inline on the connection, it must not block.
+    CpuCost = 1,     // Runs on the worker pool, e.g. hashing passwords.
+    BlockingCost = 2 // Runs on the worker pool, e.g. disk or database.
+  };
+
   struct JsonOption {
     std::string name;
     qjson::JValueType jsonValueType;
@@ -27,8 +35,9 @@ public:
 
   virtual const std::vector<JsonOption> &getOption() const = 0;
   virtual int getCommandType() const = 0;
+  virtual int getCostType() const { return CheapCost; }
   virtual qjson::JObject execute(UserID executor,
-                                 qjson::JObject parameters) = 0;
+                                 const JsonParameters &parameters) = 0;
 };
 
 class RegisterCommand : public JsonMessageCommand {
@@ -44,7 +53,9 @@ public:
 
   int getCommandType() const { return NormalType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  int getCostType() const { return CpuCost; }
+
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class HasUserCommand : public JsonMessageCommand {
@@ -59,7 +70,7 @@ public:
 
   int getCommandType() const { return NormalType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class SearchUserCommand : public JsonMessageCommand {
@@ -74,7 +85,7 @@ public:
 
   int getCommandType() const { return NormalType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class AddFriendCommand : public JsonMessageCommand {
@@ -89,7 +100,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class AcceptFriendVerificationCommand : public JsonMessageCommand {
@@ -104,7 +115,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class RejectFriendVerificationCommand : public JsonMessageCommand {
@@ -119,7 +130,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class GetFriendListCommand : public JsonMessageCommand {
@@ -134,7 +145,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class GetFriendVerificationListCommand : public JsonMessageCommand {
@@ -149,7 +160,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class RemoveFriendCommand : public JsonMessageCommand {
@@ -164,7 +175,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class AddGroupCommand : public JsonMessageCommand {
@@ -179,7 +190,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class AcceptGroupVerificationCommand : public JsonMessageCommand {
@@ -195,7 +206,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class RejectGroupVerificationCommand : public JsonMessageCommand {
@@ -211,7 +222,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class GetGroupListCommand : public JsonMessageCommand {
@@ -226,7 +237,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class GetGroupVerificationListCommand : public JsonMessageCommand {
@@ -241,7 +252,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class CreateGroupCommand : public JsonMessageCommand {
@@ -256,7 +267,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class RemoveGroupCommand : public JsonMessageCommand {
@@ -271,7 +282,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class LeaveGroupCommand : public JsonMessageCommand {
@@ -286,7 +297,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class SendFriendMessageCommand : public JsonMessageCommand {
@@ -302,7 +313,7 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 class SendGroupMessageCommand : public JsonMessageCommand {
@@ -318,7 +329,43 @@ public:
 
   int getCommandType() const { return LoginType; }
 
-  qjson::JObject execute(UserID executor, qjson::JObject parameters);
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
+};
+
+class UploadFileCommand : public JsonMessageCommand {
+public:
+  UploadFileCommand() = default;
+  ~UploadFileCommand() = default;
+
+  const std::vector<JsonOption> &getOption() const {
+    static std::vector<JsonOption> vec = {{"file_id", qjson::JInt},
+                                          {"file_size", qjson::JInt}};
+    return vec;
+  }
+
+  int getCommandType() const { return LoginType; }
+
+  int getCostType() const { return BlockingCost; }
+
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
+};
+
+class ShareFileCommand : public JsonMessageCommand {
+public:
+  ShareFileCommand() = default;
+  ~ShareFileCommand() = default;
+
+  const std::vector<JsonOption> &getOption() const {
+    static std::vector<JsonOption> vec = {{"file_id", qjson::JInt},
+                                          {"user_id", qjson::JInt}};
+    return vec;
+  }
+
+  int getCommandType() const { return LoginType; }
+
+  int getCostType() const { return BlockingCost; }
+
+  qjson::JObject execute(UserID executor, const JsonParameters &parameters);
 };
 
 } // namespace qls
@@ -0,0 +1,551 @@
+#include "JsonMsgRequest.h"
+
+#include <algorithm>
+#include <charconv>
+#include <system_error>
+
+#include "qls_error.h"
+
+namespace qls {
+
+bool JsonParameter::is(qjson::JValueType type) const noexcept {
+  switch (type) {
+  case qjson::JInt:
+    return m_type == Int;
+  case qjson::JBool:
+    return m_type == Bool;
+  case qjson::JString:
+    return m_type == String;
+  case qjson::JList:
+    return m_type == List;
+  default:
+    // Other options are scalars
+    return false;
+  }
+}
+
+long long JsonParameter::getInt() const {
+  if (m_type != Int) {
+    throw std::system_error(qls_errc::invalid_data);
+  }
+  return m_int;
+}
+
+bool JsonParameter::getBool() const {
+  if (m_type != Bool) {
+    throw std::system_error(qls_errc::invalid_data);
+  }
+  return m_int != 0;
+}
+
+std::string_view JsonParameter::getString() const {
+  if (m_type != String) {
+    throw std::system_error(qls_errc::invalid_data);
+  }
+  return m_string;
+}
+
+std::pmr::vector<std::string_view>
+JsonParameter::getList(std::pmr::memory_resource *resource) const {
+  if (m_type != List) {
+    throw std::system_error(qls_errc::invalid_data);
+  }
+  std::pmr::vector<std::string_view> elements(resource);
+  auto addElement = [&](std::size_t begin, std::size_t end) {
+    const std::size_t first = m_string.find_first_not_of(" \t\n\r", begin);
+    if (first < end) {
+      const std::size_t last = m_string.find_last_not_of(" \t\n\r", end - 1);
+      elements.push_back(m_string.substr(first, last + 1 - first));
+    }
+  };
+
+  // The list was checked when it was parsed, so only strings and nesting
+  // have to be followed to find the commas between its elements
+  std::size_t depth = 0;
+  std::size_t begin = 1;
+  bool in_string = false;
+  for (std::size_t i = 1; i < m_string.size(); ++i) {
+    const char c = m_string[i];
+    if (in_string) {
+      if (c == '\\') {
+        ++i;
+      } else if (c == '"') {
+        in_string = false;
+      }
+      continue;
+    }
+    switch (c) {
+    case '"':
+      in_string = true;
+      break;
+    case '[':
+    case '{':
+      ++depth;
+      break;
+    case ']':
+    case '}':
+      if (depth == 0) {
+        addElement(begin, i);
+        return elements;
+      }
+      --depth;
+      break;
+    case ',':
+      if (depth == 0) {
+        addElement(begin, i);
+        begin = i + 1;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return elements;
+}
+
+const JsonParameter &
+JsonParameters::operator[](std::string_view name) const noexcept {
+  static const JsonParameter missing;
+  // Requests have a handful of parameters, the last one of a name wins
+  auto iter = std::find_if(m_members.crbegin(), m_members.crend(),
+                           [&](const auto &member) {
+                             return member.first == name;
+                           });
+  return iter == m_members.crend() ? missing : iter->second;
+}
+
+bool JsonParameters::hasMember(std::string_view name) const noexcept {
+  return (*this)[name].getType() != JsonParameter::Missing;
+}
+
+void JsonParameters::add(std::string_view name, const JsonParameter &value) {
+  m_members.emplace_back(name, value);
+}
+
+/**
+ * @brief Recursive descent parser filling a JsonRequest.
+ * @details Throws std::system_error with qls_errc::invalid_data on malformed
+ * JSON.
+ */
+class JsonRequestParser final {
+public:
+  constexpr static std::size_t max_depth = 64;
+
+  JsonRequestParser(std::string_view data, JsonRequest &request,
+                    const JsonRequest::OptionLookup &lookup) noexcept
+      : m_data(data), m_request(request), m_lookup(lookup) {}
+
+  JsonRequest::Status parse() {
+    skipWhitespace();
+    JsonRequest::Status status = JsonRequest::Success;
+    if (peek() == '{') {
+      status = parseRequest();
+    } else {
+      skipValue(0);
+      status = JsonRequest::NotDict;
+    }
+    skipWhitespace();
+    if (m_pos != m_data.size()) {
+      fail();
+    }
+    return status;
+  }
+
+private:
+  [[noreturn]] static void fail() {
+    throw std::system_error(qls_errc::invalid_data);
+  }
+
+  char peek() const {
+    if (m_pos >= m_data.size()) {
+      fail();
+    }
+    return m_data[m_pos];
+  }
+
+  void expect(char c) {
+    if (peek() != c) {
+      fail();
+    }
+    ++m_pos;
+  }
+
+  void expectWord(std::string_view word) {
+    if (m_data.substr(m_pos, word.size()) != word) {
+      fail();
+    }
+    m_pos += word.size();
+  }
+
+  void skipWhitespace() noexcept {
+    while (m_pos < m_data.size() &&
+           (m_data[m_pos] == ' ' || m_data[m_pos] == '\t' ||
+            m_data[m_pos] == '\n' || m_data[m_pos] == '\r')) {
+      ++m_pos;
+    }
+  }
+
+  JsonRequest::Status parseRequest() {
+    bool has_function = false;
+    bool function_is_string = false;
+    bool has_parameters = false;
+    bool parameters_is_dict = false;
+    const JsonRequest::Options *options = nullptr;
+
+    parseMembers([&](std::string_view key) {
+      if (key == "function") {
+        if (std::exchange(has_function, true)) {
+          fail();
+        }
+        function_is_string = peek() == '"';
+        if (!function_is_string) {
+          skipValue(1);
+          return;
+        }
+        m_request.m_function = parseString(true);
+        options = m_lookup ? m_lookup(m_request.m_function) : nullptr;
+      } else if (key == "parameters") {
+        if (std::exchange(has_parameters, true)) {
+          fail();
+        }
+        parameters_is_dict = peek() == '{';
+        if (!parameters_is_dict) {
+          skipValue(1);
+          return;
+        }
+        // Parameters before the function are all kept
+        parseParameters(has_function ? options : nullptr);
+      } else if (key == "ordered") {
+        // Optional, anything but true leaves the request unordered
+        const JsonParameter ordered = parseParameter(false);
+        m_request.m_ordered =
+            ordered.getType() == JsonParameter::Bool && ordered.getBool();
+      } else {
+        skipValue(1);
+      }
+    });
+
+    if (!has_function) {
+      return JsonRequest::LostFunction;
+    }
+    if (!has_parameters) {
+      return JsonRequest::LostParameters;
+    }
+    if (!function_is_string) {
+      return JsonRequest::FunctionNotString;
+    }
+    if (!parameters_is_dict) {
+      return JsonRequest::ParametersNotDict;
+    }
+    return JsonRequest::Success;
+  }
+
+  void parseParameters(const JsonRequest::Options *options) {
+    auto &parameters = m_request.m_parameters;
+    parseMembers([&](std::string_view key) {
+      if (!options) {
+        parameters.add(key, parseParameter(true));
+        return;
+      }
+      auto iter = std::find_if(
+          options->cbegin(), options->cend(),
+          [&](const auto &option) { return option.name == key; });
+      if (iter == options->cend()) {
+        // Not an option, nothing is stored
+        skipValue(2);
+        return;
+      }
+      parameters.add(key, parseParameter(iter->jsonValueType ==
+                                         qjson::JString));
+    });
+  }
+
+  // Calls member_handler with each key, it must consume the value
+  template <typename Function> void parseMembers(Function &&member_handler) {
+    expect('{');
+    skipWhitespace();
+    if (peek() == '}') {
+      ++m_pos;
+      return;
+    }
+    while (true) {
+      skipWhitespace();
+      const std::string_view key = parseString(true);
+      skipWhitespace();
+      expect(':');
+      skipWhitespace();
+      member_handler(key);
+      skipWhitespace();
+      if (peek() == ',') {
+        ++m_pos;
+        continue;
+      }
+      expect('}');
+      return;
+    }
+  }
+
+  JsonParameter parseParameter(bool keep_string) {
+    switch (peek()) {
+    case '"':
+      return JsonParameter(parseString(keep_string));
+    case 't':
+      expectWord("true");
+      return JsonParameter(true);
+    case 'f':
+      expectWord("false");
+      return JsonParameter(false);
+    case 'n':
+      expectWord("null");
+      return JsonParameter(JsonParameter::Null);
+    case '[': {
+      // Kept as text, it is only split when it is used
+      const std::size_t begin = m_pos;
+      skipValue(2);
+      return JsonParameter(JsonParameter::List,
+                           m_data.substr(begin, m_pos - begin));
+    }
+    case '{':
+      skipValue(2);
+      return JsonParameter(JsonParameter::Other);
+    default:
+      return parseNumber();
+    }
+  }
+
+  JsonParameter parseNumber() {
+    const std::size_t begin = m_pos;
+    auto skipDigits = [this]() {
+      const std::size_t digits_begin = m_pos;
+      while (m_pos < m_data.size() && m_data[m_pos] >= '0' &&
+             m_data[m_pos] <= '9') {
+        ++m_pos;
+      }
+      if (m_pos == digits_begin) {
+        fail();
+      }
+    };
+
+    if (peek() == '-') {
+      ++m_pos;
+    }
+    if (peek() == '0') {
+      ++m_pos;
+    } else {
+      skipDigits();
+    }
+    bool is_integer = true;
+    if (m_pos < m_data.size() && m_data[m_pos] == '.') {
+      ++m_pos;
+      skipDigits();
+      is_integer = false;
+    }
+    if (m_pos < m_data.size() &&
+        (m_data[m_pos] == 'e' || m_data[m_pos] == 'E')) {
+      ++m_pos;
+      if (peek() == '+' || peek() == '-') {
+        ++m_pos;
+      }
+      skipDigits();
+      is_integer = false;
+    }
+
+    long long value = 0;
+    if (is_integer) {
+      const auto [ptr, errc] = std::from_chars(m_data.data() + begin,
+                                               m_data.data() + m_pos, value);
+      if (errc == std::errc{}) {
+        return JsonParameter(value);
+      }
+    }
+    // Too large or not an integer
+    return JsonParameter(JsonParameter::Other);
+  }
+
+  /**
+   * @brief Parses a string.
+   * @param keep False to only check the string, an empty view is returned.
+   * @return A view into the data, or into the arena if it had escapes.
+   */
+  std::string_view parseString(bool keep) {
+    expect('"');
+    const std::size_t begin = m_pos;
+    bool has_escape = false;
+    while (true) {
+      const char c = peek();
+      if (c == '"') {
+        break;
+      }
+      if (static_cast<unsigned char>(c) < 0x20) {
+        fail();
+      }
+      if (c == '\\') {
+        has_escape = true;
+        ++m_pos;
+        if (peek() == 'u') {
+          m_pos += 4;
+        }
+      }
+      ++m_pos;
+    }
+    const std::string_view raw = m_data.substr(begin, m_pos - begin);
+    ++m_pos;
+    if (!has_escape) {
+      return keep ? raw : std::string_view{};
+    }
+    // Unescaped text is never longer than the escaped one
+    char *buffer = keep ? static_cast<char *>(
+                              m_request.m_parameters.getArena()->allocate(
+                                  raw.size(), 1))
+                        : nullptr;
+    const std::size_t size = unescape(raw, buffer);
+    return keep ? std::string_view(buffer, size) : std::string_view{};
+  }
+
+  // Writes the unescaped string to buffer unless it is null
+  static std::size_t unescape(std::string_view raw, char *buffer) {
+    std::size_t size = 0;
+    auto put = [&](char c) {
+      if (buffer) {
+        buffer[size] = c;
+      }
+      ++size;
+    };
+
+    for (std::size_t i = 0; i < raw.size(); ++i) {
+      if (raw[i] != '\\') {
+        put(raw[i]);
+        continue;
+      }
+      switch (raw[++i]) {
+      case '"':
+      case '\\':
+      case '/':
+        put(raw[i]);
+        break;
+      case 'b':
+        put('\b');
+        break;
+      case 'f':
+        put('\f');
+        break;
+      case 'n':
+        put('\n');
+        break;
+      case 'r':
+        put('\r');
+        break;
+      case 't':
+        put('\t');
+        break;
+      case 'u': {
+        std::uint32_t code = loadHex(raw, i + 1);
+        i += 4;
+        if (code >= 0xd800 && code < 0xdc00) {
+          // A high surrogate must be followed by a low one
+          if (raw.substr(i + 1, 2) != "\\u") {
+            fail();
+          }
+          const std::uint32_t low = loadHex(raw, i + 3);
+          if (low < 0xdc00 || low >= 0xe000) {
+            fail();
+          }
+          code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+          i += 6;
+        } else if (code >= 0xdc00 && code < 0xe000) {
+          fail();
+        }
+        putUtf8(code, put);
+        break;
+      }
+      default:
+        fail();
+      }
+    }
+    return size;
+  }
+
+  static std::uint32_t loadHex(std::string_view raw, std::size_t pos) {
+    std::uint32_t code = 0;
+    if (pos + 4 > raw.size()) {
+      fail();
+    }
+    const auto [ptr, errc] =
+        std::from_chars(raw.data() + pos, raw.data() + pos + 4, code, 16);
+    if (errc != std::errc{} || ptr != raw.data() + pos + 4) {
+      fail();
+    }
+    return code;
+  }
+
+  // \uXXXX escapes take at least as many bytes as their UTF-8 encoding
+  template <typename Put>
+  static void putUtf8(std::uint32_t code, Put &&put) {
+    if (code < 0x80) {
+      put(static_cast<char>(code));
+    } else if (code < 0x800) {
+      put(static_cast<char>(0xc0 | (code >> 6)));
+      put(static_cast<char>(0x80 | (code & 0x3f)));
+    } else if (code < 0x10000) {
+      put(static_cast<char>(0xe0 | (code >> 12)));
+      put(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+      put(static_cast<char>(0x80 | (code & 0x3f)));
+    } else {
+      put(static_cast<char>(0xf0 | (code >> 18)));
+      put(static_cast<char>(0x80 | ((code >> 12) & 0x3f)));
+      put(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+      put(static_cast<char>(0x80 | (code & 0x3f)));
+    }
+  }
+
+  // Checks a value without keeping anything
+  void skipValue(std::size_t depth) {
+    if (depth > max_depth) {
+      fail();
+    }
+    switch (peek()) {
+    case '{':
+      parseMembers([&](std::string_view) { skipValue(depth + 1); });
+      return;
+    case '[':
+      ++m_pos;
+      skipWhitespace();
+      if (peek() == ']') {
+        ++m_pos;
+        return;
+      }
+      while (true) {
+        skipWhitespace();
+        skipValue(depth + 1);
+        skipWhitespace();
+        if (peek() == ',') {
+          ++m_pos;
+          continue;
+        }
+        expect(']');
+        return;
+      }
+    default:
+      parseParameter(false);
+    }
+  }
+
+  std::string_view m_data;
+  std::size_t m_pos = 0;
+  JsonRequest &m_request;
+  const JsonRequest::OptionLookup &m_lookup;
+};
+
+JsonRequest::Status JsonRequest::parse(std::string_view data,
+                                       const OptionLookup &lookup) {
+  try {
+    return JsonRequestParser(data, *this, lookup).parse();
+  } catch (const std::system_error &e) {
+    if (e.code() != qls_errc::invalid_data) {
+      throw;
+    }
+    return InvalidJson;
+  }
+}
+
+} // namespace qls
@@ -0,0 +1,191 @@
+#ifndef JSON_MESSAGE_REQUEST_H
+#define JSON_MESSAGE_REQUEST_H
+
+#include <Json.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory_resource>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "JsonMsgProcessCommand.h"
+
+namespace qls {
+
+/**
+ * @brief A scalar parameter of a request.
+ * @details Strings are views into the request or into the arena of its
+ * JsonParameters. Getters throw std::system_error with qls_errc::invalid_data
+ * if the parameter is missing or has another type.
+ */
+class JsonParameter final {
+public:
+  enum Type : std::int8_t {
+    Missing = 0,
+    Null,
+    Int,
+    Bool,
+    String,
+    List,
+    Other // Numbers that aren't integers and dictionaries
+  };
+
+  JsonParameter() noexcept = default;
+  explicit JsonParameter(Type type) noexcept : m_type(type) {}
+  explicit JsonParameter(long long value) noexcept
+      : m_type(Int), m_int(value) {}
+  explicit JsonParameter(bool value) noexcept
+      : m_type(Bool), m_int(value ? 1 : 0) {}
+  explicit JsonParameter(std::string_view value) noexcept
+      : m_type(String), m_string(value) {}
+  /// A parameter whose value is kept as JSON text, such as a List
+  JsonParameter(Type type, std::string_view text) noexcept
+      : m_type(type), m_string(text) {}
+
+  [[nodiscard]] Type getType() const noexcept { return m_type; }
+
+  /**
+   * @brief Checks if the parameter has the type of a command option.
+   */
+  [[nodiscard]] bool is(qjson::JValueType type) const noexcept;
+
+  [[nodiscard]] long long getInt() const;
+  [[nodiscard]] bool getBool() const;
+  [[nodiscard]] std::string_view getString() const;
+
+  /**
+   * @brief Splits a list into its elements.
+   * @param resource Memory of the returned vector.
+   * @return The JSON text of each element, views into the request.
+   */
+  [[nodiscard]] std::pmr::vector<std::string_view>
+  getList(std::pmr::memory_resource *resource) const;
+
+private:
+  Type m_type = Missing;
+  long long m_int = 0;
+  std::string_view m_string;
+};
+
+/**
+ * @class JsonParameters
+ * @brief Read-only parameters of one request.
+ * @details Parameters are views into the request payload. Strings that had
+ * to be unescaped and the member list live in an arena owned by this object,
+ * which starts in an inline buffer, so a typical request needs no heap
+ * allocation and is released as a whole.
+ */
+class JsonParameters final {
+public:
+  JsonParameters() = default;
+  JsonParameters(const JsonParameters &) = delete;
+  JsonParameters(JsonParameters &&) = delete;
+  ~JsonParameters() noexcept = default;
+
+  JsonParameters &operator=(const JsonParameters &) = delete;
+  JsonParameters &operator=(JsonParameters &&) = delete;
+
+  /**
+   * @brief Gets a parameter, a Missing one if there is none with this name.
+   */
+  [[nodiscard]] const JsonParameter &
+  operator[](std::string_view name) const noexcept;
+
+  [[nodiscard]] bool hasMember(std::string_view name) const noexcept;
+
+  /**
+   * @brief Adds a parameter, it hides earlier ones with the same name.
+   * @param name The name, it must outlive this object.
+   * @param value The parameter, its string must outlive this object.
+   */
+  void add(std::string_view name, const JsonParameter &value);
+
+  /**
+   * @brief Removes every parameter, the arena keeps its memory.
+   */
+  void clear() noexcept { m_members.clear(); }
+
+  /**
+   * @brief Gets the arena of the request.
+   */
+  [[nodiscard]] std::pmr::memory_resource *getArena() noexcept {
+    return &m_arena;
+  }
+
+private:
+  std::array<std::byte, 1024> m_buffer;
+  std::pmr::monotonic_buffer_resource m_arena{m_buffer.data(),
+                                              m_buffer.size()};
+  std::pmr::vector<std::pair<std::string_view, JsonParameter>> m_members{
+      &m_arena};
+};
+
+/**
+ * @class JsonRequest
+ * @brief Parses {"function": ..., "parameters": {...}} without a DOM.
+ * @details The request is parsed in one pass straight from the payload.
+ * Once the function is known, only the parameters its options name are
+ * kept, so other members are checked for valid syntax but never stored.
+ * The payload must outlive the request.
+ */
+class JsonRequest final {
+public:
+  using Options = std::vector<JsonMessageCommand::JsonOption>;
+  /// Finds the options of a function, null to keep every parameter
+  using OptionLookup = std::function<const Options *(std::string_view)>;
+
+  enum Status : std::int8_t {
+    Success = 0,
+    InvalidJson,
+    NotDict,
+    LostFunction,
+    LostParameters,
+    FunctionNotString,
+    ParametersNotDict
+  };
+
+  JsonRequest() = default;
+  JsonRequest(const JsonRequest &) = delete;
+  JsonRequest(JsonRequest &&) = delete;
+  ~JsonRequest() noexcept = default;
+
+  JsonRequest &operator=(const JsonRequest &) = delete;
+  JsonRequest &operator=(JsonRequest &&) = delete;
+
+  /**
+   * @brief Parses a request.
+   * @param data The JSON text.
+   * @param lookup Called once with the function name as soon as it has been
+   * parsed.
+   * @return Success, or the first problem with the request.
+   */
+  Status parse(std::string_view data, const OptionLookup &lookup);
+
+  [[nodiscard]] std::string_view getFunction() const noexcept {
+    return m_function;
+  }
+
+  [[nodiscard]] const JsonParameters &getParameters() const noexcept {
+    return m_parameters;
+  }
+
+  /**
+   * @brief Checks if the request asked to run after the requests before it.
+   * @details Set by an optional "ordered": true next to the function.
+   */
+  [[nodiscard]] bool isOrdered() const noexcept { return m_ordered; }
+
+private:
+  friend class JsonRequestParser;
+
+  std::string_view m_function;
+  bool m_ordered = false;
+  JsonParameters m_parameters;
+};
+
+} // namespace qls
+
+#endif // !JSON_MESSAGE_REQUEST_H
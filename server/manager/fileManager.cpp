@@ -0,0 +1,491 @@
+#include "fileManager.h"
+
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "dataPackage.hpp"
+#include "frame.hpp"
+#include "qls_error.h"
+#include "returnStateMessage.hpp"
+
+namespace qls {
+
+namespace {
+
+// Number of chunks of a file, at least one so empty files have a package
+std::uint32_t getChunkNum(std::uint64_t file_size) noexcept {
+  return static_cast<std::uint32_t>(std::max<std::uint64_t>(
+      (file_size + FileManager::chunk_size - 1) / FileManager::chunk_size,
+      1));
+}
+
+/**
+ * @brief Reads a file from disk one chunk per fragment.
+ * @details Chunks are read on the worker pool. Once a chunk has been handed
+ * out the next one is read while it is being written, so the strand of the
+ * connection only waits for the disk if the socket is faster than it.
+ */
+class FileFragmentSource final : public BasicConnection::FragmentSource {
+public:
+  FileFragmentSource(const std::filesystem::path &path, long long file_id,
+                     std::uint64_t file_size, std::uint32_t sequence,
+                     WorkerPool &worker_pool)
+      : m_state(std::make_shared<State>(path, file_size, sequence)),
+        m_file_id(file_id), m_sequence_size(getChunkNum(file_size)),
+        m_sequence(sequence), m_worker_pool(worker_pool) {
+    if (!m_state->file) {
+      throw std::system_error(qls_errc::file_not_existed);
+    }
+    m_state->file.seekg(static_cast<std::streamoff>(
+        sequence * static_cast<std::uint64_t>(FileManager::chunk_size)));
+  }
+
+  asio::awaitable<FramePtr> async_next_fragment() override {
+    if (m_sequence >= m_sequence_size) {
+      co_return nullptr;
+    }
+
+    auto executor = co_await asio::this_coro::executor;
+    for (std::size_t retries = 0;; ++retries) {
+      if (!m_prefetching) {
+        startRead(executor);
+      }
+      if (!m_state->done) {
+        // Woken up by the read cancelling the timer
+        std::error_code errorc;
+        co_await m_state->ready_timer->async_wait(
+            asio::redirect_error(asio::use_awaitable, errorc));
+      }
+      m_prefetching = false;
+      if (!m_state->error) {
+        break;
+      }
+
+      std::error_code error = std::make_error_code(std::errc::io_error);
+      try {
+        std::rethrow_exception(std::exchange(m_state->error, nullptr));
+      } catch (const std::system_error &e) {
+        error = e.code();
+      } catch (...) {
+      }
+      if (error != qls_errc::server_busy || retries == max_busy_retries) {
+        // The client is told instead of the stream just stopping, so it
+        // can tell a failed read from a short file and resume from here
+        co_return makeErrorFragment(error);
+      }
+      // The read never started, try again once the pool had time to drain
+      asio::steady_timer timer(executor, busy_retry_delay);
+      co_await timer.async_wait(asio::use_awaitable);
+    }
+
+    FramePtr fragment = Frame::makeFrame(
+        std::move(m_state->chunk), DataPackage::FileStream, m_sequence_size,
+        m_sequence++, m_file_id);
+    if (m_sequence < m_sequence_size) {
+      startRead(executor);
+    }
+    co_return fragment;
+  }
+
+private:
+  // How often and after how long a read the worker pool rejected is retried
+  constexpr static std::size_t max_busy_retries = 20;
+  constexpr static auto busy_retry_delay = std::chrono::milliseconds(50);
+
+  // Ends the stream with an error tagged with the id of the file
+  FramePtr makeErrorFragment(const std::error_code &error) {
+    auto returnJson = makeErrorMessage(error.message());
+    returnJson["file_id"] = m_file_id;
+    returnJson["offset"] = static_cast<long long>(
+        m_sequence * static_cast<std::uint64_t>(FileManager::chunk_size));
+    m_sequence = m_sequence_size;
+    return Frame::makeFrame(returnJson.to_string(), DataPackage::Text, 1, 0,
+                            m_file_id);
+  }
+
+  // Shared with the read in flight, which may outlive the source
+  struct State {
+    State(const std::filesystem::path &path, std::uint64_t file_size,
+          std::uint32_t sequence)
+        : file(path, std::ios::binary), file_size(file_size),
+          sequence(sequence) {}
+
+    std::ifstream file;
+    const std::uint64_t file_size;
+    std::uint32_t sequence;
+    std::string chunk;
+    std::exception_ptr error;
+    bool done = false;
+    std::unique_ptr<asio::steady_timer> ready_timer;
+  };
+
+  void startRead(const asio::any_io_executor &executor) {
+    m_prefetching = true;
+    m_state->done = false;
+    if (!m_state->ready_timer) {
+      m_state->ready_timer = std::make_unique<asio::steady_timer>(executor);
+    }
+    m_state->ready_timer->expires_at(asio::steady_timer::time_point::max());
+    asio::co_spawn(
+        executor,
+        [state = m_state, &worker_pool = m_worker_pool]()
+            -> asio::awaitable<void> {
+          try {
+            state->chunk = co_await worker_pool.async_run([state]() {
+              const std::uint64_t offset =
+                  state->sequence *
+                  static_cast<std::uint64_t>(FileManager::chunk_size);
+              std::string data(
+                  static_cast<std::size_t>(std::min<std::uint64_t>(
+                      FileManager::chunk_size, state->file_size - offset)),
+                  '\0');
+              if (!state->file.read(data.data(),
+                                    static_cast<std::streamsize>(
+                                        data.size()))) {
+                throw std::system_error(
+                    std::make_error_code(std::errc::io_error));
+              }
+              ++state->sequence;
+              return data;
+            });
+          } catch (...) {
+            state->error = std::current_exception();
+          }
+          // Back on the strand of the connection
+          state->done = true;
+          state->ready_timer->cancel();
+        },
+        asio::detached);
+  }
+
+  std::shared_ptr<State> m_state;
+  const long long m_file_id;
+  const std::uint32_t m_sequence_size;
+  std::uint32_t m_sequence;
+  WorkerPool &m_worker_pool;
+  bool m_prefetching = false;
+};
+
+} // namespace
+
+struct Upload {
+  UserID owner;
+  std::uint64_t file_size = 0;
+  std::uint32_t next_sequence = 0;
+  std::ofstream file;
+  std::chrono::steady_clock::time_point last_activity =
+      std::chrono::steady_clock::now();
+  std::mutex mutex;
+};
+
+// Who may download a complete file
+struct FileAccess {
+  UserID owner;
+  std::unordered_set<UserID> readers;
+};
+
+struct FileManager::FileManagerImpl {
+  std::filesystem::path m_spool_path;
+
+  std::unordered_map<long long, std::shared_ptr<Upload>> m_upload_map;
+  mutable std::shared_mutex m_upload_map_mutex;
+
+  std::unordered_map<long long, FileAccess> m_access_map;
+  mutable std::shared_mutex m_access_map_mutex;
+
+  std::filesystem::path getFilePath(long long file_id) const {
+    return m_spool_path / std::format("{:016x}", file_id);
+  }
+
+  std::filesystem::path getPartPath(long long file_id) const {
+    return m_spool_path / std::format("{:016x}.part", file_id);
+  }
+
+  // The owner on the first line, then one reader per line
+  std::filesystem::path getAccessPath(long long file_id) const {
+    return m_spool_path / std::format("{:016x}.acl", file_id);
+  }
+
+  // Replaces the access list of a file on disk in one rename
+  void writeAccess(long long file_id, const FileAccess &access) const {
+    const auto part_path =
+        m_spool_path / std::format("{:016x}.acl.part", file_id);
+    {
+      std::ofstream file(part_path, std::ios::trunc);
+      file << access.owner.getOriginValue() << '\n';
+      for (const UserID &reader : access.readers) {
+        file << reader.getOriginValue() << '\n';
+      }
+      file.flush();
+      if (!file) {
+        throw std::system_error(std::make_error_code(std::errc::io_error));
+      }
+    }
+    std::filesystem::rename(part_path, getAccessPath(file_id));
+  }
+
+  void loadAccess(const std::filesystem::path &path) {
+    long long file_id = 0;
+    const auto name = path.stem().string();
+    const auto [end, errorc] = std::from_chars(
+        name.data(), name.data() + name.size(), file_id, 16);
+    if (errorc != std::errc() || end != name.data() + name.size()) {
+      return;
+    }
+    std::ifstream file(path);
+    long long user_id = 0;
+    if (!(file >> user_id)) {
+      return;
+    }
+    FileAccess access{.owner = UserID(user_id)};
+    while (file >> user_id) {
+      access.readers.emplace(user_id);
+    }
+    m_access_map.insert_or_assign(file_id, std::move(access));
+  }
+
+  void checkReadable(const UserID &user_id, long long file_id) const {
+    std::shared_lock lock(m_access_map_mutex);
+    auto iter = m_access_map.find(file_id);
+    // Files of others look like missing ones, so ids can't be probed
+    if (iter == m_access_map.cend() ||
+        (iter->second.owner != user_id &&
+         !iter->second.readers.contains(user_id))) {
+      throw std::system_error(qls_errc::file_not_existed);
+    }
+  }
+
+  std::shared_ptr<Upload> getUpload(const UserID &user_id,
+                                    long long file_id) const {
+    std::shared_lock lock(m_upload_map_mutex);
+    auto iter = m_upload_map.find(file_id);
+    if (iter == m_upload_map.cend() || iter->second->owner != user_id) {
+      throw std::system_error(qls_errc::file_not_existed);
+    }
+    return iter->second;
+  }
+
+  // Must be called with the upload's mutex held
+  void finishUpload(long long file_id, Upload &upload) {
+    upload.file.close();
+    // Written first, a file without one can't be downloaded by anyone
+    FileAccess access{.owner = upload.owner};
+    writeAccess(file_id, access);
+    std::filesystem::rename(getPartPath(file_id), getFilePath(file_id));
+    {
+      std::unique_lock lock(m_access_map_mutex);
+      m_access_map.insert_or_assign(file_id, std::move(access));
+    }
+    std::unique_lock lock(m_upload_map_mutex);
+    m_upload_map.erase(file_id);
+  }
+
+  void removeExpiredUploads() {
+    const auto expired_time =
+        std::chrono::steady_clock::now() - FileManager::upload_idle_timeout;
+    std::vector<long long> expired_ids;
+    {
+      std::unique_lock lock(m_upload_map_mutex);
+      std::erase_if(m_upload_map, [&](const auto &iter) {
+        // An upload that is being written to isn't idle
+        std::unique_lock upload_lock(iter.second->mutex, std::try_to_lock);
+        if (!upload_lock.owns_lock() ||
+            iter.second->last_activity > expired_time) {
+          return false;
+        }
+        // Chunks that still arrive fail to be written
+        iter.second->file.close();
+        expired_ids.push_back(iter.first);
+        return true;
+      });
+    }
+    for (long long file_id : expired_ids) {
+      std::error_code errorc;
+      std::filesystem::remove(getPartPath(file_id), errorc);
+    }
+  }
+};
+
+FileManager::FileManager() : m_impl(std::make_unique<FileManagerImpl>()) {}
+
+FileManager::~FileManager() noexcept = default;
+
+void FileManager::init(const std::filesystem::path &spool_path) {
+  m_impl->m_spool_path = spool_path;
+  std::filesystem::create_directories(spool_path);
+
+  // Uploads are only known in memory, so earlier ones can't be resumed.
+  // Complete files get their access lists back.
+  std::unique_lock lock(m_impl->m_access_map_mutex);
+  for (const auto &entry : std::filesystem::directory_iterator(spool_path)) {
+    if (!entry.is_regular_file()) {
+      continue;
+    }
+    if (entry.path().extension() == ".part") {
+      std::error_code errorc;
+      std::filesystem::remove(entry.path(), errorc);
+    } else if (entry.path().extension() == ".acl") {
+      m_impl->loadAccess(entry.path());
+    }
+  }
+}
+
+asio::awaitable<void> FileManager::auto_clean(WorkerPool &worker_pool) {
+  asio::steady_timer timer(co_await asio::this_coro::executor);
+  while (true) {
+    timer.expires_after(upload_clean_interval);
+    co_await timer.async_wait(asio::use_awaitable);
+    try {
+      // Removing files touches the disk
+      co_await worker_pool.async_run(
+          [this]() { m_impl->removeExpiredUploads(); });
+    } catch (const std::system_error &) {
+      // The pool is busy, try again next time
+    }
+  }
+}
+
+std::pair<long long, std::uint64_t>
+FileManager::startUpload(const UserID &user_id, long long file_id,
+                         std::uint64_t file_size) {
+  if (file_size > max_file_size) {
+    throw std::system_error(qls_errc::data_too_large);
+  }
+
+  if (file_id != 0) {
+    // Resume after the last chunk that was written
+    auto upload = m_impl->getUpload(user_id, file_id);
+    std::lock_guard lock(upload->mutex);
+    if (upload->file_size != file_size) {
+      throw std::system_error(qls_errc::invalid_data);
+    }
+    upload->last_activity = std::chrono::steady_clock::now();
+    return {file_id,
+            upload->next_sequence * static_cast<std::uint64_t>(chunk_size)};
+  }
+
+  auto upload = std::make_shared<Upload>();
+  upload->owner = user_id;
+  upload->file_size = file_size;
+  {
+    std::unique_lock lock(m_impl->m_upload_map_mutex);
+    const auto upload_num = std::count_if(
+        m_impl->m_upload_map.cbegin(), m_impl->m_upload_map.cend(),
+        [&](const auto &iter) { return iter.second->owner == user_id; });
+    if (static_cast<std::size_t>(upload_num) >= max_uploads_per_user) {
+      throw std::system_error(qls_errc::too_many_uploads);
+    }
+    // Ids are random, so they can't be guessed to download others' files
+    do {
+      if (RAND_bytes(reinterpret_cast<unsigned char *>(&file_id),
+                     sizeof(file_id)) != 1) {
+        throw std::runtime_error("RAND_bytes() failed");
+      }
+      file_id &= 0x7fffffffffffffffLL;
+    } while (file_id == 0 || m_impl->m_upload_map.contains(file_id) ||
+             std::filesystem::exists(m_impl->getFilePath(file_id)));
+    m_impl->m_upload_map.emplace(file_id, upload);
+  }
+
+  std::lock_guard lock(upload->mutex);
+  upload->file.open(m_impl->getPartPath(file_id),
+                    std::ios::binary | std::ios::trunc);
+  if (!upload->file) {
+    std::unique_lock map_lock(m_impl->m_upload_map_mutex);
+    m_impl->m_upload_map.erase(file_id);
+    throw std::system_error(std::make_error_code(std::errc::io_error));
+  }
+  if (file_size == 0) {
+    m_impl->finishUpload(file_id, *upload);
+  }
+  return {file_id, 0};
+}
+
+bool FileManager::writeChunk(const UserID &user_id, long long file_id,
+                             std::uint32_t sequence, std::string_view data) {
+  auto upload = m_impl->getUpload(user_id, file_id);
+  std::lock_guard lock(upload->mutex);
+  const std::uint64_t offset =
+      upload->next_sequence * static_cast<std::uint64_t>(chunk_size);
+  if (sequence != upload->next_sequence || offset >= upload->file_size ||
+      data.size() != std::min<std::uint64_t>(chunk_size,
+                                             upload->file_size - offset)) {
+    throw std::system_error(qls_errc::invalid_data);
+  }
+
+  // Straight to disk, only the receive buffer ever holds the chunk
+  upload->file.write(data.data(), static_cast<std::streamsize>(data.size()));
+  upload->file.flush();
+  if (!upload->file) {
+    throw std::system_error(std::make_error_code(std::errc::io_error));
+  }
+  ++upload->next_sequence;
+  upload->last_activity = std::chrono::steady_clock::now();
+  if (offset + data.size() < upload->file_size) {
+    return false;
+  }
+  m_impl->finishUpload(file_id, *upload);
+  return true;
+}
+
+void FileManager::shareFile(const UserID &owner, long long file_id,
+                            const UserID &reader) {
+  std::unique_lock lock(m_impl->m_access_map_mutex);
+  auto iter = m_impl->m_access_map.find(file_id);
+  if (iter == m_impl->m_access_map.end() || iter->second.owner != owner) {
+    throw std::system_error(qls_errc::file_not_existed);
+  }
+  if (reader == owner || iter->second.readers.contains(reader)) {
+    return;
+  }
+  FileAccess access = iter->second;
+  access.readers.insert(reader);
+  // Saved before it takes effect, so a restart can't take it back
+  m_impl->writeAccess(file_id, access);
+  iter->second = std::move(access);
+}
+
+bool FileManager::hasFile(long long file_id) const {
+  std::error_code errorc;
+  return std::filesystem::is_regular_file(m_impl->getFilePath(file_id),
+                                          errorc);
+}
+
+std::uint64_t FileManager::getFileSize(long long file_id) const {
+  std::error_code errorc;
+  auto size = std::filesystem::file_size(m_impl->getFilePath(file_id), errorc);
+  if (errorc) {
+    throw std::system_error(qls_errc::file_not_existed);
+  }
+  return static_cast<std::uint64_t>(size);
+}
+
+std::unique_ptr<BasicConnection::FragmentSource>
+FileManager::makeDownload(const UserID &user_id, long long file_id,
+                          std::uint32_t sequence,
+                          WorkerPool &worker_pool) const {
+  m_impl->checkReadable(user_id, file_id);
+  const std::uint64_t file_size = getFileSize(file_id);
+  if (sequence >= getChunkNum(file_size)) {
+    throw std::system_error(qls_errc::invalid_data);
+  }
+  return std::make_unique<FileFragmentSource>(
+      m_impl->getFilePath(file_id), file_id, file_size, sequence, worker_pool);
+}
+
+} // namespace qls
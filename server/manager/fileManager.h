@@ -0,0 +1,125 @@
+#ifndef FILE_MANAGER_H
+#define FILE_MANAGER_H
+
+#include <asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+#include "connection.hpp"
+#include "userid.hpp"
+#include "workerPool.hpp"
+
+namespace qls {
+
+/**
+ * @class FileManager
+ * @brief Stores uploaded files in the spool directory and serves them.
+ * @details A file is moved as FileStream packages whose requestID is the id
+ * of the file, sequence is the index of a chunk_size chunk and sequenceSize
+ * the number of chunks. Uploads are written to disk chunk by chunk and can
+ * be resumed after a disconnect until they have been idle for
+ * upload_idle_timeout; downloads are read from disk on the worker pool one
+ * chunk ahead of the socket and can start at any chunk. A complete file can
+ * only be downloaded by its uploader and the users it was shared with, who
+ * are kept next to it in a .acl file.
+ */
+class FileManager final {
+public:
+  constexpr static std::size_t chunk_size = 64 * 1024;
+  constexpr static std::uint64_t max_file_size = 4ULL * 1024 * 1024 * 1024;
+  constexpr static std::size_t max_uploads_per_user = 8;
+  constexpr static std::chrono::minutes upload_idle_timeout{30};
+  constexpr static std::chrono::minutes upload_clean_interval{1};
+
+  FileManager();
+  FileManager(const FileManager &) = delete;
+  FileManager(FileManager &&) = delete;
+  ~FileManager() noexcept;
+
+  FileManager &operator=(const FileManager &) = delete;
+  FileManager &operator=(FileManager &&) = delete;
+
+  /**
+   * @brief Initializes the file manager.
+   * @param spool_path Directory the files are stored in, created if needed.
+   */
+  void init(const std::filesystem::path &spool_path);
+
+  /**
+   * @brief Removes uploads that have been idle for upload_idle_timeout.
+   * @details Runs until it is cancelled, checking every
+   * upload_clean_interval. The files are removed on the worker pool.
+   * @param worker_pool The pool the files are removed on.
+   */
+  asio::awaitable<void> auto_clean(WorkerPool &worker_pool);
+
+  /**
+   * @brief Starts a new upload or resumes an unfinished one.
+   * @param user_id The user uploading the file.
+   * @param file_id 0 for a new file, otherwise the id of an unfinished
+   * upload of the same user.
+   * @param file_size Size of the whole file.
+   * @return The id of the file and the offset to continue from. The offset
+   * equals the file size once the upload is complete.
+   */
+  [[nodiscard]] std::pair<long long, std::uint64_t>
+  startUpload(const UserID &user_id, long long file_id,
+              std::uint64_t file_size);
+
+  /**
+   * @brief Writes the next chunk of an upload to disk.
+   * @param user_id The user uploading the file.
+   * @param file_id The id of the file.
+   * @param sequence Index of the chunk, chunks must arrive in order.
+   * @param data The chunk, chunk_size bytes except for the last one.
+   * @return true if this was the last chunk and the file is complete.
+   */
+  bool writeChunk(const UserID &user_id, long long file_id,
+                  std::uint32_t sequence, std::string_view data);
+
+  /**
+   * @brief Lets another user download a file.
+   * @param owner The user who uploaded the file.
+   * @param file_id The id of a complete file.
+   * @param reader The user who may download it from now on.
+   * @throw std::system_error with qls_errc::file_not_existed if the owner
+   * has no complete file with this id.
+   */
+  void shareFile(const UserID &owner, long long file_id, const UserID &reader);
+
+  /**
+   * @brief Checks if a file has been uploaded completely.
+   */
+  [[nodiscard]] bool hasFile(long long file_id) const;
+
+  /**
+   * @brief Gets the size of an uploaded file.
+   */
+  [[nodiscard]] std::uint64_t getFileSize(long long file_id) const;
+
+  /**
+   * @brief Makes the FileStream packages of a download.
+   * @param user_id The user downloading the file, its owner or a user it
+   * was shared with. Others get qls_errc::file_not_existed.
+   * @param file_id The id of an uploaded file.
+   * @param sequence Index of the first chunk to send.
+   * @param worker_pool The pool the chunks are read on.
+   * @return The source for BasicConnection::async_send_stream().
+   */
+  [[nodiscard]] std::unique_ptr<BasicConnection::FragmentSource>
+  makeDownload(const UserID &user_id, long long file_id,
+               std::uint32_t sequence, WorkerPool &worker_pool) const;
+
+private:
+  struct FileManagerImpl;
+  std::unique_ptr<FileManagerImpl> m_impl;
+};
+
+} // namespace qls
+
+#endif // !FILE_MANAGER_H
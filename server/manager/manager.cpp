@@ -1,9 +1,12 @@
 #include "manager.h"
 
 #include <Ini.h>
+#include <algorithm>
 #include <memory_resource>
 #include <shared_mutex>
+#include <string>
 #include <system_error>
+#include <thread>
 
 #include "groupid.hpp"
 #include "qls_error.h"
@@ -16,6 +19,8 @@ namespace qls {
 struct ManagerImpl {
   DataManager m_dataManager;                 ///< Data manager instance.
   VerificationManager m_verificationManager; ///< Verification manager instance.
+  FileManager m_fileManager;                 ///< File manager instance.
+  WorkerPool m_workerPool;                   ///< Worker pool instance.
 
   // Group room map
   std::pmr::synchronized_pool_resource m_groupRoom_sync_pool;
@@ -42,7 +47,7 @@ struct ManagerImpl {
       &m_user_sync_pool};
   std::shared_mutex m_user_map_mutex;
 
-  std::unordered_map<std::shared_ptr<Connection<asio::ip::tcp::socket>>, UserID>
+  std::unordered_map<std::shared_ptr<BasicConnection>, UserID>
       m_connection_map;
   std::shared_mutex m_connection_map_mutex;
 
@@ -88,6 +93,23 @@ void Manager::init() {
 
   m_impl->m_dataManager.init();
   m_impl->m_verificationManager.init();
+  m_impl->m_fileManager.init(serverIni["file"]["spool_path"].empty()
+                                 ? "./spool"
+                                 : serverIni["file"]["spool_path"]);
+
+  // 0 or no value means one worker thread per core
+  const std::string worker_threads = serverIni["server"]["worker_threads"];
+  const std::string worker_queue_limit =
+      serverIni["server"]["worker_queue_limit"];
+  std::size_t thread_num =
+      worker_threads.empty() ? 0 : std::stoull(worker_threads);
+  if (thread_num == 0) {
+    thread_num = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  m_impl->m_workerPool.init(thread_num,
+                            worker_queue_limit.empty()
+                                ? WorkerPool::default_max_queue_depth
+                                : std::stoull(worker_queue_limit));
 }
 
 GroupID Manager::addPrivateRoom(const UserID &user1_id,
@@ -285,7 +307,7 @@ void Manager::getUserList(
 }
 
 void Manager::registerConnection(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr) {
+    const std::shared_ptr<BasicConnection> &connection_ptr) {
   std::unique_lock lock(m_impl->m_connection_map_mutex);
   if (m_impl->m_connection_map.find(connection_ptr) !=
       m_impl->m_connection_map.cend()) {
@@ -295,15 +317,14 @@ void Manager::registerConnection(
 }
 
 bool Manager::hasConnection(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr)
-    const {
+    const std::shared_ptr<BasicConnection> &connection_ptr) const {
   std::shared_lock lock(m_impl->m_connection_map_mutex);
   return m_impl->m_connection_map.find(connection_ptr) !=
          m_impl->m_connection_map.cend();
 }
 
 bool Manager::matchUserOfConnection(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr,
+    const std::shared_ptr<BasicConnection> &connection_ptr,
     const UserID &user_id) const {
   std::shared_lock lock(m_impl->m_connection_map_mutex);
   auto iter = m_impl->m_connection_map.find(connection_ptr);
@@ -314,8 +335,7 @@ bool Manager::matchUserOfConnection(
 }
 
 UserID Manager::getUserIDOfConnection(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr)
-    const {
+    const std::shared_ptr<BasicConnection> &connection_ptr) const {
   std::shared_lock lock(m_impl->m_connection_map_mutex);
   auto iter = m_impl->m_connection_map.find(connection_ptr);
   if (iter == m_impl->m_connection_map.cend()) {
@@ -326,7 +346,7 @@ UserID Manager::getUserIDOfConnection(
 }
 
 void Manager::modifyUserOfConnection(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr,
+    const std::shared_ptr<BasicConnection> &connection_ptr,
     const UserID &user_id, DeviceType type) {
   std::unique_lock lock1(m_impl->m_connection_map_mutex, std::defer_lock);
   std::shared_lock lock2(m_impl->m_user_map_mutex, std::defer_lock);
@@ -351,7 +371,7 @@ void Manager::modifyUserOfConnection(
 }
 
 void Manager::removeConnection(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr) {
+    const std::shared_ptr<BasicConnection> &connection_ptr) {
   std::unique_lock lock1(m_impl->m_connection_map_mutex, std::defer_lock);
   std::shared_lock lock2(m_impl->m_user_map_mutex, std::defer_lock);
   std::lock(lock1, lock2);
@@ -378,6 +398,10 @@ VerificationManager &Manager::getServerVerificationManager() {
   return m_impl->m_verificationManager;
 }
 
+FileManager &Manager::getServerFileManager() { return m_impl->m_fileManager; }
+
+WorkerPool &Manager::getServerWorkerPool() { return m_impl->m_workerPool; }
+
 qls::Network &Manager::getServerNetwork() { return m_impl->m_network; }
 
 } // namespace qls
@@ -9,6 +9,7 @@
 #include "connection.hpp"
 #include "dataManager.h"
 #include "definition.hpp"
+#include "fileManager.h"
 #include "groupRoom.h"
 #include "groupid.hpp"
 #include "network.h"
@@ -16,6 +17,7 @@
 #include "user.h"
 #include "userid.hpp"
 #include "verificationManager.h"
+#include "workerPool.hpp"
 
 namespace qls {
 
@@ -157,8 +159,8 @@ public:
    *
    * @param connection_ptr A shared pointer to the socket to register.
    */
-  void registerConnection(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr);
+  void
+  registerConnection(const std::shared_ptr<BasicConnection> &connection_ptr);
 
   /**
    * @brief Checks if a socket is registered.
@@ -166,9 +168,8 @@ public:
    * @param connection_ptr A shared pointer to the socket to check.
    * @return true if the socket is registered, false otherwise.
    */
-  [[nodiscard]] bool hasConnection(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr)
-      const;
+  [[nodiscard]] bool
+  hasConnection(const std::shared_ptr<BasicConnection> &connection_ptr) const;
 
   /**
    * @brief Checks if a socket is associated with a specific user ID.
@@ -179,7 +180,7 @@ public:
    * otherwise.
    */
   [[nodiscard]] bool matchUserOfConnection(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr,
+      const std::shared_ptr<BasicConnection> &connection_ptr,
       const UserID &user_id) const;
 
   /**
@@ -189,8 +190,7 @@ public:
    * @return The user ID associated with the socket.
    */
   [[nodiscard]] UserID getUserIDOfConnection(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr)
-      const;
+      const std::shared_ptr<BasicConnection> &connection_ptr) const;
 
   /**
    * @brief Modifies the user ID associated with a registered socket.
@@ -201,7 +201,7 @@ public:
    * @param type The type of device associated with the socket.
    */
   void modifyUserOfConnection(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr,
+      const std::shared_ptr<BasicConnection> &connection_ptr,
       const UserID &user_id, DeviceType type);
 
   /**
@@ -209,8 +209,7 @@ public:
    *
    * @param connection_ptr A shared pointer to the socket to remove.
    */
-  void removeConnection(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr);
+  void removeConnection(const std::shared_ptr<BasicConnection> &connection_ptr);
 
   /**
    * @brief Retrieves the SQL process for the server.
@@ -230,6 +229,18 @@ public:
    */
   [[nodiscard]] qls::VerificationManager &getServerVerificationManager();
 
+  /**
+   * @brief Retrieves the file manager for the server.
+   * @return Reference to the FileManager.
+   */
+  [[nodiscard]] qls::FileManager &getServerFileManager();
+
+  /**
+   * @brief Retrieves the pool that runs blocking and CPU-heavy work.
+   * @return Reference to the WorkerPool.
+   */
+  [[nodiscard]] qls::WorkerPool &getServerWorkerPool();
+
   /**
    * @brief Retrieves the network for the server.
    * @return Reference to the Network.
@@ -2,19 +2,29 @@
 
 #include <Ini.h>
 #include <Json.h>
-#include <asio/experimental/awaitable_operators.hpp>
+#include <algorithm>
 #include <asio/ip/tcp.hpp>
 #include <chrono>
 #include <cstdint>
 #include <logger.hpp>
 #include <memory_resource>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <system_error>
+#include <type_traits>
+#include <utility>
 
+#include "binaryCodec.hpp"
 #include "connection.hpp"
+#include "crc32c.hpp"
 #include "dataPackage.hpp"
 #include "definition.hpp"
+#include "fragmentAssembler.hpp"
+#include "kcpStream.hpp"
+#include "kernelTls.hpp"
 #include "manager.h"
+#include "networkEndianness.hpp"
 #include "package.hpp"
 #include "qls_error.h"
 #include "socket.hpp"
@@ -33,14 +43,61 @@ using asio::use_awaitable;
 using asio::ip::tcp;
 namespace this_coro = asio::this_coro;
 using namespace asio;
-using namespace experimental::awaitable_operators;
 using namespace std::chrono_literals;
 
+namespace {
+
+// Index of the shard run by this thread, npos on non-io threads
+thread_local std::size_t local_shard_index = static_cast<std::size_t>(-1);
+
+#if defined(SO_REUSEPORT)
+using reuse_port =
+    asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+struct Protocol {
+  bool compact_header = false;
+  bool checksum = false;
+};
+
+// Answers the Hello of a client with the protocol version both sides speak
+// and the capabilities granted out of the allowed ones, and switches the
+// connection's outgoing frames to them
+Protocol negotiateProtocol(BasicConnection &connection,
+                           const DataPackageView &hello,
+                           std::uint64_t allowed_capabilities) {
+  BinaryReader reader(hello.getData());
+  const std::uint64_t version = std::clamp<std::uint64_t>(
+      reader.readVarint(), 1, DataPackage::protocol_version);
+  // Older clients don't send capabilities
+  const std::uint64_t capabilities =
+      (reader.empty() ? 0 : reader.readVarint()) & allowed_capabilities;
+
+  BinaryWriter writer;
+  writer.writeVarint(version).writeVarint(capabilities);
+  connection.async_send(Frame::makeFrame(writer.release(), DataPackage::Hello,
+                                         1, 0, hello.requestID));
+  Protocol protocol;
+  protocol.compact_header = version >= 2;
+  protocol.checksum = (capabilities & DataPackage::capability_checksum) != 0;
+  connection.set_compact_header(protocol.compact_header);
+  connection.set_checksum(protocol.checksum);
+  return protocol;
+}
+
+} // namespace
+
 Network::Network(std::pmr::memory_resource *memory_resource)
     : m_port(port_num), m_thread_num(std::thread::hardware_concurrency()),
+      m_sharded(false), m_kernel_tls(false), m_kcp(false), m_checksum(false),
+      m_next_shard(0),
       m_memory_resource(memory_resource) {
   m_threads =
       std::make_unique<std::thread[]>(static_cast<std::size_t>(m_thread_num));
+  m_io_contexts = std::make_unique<asio::io_context[]>(
+      static_cast<std::size_t>(m_thread_num));
+  m_timing_wheels =
+      std::make_unique<TimingWheel[]>(static_cast<std::size_t>(m_thread_num));
 }
 
 Network::~Network() {
@@ -62,6 +119,18 @@ void Network::setTlsConfig(
   }
 }
 
+void Network::setShardedMode(bool sharded) noexcept { m_sharded = sharded; }
+
+void Network::setKernelTlsMode(bool kernel_tls) noexcept {
+  m_kernel_tls = kernel_tls;
+}
+
+void Network::setKcpMode(bool kcp) noexcept { m_kcp = kcp; }
+
+void Network::setChecksumMode(bool checksum) noexcept {
+  m_checksum = checksum;
+}
+
 void Network::run(std::string_view host, std::uint16_t port) {
   m_host = host;
   m_port = port;
@@ -71,14 +140,52 @@ void Network::run(std::string_view host, std::uint16_t port) {
     throw std::system_error(qls_errc::null_tls_context);
   }
 
-  try {
-    signal_set signals(m_io_context, SIGINT, SIGTERM);
-    signals.async_wait([&](auto, auto) { m_io_context.stop(); });
+  if (m_kernel_tls) {
+    prepareKernelTls(m_ssl_context_ptr->native_handle());
+  }
 
-    co_spawn(m_io_context, listener(), detached);
-    co_spawn(m_io_context, m_rateLimiter.auto_clean(), detached);
+  try {
+    signal_set signals(m_io_contexts[0], SIGINT, SIGTERM);
+    signals.async_wait([&](auto, auto) { stop(); });
+
+    // Every shard listens on its own SO_REUSEPORT acceptor so the kernel
+    // spreads incoming connections over the shards. Without SO_REUSEPORT
+    // the acceptor of shard 0 hands the sockets out in turn.
+#if defined(SO_REUSEPORT)
+    const std::size_t listener_num = get_shard_count();
+#else
+    const std::size_t listener_num = 1;
+#endif
+    for (std::size_t i = 0; i < listener_num; i++) {
+      co_spawn(m_io_contexts[i], listener(i), detached);
+    }
+    if (m_kcp) {
+      co_spawn(m_io_contexts[0], kcp_listener(), detached);
+    }
+    for (std::size_t i = 0; i < get_shard_count(); i++) {
+      co_spawn(m_io_contexts[i], tick_timing_wheel(i), detached);
+    }
+    co_spawn(m_io_contexts[0], m_rateLimiter.auto_clean(), detached);
+    co_spawn(m_io_contexts[0], log_worker_pool(), detached);
+    co_spawn(m_io_contexts[0],
+             serverManager.getServerFileManager().auto_clean(
+                 serverManager.getServerWorkerPool()),
+             detached);
+
+    // A shard without a listener may have nothing to do until the first
+    // connection is handed to it, so keep its run() from returning early.
+    // stop() still ends run() at once.
+    std::vector<executor_work_guard<io_context::executor_type>> work_guards;
+    work_guards.reserve(get_shard_count());
+    for (std::size_t i = 0; i < get_shard_count(); i++) {
+      work_guards.emplace_back(m_io_contexts[i].get_executor());
+    }
     for (int i = 0; i < m_thread_num; i++) {
-      m_threads[i] = std::thread([&]() { m_io_context.run(); });
+      const std::size_t shard_index = m_sharded ? i : 0;
+      m_threads[i] = std::thread([this, shard_index]() {
+        local_shard_index = shard_index;
+        m_io_contexts[shard_index].run();
+      });
     }
     for (int i = 0; i < m_thread_num; i++) {
       if (m_threads[i].joinable()) {
@@ -91,10 +198,36 @@ void Network::run(std::string_view host, std::uint16_t port) {
 }
 
 asio::io_context &Network::get_io_context() noexcept {
-  return this->m_io_context;
+  const std::size_t shard_count = get_shard_count();
+  if (local_shard_index < shard_count) {
+    return m_io_contexts[local_shard_index];
+  }
+  return m_io_contexts[m_next_shard.fetch_add(1, std::memory_order_relaxed) %
+                       shard_count];
+}
+
+asio::io_context &Network::get_io_context(std::size_t shard_index) {
+  if (shard_index >= get_shard_count()) {
+    throw std::out_of_range("shard index is out of range");
+  }
+  return m_io_contexts[shard_index];
 }
 
-void Network::stop() { m_io_context.stop(); }
+std::size_t Network::get_shard_count() const noexcept {
+  return m_sharded ? static_cast<std::size_t>(m_thread_num) : 1;
+}
+
+TimingWheel &Network::get_timing_wheel() noexcept {
+  return m_timing_wheels[local_shard_index < get_shard_count()
+                             ? local_shard_index
+                             : 0];
+}
+
+void Network::stop() {
+  for (std::size_t i = 0; i < get_shard_count(); i++) {
+    m_io_contexts[i].stop();
+  }
+}
 
 awaitable<void> Network::process(ip::tcp::socket origin_socket) {
   auto executor = co_await this_coro::executor;
@@ -108,66 +241,144 @@ awaitable<void> Network::process(ip::tcp::socket origin_socket) {
   }
 
   // Load SSL socket pointer
-  std::shared_ptr<Connection<asio::ip::tcp::socket>> connection_ptr =
-      std::allocate_shared<Connection<asio::ip::tcp::socket>>(
-          std::pmr::polymorphic_allocator<Connection<asio::ip::tcp::socket>>(
-              m_memory_resource),
-          std::move(origin_socket), *m_ssl_context_ptr);
+  auto connection_ptr = std::allocate_shared<Connection<tcp::socket>>(
+      std::pmr::polymorphic_allocator<Connection<tcp::socket>>(
+          m_memory_resource),
+      std::move(origin_socket), *m_ssl_context_ptr);
+  // Requests of a connection may be processed at once, they share its strand
+  auto &strand = connection_ptr->strand;
+  co_await co_spawn(strand, serve(std::move(connection_ptr)), use_awaitable);
+}
+
+awaitable<void> Network::process_kcp(KcpStream stream) {
+  // The listener already checked the rate limiter for the session
+  auto connection_ptr = std::allocate_shared<Connection<KcpStream>>(
+      std::pmr::polymorphic_allocator<Connection<KcpStream>>(m_memory_resource),
+      std::move(stream), *m_ssl_context_ptr);
+  auto &strand = connection_ptr->strand;
+  co_await co_spawn(strand, serve(std::move(connection_ptr)), use_awaitable);
+}
+
+template <class T>
+awaitable<void> Network::serve(std::shared_ptr<Connection<T>> connection_ptr) {
   // String address for data processing
   std::string addr = socket2ip(connection_ptr->socket);
   // Socket package receiver
-  Package<DataPackage::LengthType> packageReceiver;
+  Package<DataPackage::LengthType> packageReceiver(max_package_length);
   // Register the socket
   serverManager.registerConnection(connection_ptr);
+  // Reads only update the last activity, the timing wheel of the shard
+  // closes the connection once it has been idle for too long
+  TimingWheel &timing_wheel = get_timing_wheel();
+  watch_connection(timing_wheel, connection_ptr, addr, timeout_num);
 
   try {
     serverLogger.info(std::format("[{}] connected to the server", addr));
 
-    // SSL handshake
-    co_await (connection_ptr->socket.async_handshake(ssl::stream_base::server,
-                                                     use_awaitable) ||
-              timeout(timeout_num));
+    // SSL handshake, kTLS only works on TCP sockets
+    bool track_kernel_tls = false;
+    if constexpr (std::is_same_v<T, tcp::socket>) {
+      track_kernel_tls =
+          m_kernel_tls &&
+          trackKernelTls(connection_ptr->socket.native_handle());
+    }
+    co_await connection_ptr->socket.async_handshake(ssl::stream_base::server,
+                                                    use_awaitable);
+    if constexpr (std::is_same_v<T, tcp::socket>) {
+      if (track_kernel_tls) {
+        if (co_await connection_ptr->enable_kernel_tls_tx()) {
+          serverLogger.info(std::format("[{}] kTLS enabled", addr));
+        } else {
+          serverLogger.info(
+              std::format("[{}] kTLS unavailable, using OpenSSL", addr));
+        }
+      }
+    }
 
-    char data[buffer_lenth] = {0};
     SocketService socketService(connection_ptr);
+    FragmentAssembler fragmentAssembler(max_fragment_budget);
+    // Clients that speak version 2 send a Hello as their first frame, every
+    // frame before it and all frames of version 1 clients have a v1 header
+    Protocol protocol;
+    bool is_first_frame = true;
     long long heart_beat_times = 0;
-    auto heart_beat_time_point = std::chrono::steady_clock::now();
-    std::pmr::string data_buffer(m_memory_resource);
+    auto heart_beat_time_point = timing_wheel.now();
     while (true) {
       try {
-        do {
-          std::size_t size = std::get<0>(
-              co_await (connection_ptr->socket.async_read_some(
-                            buffer(data), bind_executor(connection_ptr->strand,
-                                                        use_awaitable)) ||
-                        timeout(timeout_num)));
+        // Only read from the socket if no complete frame is buffered yet
+        while (!packageReceiver.canRead()) {
+          auto free_space = packageReceiver.writableBuffer();
+          std::size_t size = co_await connection_ptr->socket.async_read_some(
+              buffer(free_space.data(), free_space.size()),
+              bind_executor(connection_ptr->strand, use_awaitable));
+          connection_ptr->update_last_activity(timing_wheel.now());
           // serverLogger.info((std::format("[{}] received message: {}", addr,
-          // showBinaryData({data, size}))));
-          packageReceiver.write({data, size});
-        } while (!packageReceiver.canRead());
-
-        packageReceiver.read(data_buffer);
-        auto pack = DataPackage::stringToPackage(data_buffer);
-        if (pack->type == DataPackage::HeartBeat) {
-          // Heartbeat package
+          // showBinaryData({free_space.data(), size}))));
+          packageReceiver.commit(size);
+        }
+
+        // The view points into packageReceiver's buffer, which is not touched
+        // again until the package has been processed
+        std::string_view frame = packageReceiver.readView();
+        const bool first_frame = std::exchange(is_first_frame, false);
+        if (protocol.checksum) {
+          const auto checksum = loadNetworkEndianness<std::uint32_t>(
+              frame.data() + frame.size() - DataPackage::checksum_size);
+          frame.remove_suffix(DataPackage::checksum_size);
+          if (crc32c(frame) != checksum) {
+            // The framing of everything after it can't be trusted either
+            serverLogger.warning("[", addr, "]",
+                                 "received a package with a bad checksum");
+            throw std::system_error(qls_errc::invalid_data);
+          }
+        }
+        const auto frame_type = protocol.compact_header
+                                    ? DataPackageView::peekCompactType(frame)
+                                    : DataPackageView::peekType(frame);
+        if (frame_type == DataPackage::HeartBeat) {
+          // Heartbeats only count, the rest of the header is never decoded
           heart_beat_times++;
-          if ((std::chrono::steady_clock::now() - heart_beat_time_point) >=
-              heart_beat_check_interval) {
+          const auto now = timing_wheel.now();
+          if (now - heart_beat_time_point >= heart_beat_check_interval) {
             // Update time point
-            heart_beat_time_point = std::chrono::steady_clock::now();
+            heart_beat_time_point = now;
             if (heart_beat_times > max_heart_beat_num) {
               // Remove socket pointer from manager
               // if there were too many heartbeats
               serverLogger.error("[", addr, "]", "too many heartbeats");
-              serverManager.removeConnection(connection_ptr);
-              co_return;
+              break;
             }
             heart_beat_times = 0;
           }
           continue;
         }
-        pack->getData(data_buffer);
-        co_await socketService.process(data_buffer, std::move(pack));
+        auto pack = protocol.compact_header
+                        ? DataPackageView::fromCompactString(frame)
+                        : DataPackageView::fromString(frame);
+        if (pack.type == DataPackage::Hello) {
+          if (!first_frame) {
+            throw std::system_error(qls_errc::invalid_data);
+          }
+          protocol = negotiateProtocol(
+              *connection_ptr, pack,
+              m_checksum ? DataPackage::supported_capabilities
+                         : DataPackage::supported_capabilities &
+                               ~DataPackage::capability_checksum);
+          packageReceiver.setCompactLength(protocol.compact_header);
+          packageReceiver.setTrailerSize(
+              protocol.checksum ? DataPackage::checksum_size : 0);
+          continue;
+        }
+        if (pack.sequenceSize > 1 && pack.type != DataPackage::FileStream) {
+          // Fragments are only processed once the whole message is here,
+          // file chunks go straight to disk instead
+          auto message = fragmentAssembler.push(pack);
+          if (message) {
+            co_await socketService.dispatch(*message);
+          }
+          continue;
+        }
+        co_await socketService.dispatch(pack);
         continue;
       } catch (const std::system_error &e) {
         const auto &errc = e.code();
@@ -180,11 +391,14 @@ awaitable<void> Network::process(ip::tcp::socket origin_socket) {
       } catch (const std::exception &e) {
         serverLogger.error(std::string(e.what()));
       }
-
-      // Remove socket pointer from manager
-      serverManager.removeConnection(connection_ptr);
-      co_return;
+      break;
     }
+
+    // Pipelined requests still use the service
+    co_await socketService.wait_for_all_requests();
+    // Remove socket pointer from manager
+    serverManager.removeConnection(connection_ptr);
+    co_return;
   } catch (const std::system_error &e) {
     const auto &errc = e.code();
     if (errc.message() == "End of file") {
@@ -203,12 +417,20 @@ awaitable<void> Network::process(ip::tcp::socket origin_socket) {
   co_return;
 }
 
-awaitable<void> Network::listener() {
+awaitable<void> Network::listener(std::size_t shard_index) {
   auto executor = co_await this_coro::executor;
-  tcp::acceptor acceptor(executor, {ip::make_address(m_host), m_port});
+  tcp::endpoint endpoint(ip::make_address(m_host), m_port);
+  tcp::acceptor acceptor(executor);
+  acceptor.open(endpoint.protocol());
 
   // SYN anti-attack & Dos anti-attack
   acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+  // Only the shards share the port, a single listener keeps it to itself
+  if (m_sharded) {
+    acceptor.set_option(reuse_port(true));
+  }
+#endif
   acceptor.set_option(socket_base::receive_buffer_size(1024 * 1024));
   acceptor.set_option(tcp::acceptor::enable_connection_aborted(true));
 #if defined(__LINUX__) || defined(__UNIX__)
@@ -219,10 +441,23 @@ awaitable<void> Network::listener() {
   int cookie = 1;
   setsockopt(fd, IPPROTO_TCP, TCP_SYNCOOKIE, &cookie, sizeof(cookie));
 #endif
+  acceptor.bind(endpoint);
+  acceptor.listen();
+
   while (true) {
     try {
-      tcp::socket socket = co_await acceptor.async_accept(use_awaitable);
-      co_spawn(executor, process(std::move(socket)), detached);
+#if defined(SO_REUSEPORT)
+      asio::io_context &shard_context = m_io_contexts[shard_index];
+#else
+      asio::io_context &shard_context =
+          m_io_contexts[m_next_shard.fetch_add(1, std::memory_order_relaxed) %
+                        get_shard_count()];
+#endif
+      // The accepted socket belongs to the shard's io_context, so the whole
+      // connection is processed by the threads of that shard
+      tcp::socket socket =
+          co_await acceptor.async_accept(shard_context, use_awaitable);
+      co_spawn(shard_context, process(std::move(socket)), detached);
     } catch (const std::exception &e) {
       serverLogger.warning("Error occured at Asio.accepter: ",
                            std::string(e.what()));
@@ -230,14 +465,103 @@ awaitable<void> Network::listener() {
   }
 }
 
-awaitable<void> Network::timeout(const std::chrono::nanoseconds &duration) {
+awaitable<void> Network::kcp_listener() {
+  auto executor = co_await this_coro::executor;
+  ip::udp::endpoint endpoint(ip::make_address(m_host), m_port);
+  ip::udp::socket socket(executor, endpoint.protocol());
+  socket.set_option(ip::udp::socket::reuse_address(true));
+  socket.set_option(socket_base::receive_buffer_size(4 * 1024 * 1024));
+  socket.set_option(socket_base::send_buffer_size(4 * 1024 * 1024));
+  socket.bind(endpoint);
+
+  // Sessions are spread over the shards, the UDP socket stays on shard 0
+  KcpListener kcp_listener(
+      std::move(socket),
+      [this]() -> asio::any_io_executor {
+        const std::size_t shard_index =
+            m_next_shard.fetch_add(1, std::memory_order_relaxed) %
+            get_shard_count();
+        return m_io_contexts[shard_index].get_executor();
+      },
+      [this](const ip::udp::endpoint &remote_endpoint) {
+        return m_rateLimiter.allow_connection(remote_endpoint.address());
+      });
+  co_await kcp_listener.listen([this](KcpStream stream) {
+    auto stream_executor = stream.get_executor();
+    co_spawn(stream_executor, process_kcp(std::move(stream)), detached);
+  });
+}
+
+awaitable<void> Network::tick_timing_wheel(std::size_t shard_index) {
+  TimingWheel &timing_wheel = m_timing_wheels[shard_index];
+  steady_timer timer(co_await this_coro::executor);
+  while (true) {
+    timer.expires_after(timing_wheel.get_tick_duration());
+    co_await timer.async_wait(use_awaitable);
+    try {
+      timing_wheel.tick();
+    } catch (const std::exception &e) {
+      serverLogger.error(std::string(e.what()));
+    }
+  }
+}
+
+awaitable<void> Network::log_worker_pool() {
+  WorkerPool &worker_pool = serverManager.getServerWorkerPool();
   steady_timer timer(co_await this_coro::executor);
-  timer.expires_after(duration);
-  co_await timer.async_wait(asio::use_awaitable);
-  throw std::system_error(make_error_code(std::errc::timed_out));
+  std::size_t last_completed = 0;
+  std::size_t last_rejected = 0;
+  while (true) {
+    timer.expires_after(1min);
+    co_await timer.async_wait(use_awaitable);
+    // An idle pool isn't worth a line every minute
+    const std::size_t completed = worker_pool.get_completed_tasks();
+    const std::size_t rejected = worker_pool.get_rejected_tasks();
+    const std::size_t peak = worker_pool.take_peak_queue_depth();
+    if (completed == last_completed && rejected == last_rejected) {
+      continue;
+    }
+    serverLogger.info(std::format(
+        "Worker pool in the last minute: {} tasks completed, {} rejected, "
+        "peak queue depth {}",
+        completed - last_completed, rejected - last_rejected, peak));
+    last_completed = completed;
+    last_rejected = rejected;
+  }
+}
+
+void Network::watch_connection(
+    TimingWheel &timing_wheel,
+    std::weak_ptr<BasicConnection> connection_weak_ptr, std::string addr,
+    TimingWheel::clock::duration delay) {
+  timing_wheel.add(delay, [this, &timing_wheel,
+                           connection_weak_ptr = std::move(connection_weak_ptr),
+                           addr = std::move(addr)]() mutable {
+    auto connection_ptr = connection_weak_ptr.lock();
+    if (!connection_ptr) {
+      return;
+    }
+
+    // Clients that send heartbeats less often get a longer timeout
+    const std::chrono::seconds timeout = std::max(
+        timeout_num,
+        connection_ptr->get_heartbeat_interval() * heart_beat_timeout_factor);
+    auto idle = timing_wheel.now() - connection_ptr->get_last_activity();
+    if (idle < timeout) {
+      // There was activity since the timer was set, check again later
+      watch_connection(timing_wheel, std::move(connection_weak_ptr),
+                       std::move(addr), timeout - idle);
+      return;
+    }
+
+    serverLogger.info(std::format("[{}] timed out", addr));
+    // Closing the socket aborts the pending read of Network::serve
+    connection_ptr->close();
+  });
 }
 
-inline std::string socket2ip(const Socket &socket) {
+template <class T>
+inline std::string socket2ip(const asio::ssl::stream<T> &socket) {
   auto endpoint = socket.lowest_layer().remote_endpoint();
   return std::format("{}:{}", endpoint.address().to_string(),
                      static_cast<std::uint32_t>(endpoint.port()));
@@ -3,16 +3,22 @@
 
 #include <asio.hpp>
 #include <asio/ssl.hpp>
+#include <atomic>
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <memory>
 #include <memory_resource>
 #include <string>
+#include <string_view>
 #include <thread>
 
+#include "connection.hpp"
+#include "kcpStream.hpp"
 #include "rateLimiter.hpp"
 #include "socket.hpp"
+#include "timingWheel.hpp"
 
 namespace qls {
 
@@ -21,7 +27,8 @@ namespace qls {
  * @param s The socket.
  * @return The string representation of the socket's address.
  */
-inline std::string socket2ip(const qls::Socket &socket);
+template <class T>
+inline std::string socket2ip(const asio::ssl::stream<T> &socket);
 
 /**
  * @brief Displays binary data as a string.
@@ -48,7 +55,25 @@ public:
   constexpr static std::chrono::seconds heart_beat_check_interval =
       std::chrono::seconds(10);
   constexpr static std::uint32_t max_heart_beat_num = 10;
-  constexpr static std::uint32_t buffer_lenth = 8192;
+  // Missed heartbeats before a connection with a negotiated interval times out
+  constexpr static int heart_beat_timeout_factor = 2;
+  constexpr static std::uint32_t max_package_length = 1024 * 1024;
+  // Max bytes of unfinished fragmented messages buffered per connection
+  constexpr static std::size_t max_fragment_budget = 8 * 1024 * 1024;
+
+  // Event backend asio was built with, io_uring needs QLS_USE_IO_URING
+  constexpr static std::string_view io_backend =
+#if defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+      "io_uring";
+#elif defined(ASIO_HAS_IOCP)
+      "iocp";
+#elif defined(ASIO_HAS_EPOLL)
+      "epoll";
+#elif defined(ASIO_HAS_KQUEUE)
+      "kqueue";
+#else
+      "select";
+#endif
 
   /**
    * @brief Sets the TLS configuration.
@@ -57,6 +82,41 @@ public:
   void setTlsConfig(const std::function<std::shared_ptr<asio::ssl::context>()>
                         &callback_handle);
 
+  /**
+   * @brief Enables or disables sharded mode.
+   * @details In sharded mode every io thread owns its own io_context and
+   * acceptor, and connections stay on the shard that accepted them. Must be
+   * called before run().
+   * @param sharded True to run one io_context per thread.
+   */
+  void setShardedMode(bool sharded) noexcept;
+
+  /**
+   * @brief Enables or disables kernel TLS for outgoing data.
+   * @details Connections fall back to OpenSSL when the kernel or the
+   * negotiated cipher doesn't support kTLS. Must be called before run().
+   * @param kernel_tls True to try kTLS on every connection.
+   */
+  void setKernelTlsMode(bool kernel_tls) noexcept;
+
+  /**
+   * @brief Enables or disables the KCP listener.
+   * @details KCP sessions are accepted on the UDP port with the same number
+   * as the TCP port, and carry the same TLS and package framing. Must be
+   * called before run().
+   * @param kcp True to accept KCP sessions as well as TCP connections.
+   */
+  void setKcpMode(bool kcp) noexcept;
+
+  /**
+   * @brief Grants or refuses the CRC32C trailer clients ask for in Hello.
+   * @details Off by default: from 300-byte frames up the checksum costs more
+   * than 1% of the CPU time of a frame, see Crc32cBenchmark. Must be called
+   * before run().
+   * @param checksum True to grant DataPackage::capability_checksum.
+   */
+  void setChecksumMode(bool checksum) noexcept;
+
   /**
    * @brief Runs the network.
    * @param host The host address.
@@ -70,22 +130,53 @@ public:
   void stop();
 
   /**
-   * @brief Gets the io_context for this network
+   * @brief Gets the io_context of the calling shard.
+   * @details On an io thread this is the io_context the thread runs, so rooms
+   * and timers created while handling a request stay on the same shard. Other
+   * threads are spread over the shards in turn.
    */
   [[nodiscard]] asio::io_context &get_io_context() noexcept;
 
+  /**
+   * @brief Gets the io_context of a specific shard.
+   * @param shard_index Index of the shard, less than get_shard_count().
+   */
+  [[nodiscard]] asio::io_context &get_io_context(std::size_t shard_index);
+
+  /**
+   * @brief Gets the number of io_contexts in use.
+   * @return 1 if sharded mode is disabled.
+   */
+  [[nodiscard]] std::size_t get_shard_count() const noexcept;
+
 private:
   asio::awaitable<void> process(asio::ip::tcp::socket socket);
-  asio::awaitable<void> listener();
-  static asio::awaitable<void>
-  timeout(const std::chrono::nanoseconds &duration);
+  asio::awaitable<void> process_kcp(KcpStream stream);
+  template <class T>
+  asio::awaitable<void> serve(std::shared_ptr<Connection<T>> connection_ptr);
+  asio::awaitable<void> listener(std::size_t shard_index);
+  asio::awaitable<void> kcp_listener();
+  asio::awaitable<void> tick_timing_wheel(std::size_t shard_index);
+  asio::awaitable<void> log_worker_pool();
+  void watch_connection(TimingWheel &timing_wheel,
+                        std::weak_ptr<BasicConnection> connection_weak_ptr,
+                        std::string addr, TimingWheel::clock::duration delay);
+  [[nodiscard]] TimingWheel &get_timing_wheel() noexcept;
 
   std::string m_host;    ///< Host address.
   unsigned short m_port; ///< Port number.
   std::unique_ptr<std::thread[]>
       m_threads;                    ///< Thread pool for handling connections.
   const std::uint32_t m_thread_num; ///< Number of threads.
-  asio::io_context m_io_context;    ///< IO context for ASIO.
+  std::unique_ptr<asio::io_context[]>
+      m_io_contexts;                     ///< One IO context per shard.
+  bool m_sharded;                        ///< Whether sharded mode is on.
+  bool m_kernel_tls;                     ///< Whether kTLS is tried.
+  bool m_kcp;                            ///< Whether KCP is accepted.
+  bool m_checksum;                       ///< Whether checksums are granted.
+  std::atomic<std::size_t> m_next_shard; ///< Round-robin shard cursor.
+  std::unique_ptr<TimingWheel[]>
+      m_timing_wheels; ///< Idle timeouts, one wheel per shard.
   std::shared_ptr<asio::ssl::context>
       m_ssl_context_ptr; ///< Shared pointer to the SSL context.
   RateLimiter m_rateLimiter;
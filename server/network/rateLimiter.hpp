@@ -1,9 +1,13 @@
 #ifndef RATE_LIMITER_HPP
 #define RATE_LIMITER_HPP
 
+#include <algorithm>
+#include <array>
 #include <asio.hpp>
 #include <atomic>
 #include <chrono>
+#include <cstddef>
+#include <functional>
 #include <mutex>
 #include <unordered_map>
 
@@ -11,11 +15,122 @@
 
 namespace qls {
 
+/**
+ * @brief A token bucket that can be shared between threads without a lock.
+ * @details Uses the generic cell rate algorithm: instead of a token count the
+ * bucket keeps the time at which it will be full again, so taking a token is
+ * a single compare-exchange. The rate and burst are passed on every call and
+ * may change at any time.
+ */
+class TokenBucket final {
+public:
+  using clock = std::chrono::steady_clock;
+
+  TokenBucket() noexcept : m_full_time(0) {}
+  TokenBucket(const TokenBucket &) = delete;
+  TokenBucket(TokenBucket &&) = delete;
+  ~TokenBucket() noexcept = default;
+
+  TokenBucket &operator=(const TokenBucket &) = delete;
+  TokenBucket &operator=(TokenBucket &&) = delete;
+
+  /**
+   * @brief Takes a token if one is available.
+   * @param rate Tokens added per second.
+   * @param burst Max tokens in the bucket.
+   * @param now Current time.
+   * @return true if a token was taken.
+   */
+  bool try_acquire(double rate, double burst,
+                   clock::time_point now = clock::now()) noexcept {
+    if (rate <= 0.0 || burst < 1.0) {
+      return false;
+    }
+    const clock::rep interval = toTicks(1.0 / rate);
+    const clock::rep tolerance = toTicks((burst - 1.0) / rate);
+    const clock::rep now_ticks = now.time_since_epoch().count();
+
+    clock::rep full_time = m_full_time.load(std::memory_order_relaxed);
+    while (true) {
+      const clock::rep start = std::max(full_time, now_ticks);
+      if (start - now_ticks > tolerance) {
+        return false;
+      }
+      if (m_full_time.compare_exchange_weak(full_time, start + interval,
+                                            std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+
+  /**
+   * @brief Takes a token, waiting for it if the bucket is empty.
+   * @param rate Tokens added per second, must be positive.
+   * @param burst Max tokens in the bucket.
+   * @param now Current time.
+   * @return Time until the token is available, zero if it is available now.
+   */
+  clock::duration reserve(double rate, double burst,
+                          clock::time_point now = clock::now()) noexcept {
+    return reserve_tokens(1.0, rate, burst, now);
+  }
+
+  /**
+   * @brief Takes several tokens at once, e.g. one per byte.
+   * @param tokens Tokens to take, may be more than burst.
+   * @param rate Tokens added per second, must be positive.
+   * @param burst Max tokens in the bucket.
+   * @param now Current time.
+   * @return Time until the tokens are available, zero if they are available
+   * now.
+   */
+  clock::duration
+  reserve_tokens(double tokens, double rate, double burst,
+                 clock::time_point now = clock::now()) noexcept {
+    const clock::rep interval = toTicks(tokens / rate);
+    const clock::rep tolerance =
+        toTicks((std::max(burst, tokens) - tokens) / rate);
+    const clock::rep now_ticks = now.time_since_epoch().count();
+
+    clock::rep full_time = m_full_time.load(std::memory_order_relaxed);
+    clock::rep start = 0;
+    do {
+      start = std::max(full_time, now_ticks);
+    } while (!m_full_time.compare_exchange_weak(full_time, start + interval,
+                                                std::memory_order_relaxed));
+    return clock::duration(
+        std::max<clock::rep>(start - now_ticks - tolerance, 0));
+  }
+
+  /**
+   * @brief Gets the time at which the bucket will be full.
+   */
+  [[nodiscard]] clock::time_point get_full_time() const noexcept {
+    return clock::time_point(
+        clock::duration(m_full_time.load(std::memory_order_relaxed)));
+  }
+
+private:
+  static clock::rep toTicks(double seconds) noexcept {
+    return std::chrono::duration_cast<clock::duration>(
+               std::chrono::duration<double>(seconds))
+        .count();
+  }
+
+  std::atomic<clock::rep> m_full_time;
+};
+
+/**
+ * @brief Limits the rate of new connections per address and in total.
+ * @details The per-address buckets are split over shards picked by the hash
+ * of the address, so connections from different addresses rarely contend for
+ * the same lock. The global budget is a lock-free TokenBucket.
+ */
 class RateLimiter final {
 public:
   constexpr static double default_global_capacity = 500.0;
   constexpr static double default_single_capacity = 5.0;
-  constexpr static double default_small_float = 1e-9;
+  constexpr static std::size_t shard_num = 16;
   constexpr static std::chrono::seconds default_time_interval =
       std::chrono::seconds(30);
   constexpr static std::chrono::minutes default_clean_time_min =
@@ -29,42 +144,24 @@ public:
 
   bool allow_connection(const asio::ip::address &addr) {
     // Present timestamp
-    auto now = std::chrono::steady_clock::now();
-    // Get lock to keep thread-safe
-    std::unique_lock<spinlock_mutex> lock(m_token_buckets_mutex);
-    // Get bucket
-    auto &bucket = m_token_buckets[addr];
-    // Update tokens of bucket to check
-    // if the host associated with address sent too much connections in a short
-    // time
-    bucket.tokens =
-        std::min(m_single_capacity.load(),
-                 bucket.tokens +
-                     (static_cast<double>((now - bucket.last_update).count()) *
-                      default_small_float * m_single_capacity));
-    bucket.last_update = now;
-    bool allow = bucket.tokens-- > 0;
-    // Unlock the lock to keep speedy of the process
-    lock.unlock();
-
-    if (!allow) {
-      return false;
+    const auto now = TokenBucket::clock::now();
+    // Check if the host associated with address sent too much connections in
+    // a short time
+    const double single_capacity =
+        m_single_capacity.load(std::memory_order_relaxed);
+    Shard &shard = m_shards[std::hash<asio::ip::address>{}(addr) % shard_num];
+    {
+      std::lock_guard<spinlock_mutex> lock(shard.mutex);
+      if (!shard.buckets[addr].try_acquire(single_capacity, single_capacity,
+                                           now)) {
+        return false;
+      }
     }
 
-    // Get global token
-    double local_global_token = m_global_token.load();
-    // Update global tokens of bucket
-    local_global_token = std::min(
-        m_global_capacity.load(),
-        local_global_token +
-            (static_cast<double>((now - m_last_update.load()).count()) *
-             default_small_float * m_global_capacity));
-    if (local_global_token <= 0) {
-      allow = false;
-    }
-    m_global_token = local_global_token - 1;
-    m_last_update.store(now);
-    return allow;
+    // Take a token from the global bucket
+    const double global_capacity =
+        m_global_capacity.load(std::memory_order_relaxed);
+    return m_global_bucket.try_acquire(global_capacity, global_capacity, now);
   }
 
   void set_single_capacity(double single_capacity) {
@@ -83,30 +180,32 @@ public:
    * @brief clean the buckets out of date automatically
    */
   asio::awaitable<void> auto_clean() {
-    using namespace std::chrono_literals;
     asio::steady_timer timer(co_await asio::this_coro::executor);
     while (true) {
       timer.expires_after(default_time_interval);
       co_await timer.async_wait(asio::use_awaitable);
-      std::lock_guard<spinlock_mutex> lock(m_token_buckets_mutex);
-      std::erase_if(m_token_buckets, [](const auto &iter) {
-        return std::chrono::steady_clock::now() - iter.second.last_update >=
-               default_clean_time_min;
-      });
+      // Buckets that have been full for a while are the same as new ones
+      const auto expired_time =
+          TokenBucket::clock::now() - default_clean_time_min;
+      for (Shard &shard : m_shards) {
+        std::lock_guard<spinlock_mutex> lock(shard.mutex);
+        std::erase_if(shard.buckets, [expired_time](const auto &iter) {
+          return iter.second.get_full_time() <= expired_time;
+        });
+      }
     }
   }
 
 private:
-  struct TokenBucket {
-    double tokens = 0.0;
-    std::chrono::steady_clock::time_point last_update;
+  struct alignas(64) Shard {
+    std::unordered_map<asio::ip::address, TokenBucket> buckets;
+    spinlock_mutex mutex;
   };
+
   std::atomic<double> m_global_capacity;
-  std::atomic<double> m_global_token;
   std::atomic<double> m_single_capacity;
-  std::atomic<std::chrono::steady_clock::time_point> m_last_update;
-  std::unordered_map<asio::ip::address, TokenBucket> m_token_buckets;
-  mutable spinlock_mutex m_token_buckets_mutex;
+  TokenBucket m_global_bucket;
+  std::array<Shard, shard_num> m_shards;
 };
 
 } // namespace qls
@@ -13,6 +13,7 @@
 
 #include <Json.h>
 
+#include "binaryCodec.hpp"
 #include "manager.h"
 #include "qls_error.h"
 
@@ -171,7 +172,13 @@ void GroupRoom::sendMessage(const UserID &sender_user_id,
   json["data"]["group_id"] = m_impl->m_group_id.getOriginValue();
   json["data"]["message"] = message;
 
-  sendData(json.to_string());
+  // Clients using the binary protocol get the same push without JSON
+  BinaryWriter binary;
+  binary.writeVarint(static_cast<std::uint32_t>(BinaryPushType::GroupMessage))
+      .writeSigned(m_impl->m_group_id.getOriginValue())
+      .writeSigned(sender_user_id.getOriginValue())
+      .writeString(message);
+  sendFrame(Frame::makeTextFrame(json.to_string(), binary.release()));
 }
 
 void GroupRoom::sendTipMessage(const UserID &sender_user_id,
@@ -10,6 +10,7 @@
 
 #include <Json.h>
 
+#include "binaryCodec.hpp"
 #include "manager.h"
 #include "qls_error.h"
 
@@ -90,7 +91,12 @@ void PrivateRoom::sendMessage(std::string_view message,
   json["data"]["user_id"] = sender_user_id.getOriginValue();
   json["data"]["message"] = message;
 
-  sendData(json.to_string());
+  // Clients using the binary protocol get the same push without JSON
+  BinaryWriter binary;
+  binary.writeVarint(static_cast<std::uint32_t>(BinaryPushType::PrivateMessage))
+      .writeSigned(sender_user_id.getOriginValue())
+      .writeString(message);
+  sendFrame(Frame::makeTextFrame(json.to_string(), binary.release()));
 }
 
 void PrivateRoom::sendTipMessage(std::string_view message,
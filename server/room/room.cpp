@@ -5,6 +5,7 @@
 #include <mutex>
 #include <shared_mutex>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "dataPackage.hpp"
 #include "logger.hpp"
@@ -66,21 +67,29 @@ void TCPRoom::leaveRoom(UserID user_id) {
 }
 
 void TCPRoom::sendData(std::string_view data) {
+  sendFrame(Frame::makeEncodedFrame(std::string(data)));
+}
+
+void TCPRoom::sendData(std::string_view data, UserID user_id) {
+  sendFrame(Frame::makeEncodedFrame(std::string(data)), user_id);
+}
+
+void TCPRoom::sendFrame(const FramePtr &frame) {
   std::shared_lock lock(m_impl->m_user_map_mutex);
 
   for (const auto &[user_id, user_ptr] : std::as_const(m_impl->m_user_map)) {
-    if (!user_ptr.expired()) {
-      user_ptr.lock()->notifyAll(std::string_view(data));
+    if (auto user = user_ptr.lock(); user) {
+      user->notifyAll(frame);
     }
   }
 }
 
-void TCPRoom::sendData(std::string_view data, UserID user_id) {
+void TCPRoom::sendFrame(const FramePtr &frame, UserID user_id) {
   std::shared_lock lock(m_impl->m_user_map_mutex);
   if (m_impl->m_user_map.find(user_id) == m_impl->m_user_map.cend()) {
     throw std::logic_error("User id not in room.");
   }
-  serverManager.getUser(user_id)->notifyAll(std::move(data));
+  serverManager.getUser(user_id)->notifyAll(frame);
 }
 
 /*
@@ -96,7 +105,7 @@ struct KCPRoomImpl {
   std::pmr::unordered_map<UserID, std::weak_ptr<User>> m_user_map;
   mutable std::shared_mutex m_user_map_mutex;
 
-  std::pmr::unordered_set<std::shared_ptr<KCPSocket>> m_socket_map;
+  std::pmr::unordered_set<std::shared_ptr<Connection<KcpStream>>> m_socket_map;
   mutable std::shared_mutex m_socket_map_mutex;
 };
 
@@ -136,33 +145,50 @@ void KCPRoom::leaveRoom(UserID user_id) {
   m_impl->m_user_map.erase(iter);
 }
 
-void KCPRoom::addSocket(const std::shared_ptr<KCPSocket> &socket) {
+void KCPRoom::addSocket(
+    const std::shared_ptr<Connection<KcpStream>> &connection_ptr) {
   std::lock_guard<std::shared_mutex> lock(m_impl->m_socket_map_mutex);
-  m_impl->m_socket_map.emplace(socket);
+  m_impl->m_socket_map.emplace(connection_ptr);
 }
 
-bool KCPRoom::hasSocket(const std::shared_ptr<KCPSocket> &socket) const {
+bool KCPRoom::hasSocket(
+    const std::shared_ptr<Connection<KcpStream>> &connection_ptr) const {
   std::shared_lock lock(m_impl->m_socket_map_mutex);
-  return m_impl->m_socket_map.find(socket) != m_impl->m_socket_map.cend();
+  return m_impl->m_socket_map.find(connection_ptr) !=
+         m_impl->m_socket_map.cend();
 }
 
-void KCPRoom::removeSocket(const std::shared_ptr<KCPSocket> &socket) {
+void KCPRoom::removeSocket(
+    const std::shared_ptr<Connection<KcpStream>> &connection_ptr) {
   std::lock_guard<std::shared_mutex> lock(m_impl->m_socket_map_mutex);
-  auto iter = m_impl->m_socket_map.find(socket);
+  auto iter = m_impl->m_socket_map.find(connection_ptr);
   if (iter != m_impl->m_socket_map.end()) {
     m_impl->m_socket_map.erase(iter);
   }
 }
 
 void KCPRoom::sendData(std::string_view data) {
+  // Encode once for the whole room
+  auto frame = Frame::makeEncodedFrame(std::string(data));
   std::shared_lock lock(m_impl->m_socket_map_mutex);
-  for (const auto &socket : std::as_const(m_impl->m_socket_map)) {
-    socket->async_write_some(asio::buffer(std::string_view(data)),
-                             [](auto, auto) {});
+  for (const auto &connection_ptr : std::as_const(m_impl->m_socket_map)) {
+    connection_ptr->async_send(frame);
   }
 }
 
-void KCPRoom::sendData(std::string_view data, UserID user_id) {}
+void KCPRoom::sendData(std::string_view data, UserID user_id) {
+  if (!hasUser(user_id)) {
+    throw std::logic_error("User id not in room.");
+  }
+
+  auto frame = Frame::makeEncodedFrame(std::string(data));
+  std::shared_lock lock(m_impl->m_socket_map_mutex);
+  for (const auto &connection_ptr : std::as_const(m_impl->m_socket_map)) {
+    if (serverManager.matchUserOfConnection(connection_ptr, user_id)) {
+      connection_ptr->async_send(frame);
+    }
+  }
+}
 
 /*
  * ------------------------------------------------------------------------
@@ -171,15 +197,13 @@ void KCPRoom::sendData(std::string_view data, UserID user_id) {}
  */
 
 void TextDataRoom::sendData(std::string_view data) {
-  auto package = DataPackage::makePackage(std::move(data));
-  package->type = DataPackage::Text;
-  TCPRoom::sendData(package->packageToString());
+  // Encode once for the whole room
+  TCPRoom::sendFrame(Frame::makeFrame(std::string(data), DataPackage::Text));
 }
 
 void TextDataRoom::sendData(std::string_view data, UserID user_id) {
-  auto package = DataPackage::makePackage(std::move(data));
-  package->type = DataPackage::Text;
-  TCPRoom::sendData(package->packageToString(), user_id);
+  TCPRoom::sendFrame(Frame::makeFrame(std::string(data), DataPackage::Text),
+                     user_id);
 }
 
 } // namespace qls
@@ -7,7 +7,9 @@
 #include <memory_resource>
 #include <string_view>
 
-#include "socket.hpp"
+#include "connection.hpp"
+#include "frame.hpp"
+#include "kcpStream.hpp"
 
 #include "userid.hpp"
 
@@ -62,6 +64,13 @@ public:
   virtual void sendData(std::string_view data);
   virtual void sendData(std::string_view data, UserID user_id);
 
+  /**
+   * @brief Sends an encoded frame to every user in the room.
+   * @details The frame is shared by pointer, not copied per connection.
+   */
+  virtual void sendFrame(const FramePtr &frame);
+  virtual void sendFrame(const FramePtr &frame, UserID user_id);
+
 private:
   std::unique_ptr<TCPRoomImpl, TCPRoomImplDeleter> m_impl;
 };
@@ -86,13 +95,21 @@ public:
   [[nodiscard]] virtual bool hasUser(UserID user_id) const;
   virtual void leaveRoom(UserID user_id);
 
-  virtual void addSocket(const std::shared_ptr<KCPSocket> &socket);
+  virtual void
+  addSocket(const std::shared_ptr<Connection<KcpStream>> &connection_ptr);
   [[nodiscard]] virtual bool
-  hasSocket(const std::shared_ptr<KCPSocket> &socket) const;
-  virtual void removeSocket(const std::shared_ptr<KCPSocket> &socket);
+  hasSocket(const std::shared_ptr<Connection<KcpStream>> &connection_ptr) const;
+  virtual void
+  removeSocket(const std::shared_ptr<Connection<KcpStream>> &connection_ptr);
 
+  /**
+   * @brief Sends data to every KCP connection in the room.
+   */
   virtual void sendData(std::string_view data);
-  [[deprecated("This function is not useful at kcp connection")]]
+
+  /**
+   * @brief Sends data to the KCP connections of one user in the room.
+   */
   virtual void sendData(std::string_view data, UserID user_id);
 
 private:
@@ -1,94 +1,328 @@
 #include "socketFunctions.h"
 
 #include <Json.h>
+#include <algorithm>
 #include <asio/experimental/awaitable_operators.hpp>
+#include <chrono>
+#include <exception>
 #include <logger.hpp>
+#include <mutex>
+#include <set>
+#include <string>
 #include <system_error>
+#include <utility>
+#include <vector>
 
 #include "JsonMsgProcess.h"
 #include "dataPackage.hpp"
 #include "manager.h"
 #include "qls_error.h"
+#include "rateLimiter.hpp"
 #include "returnStateMessage.hpp"
+#include "user.h"
 #include "userid.hpp"
+#include "zstdCodec.hpp"
 
 extern Log::Logger serverLogger;
 extern qls::Manager serverManager;
 
 // SocketService
 namespace qls {
+namespace {
+
+// Throws before the impl, which uses the strand of the connection, is built
+const std::shared_ptr<BasicConnection> &
+checkConnection(const std::shared_ptr<BasicConnection> &connection_ptr) {
+  if (!connection_ptr) {
+    throw std::system_error(qls::qls_errc::null_socket_pointer);
+  }
+  return connection_ptr;
+}
+
+} // namespace
+
 struct SocketServiceImpl {
   // socket ptr
-  std::shared_ptr<Connection<asio::ip::tcp::socket>> m_connection_ptr;
+  std::shared_ptr<BasicConnection> m_connection_ptr;
   // JsonMsgProcess
   JsonMessageProcess m_jsonProcess;
+  // Messages of this connection
+  TokenBucket m_message_bucket;
+  // Bytes of file chunks of this connection
+  TokenBucket m_upload_bucket;
+  // Logged in user, cached for its message bucket
+  std::shared_ptr<User> m_user;
+  // Requests processed at once, 1 unless the client asked for pipelining
+  std::size_t m_max_requests = 1;
+  // Requests in flight, by the order they were received
+  std::set<SocketService::RequestSequence> m_requests;
+  // Requests in flight that later ones may not overtake: those that change
+  // the state of the connection and those not parsed yet
+  std::set<SocketService::RequestSequence> m_barriers;
+  SocketService::RequestSequence m_next_sequence = 0;
+  // Never expires, it is cancelled to wake up waiters whenever a request
+  // has finished
+  asio::steady_timer m_request_finished{
+      m_connection_ptr->strand, asio::steady_timer::time_point::max()};
+  // Streams to send after the responses to their requests
+  std::mutex m_pending_streams_mutex;
+  std::vector<std::pair<SocketService::RequestSequence,
+                        std::unique_ptr<BasicConnection::FragmentSource>>>
+      m_pending_streams;
+
+  asio::awaitable<void> wait_for_finished_request() {
+    std::error_code errorc;
+    co_await m_request_finished.async_wait(
+        asio::redirect_error(asio::use_awaitable, errorc));
+  }
+
+  void finish_request(SocketService::RequestSequence sequence) {
+    m_requests.erase(sequence);
+    m_barriers.erase(sequence);
+    m_request_finished.cancel();
+  }
 };
 
 SocketService::SocketService(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr)
-    : m_impl(std::make_unique<SocketServiceImpl>(connection_ptr, UserID(-1))) {
-  if (!connection_ptr) {
-    throw std::system_error(qls::qls_errc::null_socket_pointer);
-  }
-}
+    const std::shared_ptr<BasicConnection> &connection_ptr)
+    : m_impl(std::make_unique<SocketServiceImpl>(
+          checkConnection(connection_ptr), UserID(-1))) {}
 
 SocketService::~SocketService() noexcept = default;
 
-std::shared_ptr<Connection<asio::ip::tcp::socket>>
-SocketService::get_connection_ptr() const {
+std::shared_ptr<BasicConnection> SocketService::get_connection_ptr() const {
   return m_impl->m_connection_ptr;
 }
 
-asio::awaitable<void> SocketService::process(std::string_view data,
-                                             DataPackagePtr pack) {
-  auto async_send =
-      [this](std::string_view data, DataPackage::RequestIDType requestID = 0,
-             DataPackage::DataPackageType type = DataPackage::Unknown,
-             DataPackage::LengthType sequence = 0,
-             DataPackage::LengthType sequenceSize =
-                 1) -> asio::awaitable<std::size_t> {
-    auto pack = qls::DataPackage::makePackage(
-        std::move(data), type, sequenceSize, sequence, requestID);
-    // Send data to the connection
-    co_return co_await asio::async_write(
-        m_impl->m_connection_ptr->socket, asio::buffer(pack->packageToString()),
-        asio::bind_executor(m_impl->m_connection_ptr->strand,
-                            asio::use_awaitable));
+void SocketService::send_after_response(
+    RequestSequence sequence,
+    std::unique_ptr<BasicConnection::FragmentSource> source) const {
+  std::lock_guard lock(m_impl->m_pending_streams_mutex);
+  m_impl->m_pending_streams.emplace_back(sequence, std::move(source));
+}
+
+std::size_t SocketService::set_max_requests(std::size_t max_requests) const {
+  m_impl->m_max_requests =
+      std::clamp<std::size_t>(max_requests, 1, max_pipelined_requests);
+  // A dispatch waiting for a slot may go on now
+  m_impl->m_request_finished.cancel();
+  return m_impl->m_max_requests;
+}
+
+asio::awaitable<void>
+SocketService::wait_for_earlier_requests(RequestSequence sequence) const {
+  while (!m_impl->m_requests.empty() &&
+         *m_impl->m_requests.begin() < sequence) {
+    co_await m_impl->wait_for_finished_request();
+  }
+}
+
+void SocketService::release_later_requests(RequestSequence sequence) const {
+  if (m_impl->m_barriers.erase(sequence) != 0) {
+    m_impl->m_request_finished.cancel();
+  }
+}
+
+asio::awaitable<void> SocketService::dispatch(const DataPackageView &pack) {
+  auto &impl = *m_impl;
+  // File chunks must reach the disk in order and Binary packages are chat
+  // messages, neither of them can be told to keep their order
+  const bool ordered = pack.type == DataPackage::FileStream ||
+                       pack.type == DataPackage::Binary;
+  while (ordered ? !impl.m_requests.empty()
+                 : impl.m_requests.size() >= impl.m_max_requests ||
+                       !impl.m_barriers.empty()) {
+    co_await impl.wait_for_finished_request();
+  }
+  const RequestSequence sequence = impl.m_next_sequence++;
+  impl.m_requests.insert(sequence);
+
+  if (ordered || impl.m_max_requests == 1) {
+    // Processed before the next package is read
+    struct RequestGuard {
+      SocketServiceImpl &impl;
+      RequestSequence sequence;
+      ~RequestGuard() noexcept { impl.finish_request(sequence); }
+    } guard{impl, sequence};
+    co_await process(pack, sequence);
+    co_return;
+  }
+
+  // Holds back the next packages until the request turns out not to change
+  // the state of the connection
+  impl.m_barriers.insert(sequence);
+
+  // The view points into the receive buffer, which is reused for the next
+  // packages, so the request gets a copy
+  const auto &strand = impl.m_connection_ptr->strand;
+  asio::co_spawn(
+      strand,
+      [this, sequence, pack,
+       package = std::string(pack.getPackage())]() -> asio::awaitable<void> {
+        co_await process(pack.rebind(package), sequence);
+      },
+      asio::bind_executor(
+          strand, [this, sequence](std::exception_ptr exception) {
+            if (exception) {
+              try {
+                std::rethrow_exception(exception);
+              } catch (const std::exception &e) {
+                serverLogger.error(std::string(e.what()));
+              }
+              // Like a failed request that isn't pipelined, it ends the
+              // connection
+              m_impl->m_connection_ptr->close();
+            }
+            m_impl->finish_request(sequence);
+          }));
+}
+
+asio::awaitable<void> SocketService::wait_for_all_requests() {
+  while (!m_impl->m_requests.empty()) {
+    co_await m_impl->wait_for_finished_request();
+  }
+}
+
+asio::awaitable<void> SocketService::limit_message_rate() const {
+  // Limit the message rate of the connection and of the user
+  auto delay = m_impl->m_message_bucket.reserve(connection_message_rate,
+                                                connection_message_burst);
+  const UserID user_id = m_impl->m_jsonProcess.getLocalUserID();
+  if (user_id != -1LL) {
+    if (!m_impl->m_user || m_impl->m_user->getUserID() != user_id) {
+      m_impl->m_user = serverManager.getUser(user_id);
+    }
+    delay = std::max(delay, m_impl->m_user->getMessageBucket().reserve(
+                                user_message_rate, user_message_burst));
+  }
+  if (delay > std::chrono::steady_clock::duration::zero()) {
+    asio::steady_timer timer(co_await asio::this_coro::executor, delay);
+    co_await timer.async_wait(asio::use_awaitable);
+  }
+}
+
+asio::awaitable<void>
+SocketService::limit_upload_rate(std::size_t bytes) const {
+  const auto delay = m_impl->m_upload_bucket.reserve_tokens(
+      static_cast<double>(bytes), connection_upload_rate,
+      connection_upload_burst);
+  if (delay > std::chrono::steady_clock::duration::zero()) {
+    asio::steady_timer timer(co_await asio::this_coro::executor, delay);
+    co_await timer.async_wait(asio::use_awaitable);
+  }
+}
+
+asio::awaitable<void> SocketService::process(const DataPackageView &pack,
+                                             RequestSequence sequence) {
+  auto async_send = [this](std::string data,
+                           DataPackage::RequestIDType requestID = 0,
+                           DataPackage::DataPackageType type =
+                               DataPackage::Unknown) {
+    // Queue data on the connection, large responses are split into
+    // fragments so they don't hold up other packages
+    const auto &connection_ptr = m_impl->m_connection_ptr;
+    if (!connection_ptr->async_send_fragmented(std::move(data), type,
+                                               requestID)) {
+      serverLogger.warning("Send queue is full, dropped a response (",
+                           connection_ptr->get_queue_depth(), " pending, ",
+                           connection_ptr->get_queued_bytes(), " bytes)");
+    }
   };
 
   // Check whether the user was logged in
-  if (m_impl->m_jsonProcess.getLocalUserID() == -1LL &&
-      pack->type != DataPackage::Text) {
-    co_await async_send(makeErrorMessage("You haven't logged in!").to_string(),
-                        pack->requestID, DataPackage::Text);
+  const UserID user_id = m_impl->m_jsonProcess.getLocalUserID();
+  if (pack.type == DataPackage::FileStream && user_id != -1LL) {
+    // Chunks that fail to be written cost a message as well below, so only
+    // valid chunks, which are large, are charged by their bytes alone
+    co_await limit_upload_rate(pack.getData().size());
+  } else {
+    co_await limit_message_rate();
+  }
+  if (user_id == -1LL && pack.type != DataPackage::Text &&
+      pack.type != DataPackage::CompressedText) {
+    async_send(makeErrorMessage("You haven't logged in!").to_string(),
+               pack.requestID, DataPackage::Text);
     co_return;
   }
 
+  // Queue the streams the request asked for behind its response
+  auto send_pending_stream = [this, sequence]() {
+    // A batch may have started several streams, they go out in order
+    std::vector<std::unique_ptr<BasicConnection::FragmentSource>> sources;
+    {
+      std::lock_guard lock(m_impl->m_pending_streams_mutex);
+      auto &streams = m_impl->m_pending_streams;
+      for (auto &stream : streams) {
+        if (stream.first == sequence) {
+          sources.push_back(std::move(stream.second));
+        }
+      }
+      std::erase_if(streams, [sequence](const auto &stream) {
+        return stream.first == sequence;
+      });
+    }
+    for (auto &source : sources) {
+      m_impl->m_connection_ptr->async_send_stream(std::move(source));
+    }
+  };
+
   // Check the type of the data pack
-  switch (pack->type) {
+  switch (pack.type) {
   case DataPackage::Text:
     // json data type
-    co_await async_send((co_await m_impl->m_jsonProcess.processJsonMessage(
-                             qjson::to_json(std::move(data)), *this))
-                            .to_string(),
-                        pack->requestID, DataPackage::Text);
+    async_send((co_await m_impl->m_jsonProcess.processJsonMessage(
+                    pack.getData(), *this, sequence))
+                   .to_string(),
+               pack.requestID, DataPackage::Text);
+    send_pending_stream();
+    co_return;
+  case DataPackage::CompressedText:
+    // json data compressed by ZstdCodec
+    async_send((co_await m_impl->m_jsonProcess.processJsonMessage(
+                    ZstdCodec::decompress(pack.getData(),
+                                          max_decompressed_size),
+                    *this, sequence))
+                   .to_string(),
+               pack.requestID, DataPackage::Text);
+    send_pending_stream();
     co_return;
-  case DataPackage::FileStream:
-    // file stream type
-    co_await async_send(makeErrorMessage("Error type").to_string(),
-                        pack->requestID,
-                        DataPackage::Text); // Temporarily return an error
+  case DataPackage::FileStream: {
+    // a chunk of a file started with upload_file
+    std::error_code errorc;
+    try {
+      // The chunk stays in the receive buffer until it has been written
+      const bool finished =
+          co_await serverManager.getServerWorkerPool().async_run([&]() {
+            return serverManager.getServerFileManager().writeChunk(
+                user_id, pack.requestID, pack.sequence, pack.getData());
+          });
+      if (finished) {
+        auto returnJson = makeSuccessMessage("Successfully uploaded a file!");
+        returnJson["file_id"] = pack.requestID;
+        async_send(returnJson.to_string(), pack.requestID, DataPackage::Text);
+      }
+    } catch (const std::system_error &e) {
+      errorc = e.code();
+    }
+    if (errorc) {
+      // The client can resume from the offset upload_file returns
+      async_send(makeErrorMessage(errorc.message()).to_string(),
+                 pack.requestID, DataPackage::Text);
+      co_await limit_message_rate();
+    }
     co_return;
+  }
   case DataPackage::Binary:
-    // binary stream type
-    co_await async_send(makeErrorMessage("Error type").to_string(),
-                        pack->requestID,
-                        DataPackage::Text); // Temporarily return an error
+    // commands in the binary encoding, decoded without parsing JSON
+    async_send(co_await m_impl->m_jsonProcess.processBinaryMessage(
+                   pack.getData(), *this),
+               pack.requestID, DataPackage::Binary);
+    send_pending_stream();
     co_return;
   default:
     // unknown type
-    co_await async_send(makeErrorMessage("Error type").to_string(),
-                        pack->requestID, DataPackage::Text);
+    async_send(makeErrorMessage("Error type").to_string(), pack.requestID,
+               DataPackage::Text);
     co_return;
   }
   co_return;
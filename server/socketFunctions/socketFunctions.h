@@ -2,6 +2,9 @@
 #define SOCKET_FUNCTIONS_H
 
 #include <asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 
 #include "connection.hpp"
@@ -13,23 +16,130 @@ struct SocketServiceImpl;
 
 class SocketService final {
 public:
-  SocketService(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr);
+  /// Number of a request in the order it was received on the connection
+  using RequestSequence = std::uint64_t;
+
+  // Messages a connection may send per second and in one burst
+  constexpr static double connection_message_rate = 50.0;
+  constexpr static double connection_message_burst = 100.0;
+  // Messages all connections of a user may send per second and in one burst
+  constexpr static double user_message_rate = 100.0;
+  constexpr static double user_message_burst = 200.0;
+  // Bytes of file chunks a connection may send per second and in one burst
+  constexpr static double connection_upload_rate = 64.0 * 1024 * 1024;
+  constexpr static double connection_upload_burst = 8.0 * 1024 * 1024;
+  // Largest request a client may send as CompressedText once decompressed
+  constexpr static std::size_t max_decompressed_size = 1024 * 1024;
+  // Heartbeat intervals a client may ask for with set_heartbeat_interval
+  constexpr static std::chrono::seconds min_heart_beat_interval =
+      std::chrono::seconds(10);
+  constexpr static std::chrono::seconds max_heart_beat_interval =
+      std::chrono::minutes(5);
+  // Requests a client may have in flight at once with set_pipelining
+  constexpr static std::size_t max_pipelined_requests = 16;
+
+  SocketService(const std::shared_ptr<BasicConnection> &connection_ptr);
   ~SocketService() noexcept;
 
   /**
    * @brief Get the socket pointer
    * @return Connection pointer
    */
-  std::shared_ptr<Connection<asio::ip::tcp::socket>> get_connection_ptr() const;
+  std::shared_ptr<BasicConnection> get_connection_ptr() const;
+
+  /**
+   * @brief Sends a stream once the response to a request is queued
+   * @details Lets a request answer with its response first and then with
+   * packages such as the chunks of a file. A request may start several
+   * streams, they are sent in order. May be called from any thread.
+   * @param sequence The request the stream belongs to
+   * @param source The source of the packages
+   */
+  void send_after_response(
+      RequestSequence sequence,
+      std::unique_ptr<BasicConnection::FragmentSource> source) const;
+
+  /**
+   * @brief Sets how many requests of the connection are processed at once
+   * @details With more than one, a request no longer waits for the requests
+   * before it and clients match responses to requests by their requestID.
+   * Called on the strand of the connection.
+   * @param max_requests Number of requests, clamped to
+   * [1, max_pipelined_requests]
+   * @return The number of requests that was set
+   */
+  std::size_t set_max_requests(std::size_t max_requests) const;
+
+  /**
+   * @brief Waits until every request received before a request has finished
+   * @details Lets requests that depend on the ones before them keep their
+   * order while pipelining. Called on the strand of the connection.
+   * @param sequence The waiting request
+   */
+  asio::awaitable<void>
+  wait_for_earlier_requests(RequestSequence sequence) const;
+
+  /**
+   * @brief Lets the requests after a request start before it has finished
+   * @details While pipelining, a request holds back the packages after it
+   * until it has been parsed. Requests that don't change the state of the
+   * connection call this once they know it, the others keep the later
+   * requests waiting until they have finished. Called on the strand of the
+   * connection.
+   * @param sequence The request
+   */
+  void release_later_requests(RequestSequence sequence) const;
+
+  /**
+   * @brief Hands a received package over for processing
+   * @details Without pipelining the package is processed before this
+   * returns. Otherwise this only waits until fewer than the maximum number of
+   * requests are in flight, then the package is copied and processed in the
+   * background, and the next package waits until it has been released with
+   * release_later_requests. File chunks and Binary packages always keep
+   * their order: they wait for every request before them and hold back the
+   * ones after them. Called on the strand of the connection.
+   * @param pack View of the received data packet, must stay valid until the
+   * returned awaitable completes
+   */
+  asio::awaitable<void> dispatch(const DataPackageView &pack);
+
+  /**
+   * @brief Waits until no request is in flight
+   * @details Must be awaited before the service is destroyed.
+   */
+  asio::awaitable<void> wait_for_all_requests();
+
+  /**
+   * @brief Takes one message from the rate limits of the connection and user
+   * @details Waits until the message is allowed. Every received package
+   * but a file chunk takes one, requests that carry several others take one
+   * more for each.
+   * Called on the strand of the connection.
+   */
+  asio::awaitable<void> limit_message_rate() const;
+
+  /**
+   * @brief Takes the bytes of a file chunk from the upload rate limit
+   * @details File chunks are charged by their size instead of as messages,
+   * so an upload is not held to the message rate and doesn't use up the
+   * budget for chat messages. Called on the strand of the connection.
+   * @param bytes Size of the chunk
+   */
+  asio::awaitable<void> limit_upload_rate(std::size_t bytes) const;
 
   /**
    * @brief Process function
-   * @param connection_ptr Connection pointer
-   * @param data Decrypted data
-   * @param pack Original data packet
+   * @details Messages over the rate of the connection or its user are not
+   * dropped: processing waits until they are allowed, so a flooding client
+   * runs out of request slots and is slowed down by flow control instead of
+   * keeping the io thread busy.
+   * @param pack View of the received data packet, must stay valid until the
+   * returned awaitable completes
+   * @param sequence Number of the request
    */
-  asio::awaitable<void> process(std::string_view data, DataPackagePtr pack);
+  asio::awaitable<void> process(const DataPackageView &pack,
+                                RequestSequence sequence);
 
 private:
   std::unique_ptr<SocketServiceImpl> m_impl;
@@ -13,6 +13,7 @@
 
 #include "Json.h"
 #include "dataPackage.hpp"
+#include "frame.hpp"
 #include "groupRoom.h"
 #include "groupid.hpp"
 #include "logger.hpp"
@@ -64,12 +65,13 @@ struct UserImpl {
       m_user_group_verification_map_mutex; ///< Mutex for thread-safe access to
                                            ///< group verification map
 
-  std::unordered_map<std::shared_ptr<Connection<asio::ip::tcp::socket>>,
-                     DeviceType>
+  std::unordered_map<std::shared_ptr<BasicConnection>, DeviceType>
       m_connection_map; ///< Map of sockets associated with the user
   std::shared_mutex
       m_connection_map_mutex; ///< Mutex for thread-safe access to socket map
 
+  TokenBucket m_message_bucket; ///< Messages of all sockets of the user
+
   inline static ossl_proxy m_ossl_proxy = {};
   inline static md_proxy m_md_proxy = {m_ossl_proxy, "SHA3-512"};
 
@@ -88,10 +90,9 @@ struct UserImpl {
 template <class T>
   requires requires(T json_value) { qjson::JObject(json_value); }
 static inline void sendJsonToUser(const UserID &user_id, T &&json) {
-  auto pack = DataPackage::makePackage(
-      qjson::JObject(std::forward<T>(json)).to_string());
-  pack->type = DataPackage::Text;
-  serverManager.getUser(user_id)->notifyAll(pack->packageToString());
+  auto frame = Frame::makeFrame(
+      qjson::JObject(std::forward<T>(json)).to_string(), DataPackage::Text);
+  serverManager.getUser(user_id)->notifyAll(frame);
 }
 
 template <class T, class Func, std::input_iterator It, std::sentinel_for<It> S>
@@ -101,12 +102,11 @@ template <class T, class Func, std::input_iterator It, std::sentinel_for<It> S>
     qls::UserID{std::invoke(std::declval<Func>(), std::as_const(*iter))};
   }
 static inline void sendJsonToUser(It begin, S end, T &&json, Func &&func) {
-  auto pack = DataPackage::makePackage(
-      qjson::JObject(std::forward<T>(json)).to_string());
-  pack->type = DataPackage::Text;
+  // Encode once, every recipient shares the same frame
+  auto frame = Frame::makeFrame(
+      qjson::JObject(std::forward<T>(json)).to_string(), DataPackage::Text);
   for (; begin != end; ++begin) {
-    serverManager.getUser(std::invoke(func, *begin))
-        ->notifyAll(pack->packageToString());
+    serverManager.getUser(std::invoke(func, *begin))->notifyAll(frame);
   }
 }
 
@@ -561,9 +561,8 @@ User::getGroupVerificationList() const {
   return m_impl->m_user_group_verification_map;
 }
 
-void User::addConnection(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr,
-    DeviceType type) {
+void User::addConnection(const std::shared_ptr<BasicConnection> &connection_ptr,
+                         DeviceType type) {
   std::unique_lock lock(m_impl->m_connection_map_mutex);
   if (m_impl->m_connection_map.find(connection_ptr) !=
       m_impl->m_connection_map.cend()) {
@@ -574,16 +573,14 @@ void User::addConnection(
 }
 
 bool User::hasConnection(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr)
-    const {
+    const std::shared_ptr<BasicConnection> &connection_ptr) const {
   std::shared_lock lock(m_impl->m_connection_map_mutex);
   return m_impl->m_connection_map.find(connection_ptr) !=
          m_impl->m_connection_map.cend();
 }
 
 void User::modifyConnectionType(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr,
-    DeviceType type) {
+    const std::shared_ptr<BasicConnection> &connection_ptr, DeviceType type) {
   std::unique_lock lock(m_impl->m_connection_map_mutex);
   auto iter = m_impl->m_connection_map.find(connection_ptr);
   if (iter == m_impl->m_connection_map.cend()) {
@@ -595,7 +592,7 @@ void User::modifyConnectionType(
 }
 
 void User::removeConnection(
-    const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr) {
+    const std::shared_ptr<BasicConnection> &connection_ptr) {
   std::unique_lock lock(m_impl->m_connection_map_mutex);
   auto iter = m_impl->m_connection_map.find(connection_ptr);
   if (iter == m_impl->m_connection_map.cend()) {
@@ -606,43 +603,40 @@ void User::removeConnection(
   m_impl->m_connection_map.erase(iter);
 }
 
+TokenBucket &User::getMessageBucket() noexcept {
+  return m_impl->m_message_bucket;
+}
+
 void User::notifyAll(std::string_view data) {
+  notifyAll(Frame::makeEncodedFrame(std::string(data)));
+}
+
+void User::notifyAll(const FramePtr &frame) {
   std::shared_lock lock(m_impl->m_connection_map_mutex);
-  std::shared_ptr<std::string> buffer_ptr(std::allocate_shared<std::string>(
-      std::pmr::polymorphic_allocator<std::string>(
-          m_impl->m_local_memory_resouce),
-      std::string_view(data)));
   for (const auto &[connection_ptr, type] : m_impl->m_connection_map) {
-    asio::async_write(connection_ptr->socket, asio::buffer(*buffer_ptr),
-                      asio::bind_executor(
-                          connection_ptr->strand,
-                          [buffer_ptr](std::error_code errorc, std::size_t) {
-                            if (errorc) {
-                              serverLogger.error('[', errorc.category().name(),
-                                                 ']', errorc.message());
-                            }
-                          }));
+    if (!connection_ptr->async_send(frame)) {
+      serverLogger.warning("Send queue of user ",
+                           m_impl->user_id.getOriginValue(),
+                           " is full, dropped a notification (",
+                           connection_ptr->get_queue_depth(), " pending, ",
+                           connection_ptr->get_queued_bytes(), " bytes)");
+    }
   }
 }
 
 void User::notifyWithType(DeviceType type, std::string_view data) {
+  notifyWithType(type, Frame::makeEncodedFrame(std::string(data)));
+}
+
+void User::notifyWithType(DeviceType type, const FramePtr &frame) {
   std::shared_lock lock(m_impl->m_connection_map_mutex);
-  std::shared_ptr<std::string> buffer_ptr(std::allocate_shared<std::string>(
-      std::pmr::polymorphic_allocator<std::string>(
-          m_impl->m_local_memory_resouce),
-      std::string_view(data)));
   for (const auto &[connection_ptr, dtype] : m_impl->m_connection_map) {
-    if (dtype == type) {
-      asio::async_write(
-          connection_ptr->socket, asio::buffer(*buffer_ptr),
-          asio::bind_executor(
-              connection_ptr->strand,
-              [this, buffer_ptr](std::error_code errorc, std::size_t n) {
-                if (errorc) {
-                  serverLogger.error('[', errorc.category().name(), ']',
-                                     errorc.message());
-                }
-              }));
+    if (dtype == type && !connection_ptr->async_send(frame)) {
+      serverLogger.warning("Send queue of user ",
+                           m_impl->user_id.getOriginValue(),
+                           " is full, dropped a notification (",
+                           connection_ptr->get_queue_depth(), " pending, ",
+                           connection_ptr->get_queued_bytes(), " bytes)");
     }
   }
 }
@@ -12,7 +12,9 @@
 
 #include "connection.hpp"
 #include "definition.hpp"
+#include "frame.hpp"
 #include "groupid.hpp"
+#include "rateLimiter.hpp"
 
 #include "userid.hpp"
 
@@ -118,9 +120,8 @@ public:
    * @param connection_ptr Pointer to the socket to check.
    * @return true if user has the socket, false otherwise.
    */
-  [[nodiscard]] bool hasConnection(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr)
-      const;
+  [[nodiscard]] bool
+  hasConnection(const std::shared_ptr<BasicConnection> &connection_ptr) const;
 
   /**
    * @brief Modifies the type of a socket in the user's socket map.
@@ -128,8 +129,7 @@ public:
    * @param type New DeviceType associated with the socket.
    */
   void modifyConnectionType(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr,
-      DeviceType type);
+      const std::shared_ptr<BasicConnection> &connection_ptr, DeviceType type);
 
   /**
    * @brief Notifies all sockets associated with the user.
@@ -137,6 +137,12 @@ public:
    */
   void notifyAll(std::string_view data);
 
+  /**
+   * @brief Notifies all sockets associated with the user.
+   * @param frame Encoded frame shared by every socket's send queue.
+   */
+  void notifyAll(const FramePtr &frame);
+
   /**
    * @brief Notifies sockets of a specific DeviceType associated with the user.
    * @param type DeviceType of sockets to notify.
@@ -144,6 +150,13 @@ public:
    */
   void notifyWithType(DeviceType type, std::string_view data);
 
+  /**
+   * @brief Notifies sockets of a specific DeviceType associated with the user.
+   * @param type DeviceType of sockets to notify.
+   * @param frame Encoded frame shared by every socket's send queue.
+   */
+  void notifyWithType(DeviceType type, const FramePtr &frame);
+
   // Methods to update user information
 
   void updateUserName(std::string_view);
@@ -198,16 +211,20 @@ public:
    * @param connection_ptr Pointer to the socket to add.
    * @param type DeviceType associated with the socket.
    */
-  void addConnection(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr,
-      DeviceType type);
+  void addConnection(const std::shared_ptr<BasicConnection> &connection_ptr,
+                     DeviceType type);
 
   /**
    * @brief Removes a socket from the user's socket map.
    * @param connection_ptr Pointer to the socket to remove.
    */
-  void removeConnection(
-      const std::shared_ptr<Connection<asio::ip::tcp::socket>> &connection_ptr);
+  void removeConnection(const std::shared_ptr<BasicConnection> &connection_ptr);
+
+  /**
+   * @brief Gets the bucket limiting the messages of all the user's sockets.
+   * @return Reference to the bucket, valid as long as the user.
+   */
+  [[nodiscard]] TokenBucket &getMessageBucket() noexcept;
 
 private:
   std::unique_ptr<UserImpl, UserImplDeleter> m_impl;
@@ -0,0 +1,235 @@
+#ifndef SESSION_TICKET_KEYS_HPP
+#define SESSION_TICKET_KEYS_HPP
+
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+
+namespace qls {
+
+/**
+ * @brief Rotating keys for TLS session tickets.
+ * @details Lets clients resume a TLS 1.3 session without a full handshake.
+ * New tickets are always encrypted with the newest key, which is replaced
+ * once it is older than the rotation interval. Older keys are kept to decrypt
+ * tickets until they expire, and every resumption hands out a new ticket
+ * made with the current key.
+ */
+class session_ticket_keys {
+public:
+  constexpr static std::chrono::seconds default_rotation_interval =
+      std::chrono::hours(1);
+  constexpr static std::size_t default_key_num = 4;
+
+  /**
+   * @param rotation_interval Time a key is used to encrypt new tickets.
+   * @param key_num Number of keys kept, including the current one. Tickets
+   * live for rotation_interval * key_num.
+   */
+  session_ticket_keys(
+      std::chrono::seconds rotation_interval = default_rotation_interval,
+      std::size_t key_num = default_key_num)
+      : rotation_interval_(
+            std::max(rotation_interval, std::chrono::seconds(1))),
+        key_num_(std::max(key_num, std::size_t(1))) {
+    rotate();
+  }
+
+  session_ticket_keys(const session_ticket_keys &) = delete;
+  session_ticket_keys(session_ticket_keys &&) = delete;
+
+  ~session_ticket_keys() noexcept {
+    for (auto &key : keys_) {
+      OPENSSL_cleanse(&key, sizeof(key));
+    }
+  }
+
+  session_ticket_keys &operator=(const session_ticket_keys &) = delete;
+  session_ticket_keys &operator=(session_ticket_keys &&) = delete;
+
+  /**
+   * @brief Enables session tickets on a server context.
+   * @param ssl_context Native handle of the context.
+   * @param keys Keys to use, kept alive as long as the context.
+   */
+  static void install(SSL_CTX *ssl_context,
+                      std::shared_ptr<session_ticket_keys> keys) {
+    if (ssl_context == nullptr || !keys) {
+      throw std::logic_error("ssl context or ticket keys is null");
+    }
+
+    const auto lifetime =
+        static_cast<long>(keys->get_ticket_lifetime().count());
+    auto *holder = new std::shared_ptr<session_ticket_keys>(std::move(keys));
+    if (!SSL_CTX_set_ex_data(ssl_context, ex_data_index(), holder)) {
+      delete holder;
+      throw std::runtime_error("SSL_CTX_set_ex_data() failed");
+    }
+    SSL_CTX_clear_options(ssl_context, SSL_OP_NO_TICKET);
+    SSL_CTX_set_timeout(ssl_context, lifetime);
+    if (!SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_context,
+                                              &ticket_key_callback)) {
+      throw std::runtime_error("SSL_CTX_set_tlsext_ticket_key_evp_cb() failed");
+    }
+  }
+
+  /**
+   * @brief Makes a new key current and drops the oldest one.
+   */
+  void rotate() {
+    key new_key = make_key();
+    std::unique_lock lock(mutex_);
+    push_key(new_key);
+  }
+
+  /**
+   * @brief Gets how long a ticket can be used to resume a session.
+   */
+  [[nodiscard]] std::chrono::seconds get_ticket_lifetime() const noexcept {
+    return rotation_interval_ * static_cast<long long>(key_num_);
+  }
+
+private:
+  struct key {
+    std::array<unsigned char, 16> name;
+    std::array<unsigned char, 32> aes_key;
+    std::array<unsigned char, 32> hmac_key;
+    std::chrono::steady_clock::time_point created;
+  };
+
+  static key make_key() {
+    key new_key;
+    if (RAND_bytes(new_key.name.data(), new_key.name.size()) != 1 ||
+        RAND_priv_bytes(new_key.aes_key.data(), new_key.aes_key.size()) != 1 ||
+        RAND_priv_bytes(new_key.hmac_key.data(), new_key.hmac_key.size()) !=
+            1) {
+      OPENSSL_cleanse(&new_key, sizeof(new_key));
+      throw std::runtime_error("RAND_bytes() failed");
+    }
+    new_key.created = std::chrono::steady_clock::now();
+    return new_key;
+  }
+
+  // Must be called with mutex_ held
+  void push_key(key &new_key) {
+    keys_.push_front(new_key);
+    OPENSSL_cleanse(&new_key, sizeof(new_key));
+    while (keys_.size() > key_num_) {
+      OPENSSL_cleanse(&keys_.back(), sizeof(key));
+      keys_.pop_back();
+    }
+  }
+
+  void rotate_if_stale() {
+    auto is_stale = [this]() {
+      return std::chrono::steady_clock::now() - keys_.front().created >=
+             rotation_interval_;
+    };
+    {
+      std::shared_lock lock(mutex_);
+      if (!is_stale()) {
+        return;
+      }
+    }
+    key new_key = make_key();
+    std::unique_lock lock(mutex_);
+    if (is_stale()) {
+      push_key(new_key);
+    } else {
+      OPENSSL_cleanse(&new_key, sizeof(new_key));
+    }
+  }
+
+  static int ex_data_index() {
+    static const int index = SSL_CTX_get_ex_new_index(
+        0, nullptr, nullptr, nullptr,
+        [](void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *) {
+          delete static_cast<std::shared_ptr<session_ticket_keys> *>(ptr);
+        });
+    return index;
+  }
+
+  static bool set_hmac_key(EVP_MAC_CTX *hmac_context, const key &ticket_key) {
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(
+            OSSL_MAC_PARAM_KEY,
+            const_cast<unsigned char *>(ticket_key.hmac_key.data()),
+            ticket_key.hmac_key.size()),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                         const_cast<char *>("SHA256"), 0),
+        OSSL_PARAM_construct_end()};
+    return EVP_MAC_CTX_set_params(hmac_context, params) == 1;
+  }
+
+  static int ticket_key_callback(SSL *ssl, unsigned char *key_name,
+                                 unsigned char *iv,
+                                 EVP_CIPHER_CTX *cipher_context,
+                                 EVP_MAC_CTX *hmac_context, int encrypt) {
+    auto *holder = static_cast<std::shared_ptr<session_ticket_keys> *>(
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_data_index()));
+    if (holder == nullptr || !*holder) {
+      return -1;
+    }
+    session_ticket_keys &self = **holder;
+
+    if (encrypt) {
+      try {
+        self.rotate_if_stale();
+      } catch (...) {
+        // Keep using the current key
+      }
+
+      std::shared_lock lock(self.mutex_);
+      const key &ticket_key = self.keys_.front();
+      const int iv_length = EVP_CIPHER_get_iv_length(EVP_aes_256_cbc());
+      if (RAND_bytes(iv, iv_length) != 1) {
+        return -1;
+      }
+      std::memcpy(key_name, ticket_key.name.data(), ticket_key.name.size());
+      if (EVP_EncryptInit_ex(cipher_context, EVP_aes_256_cbc(), nullptr,
+                             ticket_key.aes_key.data(), iv) != 1 ||
+          !set_hmac_key(hmac_context, ticket_key)) {
+        return -1;
+      }
+      return 1;
+    }
+
+    std::shared_lock lock(self.mutex_);
+    auto iter = std::find_if(
+        self.keys_.cbegin(), self.keys_.cend(), [key_name](const key &k) {
+          return std::memcmp(k.name.data(), key_name, k.name.size()) == 0;
+        });
+    if (iter == self.keys_.cend()) {
+      // Unknown or expired key, fall back to a full handshake
+      return 0;
+    }
+    if (EVP_DecryptInit_ex(cipher_context, EVP_aes_256_cbc(), nullptr,
+                           iter->aes_key.data(), iv) != 1 ||
+        !set_hmac_key(hmac_context, *iter)) {
+      return -1;
+    }
+    // TLS 1.3 clients use a ticket only once, so always issue a new one
+    return 2;
+  }
+
+  const std::chrono::seconds rotation_interval_;
+  const std::size_t key_num_;
+  std::deque<key> keys_; ///< Newest key first.
+  mutable std::shared_mutex mutex_;
+};
+
+} // namespace qls
+
+#endif // !SESSION_TICKET_KEYS_HPP
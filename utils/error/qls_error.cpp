@@ -28,6 +28,8 @@ std::string qls_error_category::message(int Errval) const {
     return "data is too large";
   case qls_errc::hash_mismatched:
     return "hash mismatched";
+  case qls_errc::compression_failed:
+    return "compression failed";
 
   // network error
   case qls_errc::null_tls_context:
@@ -85,6 +87,16 @@ std::string qls_error_category::message(int Errval) const {
   case qls_errc::permission_denied:
     return "permission denied";
 
+  // file error
+  case qls_errc::file_not_existed:
+    return "file doesn't exist";
+  case qls_errc::too_many_uploads:
+    return "too many unfinished uploads";
+
+  // server error
+  case qls_errc::server_busy:
+    return "server is busy";
+
   default:
     break;
   }
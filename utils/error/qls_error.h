@@ -19,6 +19,7 @@ enum class qls_errc : std::uint8_t {
   data_too_small,
   data_too_large,
   hash_mismatched,
+  compression_failed,
 
   // network error
   null_tls_context,
@@ -52,7 +53,14 @@ enum class qls_errc : std::uint8_t {
 
   // permission error
   no_permission,
-  permission_denied
+  permission_denied,
+
+  // file error
+  file_not_existed,
+  too_many_uploads,
+
+  // server error
+  server_busy
 };
 std::error_code make_error_code(qls::qls_errc errc) noexcept;
 
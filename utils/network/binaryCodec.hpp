@@ -0,0 +1,135 @@
+#ifndef BINARY_CODEC_HPP
+#define BINARY_CODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include "qls_error.h"
+
+namespace qls {
+
+/**
+ * @brief Codes of the messages the server pushes to binary clients.
+ */
+enum class BinaryPushType : std::uint32_t {
+  PrivateMessage = 1, ///< sender user id, message
+  GroupMessage = 2    ///< group id, sender user id, message
+};
+
+/**
+ * @brief Result codes of binary responses.
+ */
+enum class BinaryResultState : std::uint32_t { Success = 0, Error = 1 };
+
+/**
+ * @brief Appends fields in the binary command encoding.
+ * @details Unsigned integers are LEB128 varints, signed integers are
+ * zigzag encoded first so small negative numbers stay short, strings are a
+ * varint length followed by the bytes and booleans are one byte.
+ */
+class BinaryWriter final {
+public:
+  BinaryWriter() = default;
+  ~BinaryWriter() noexcept = default;
+
+  BinaryWriter &writeVarint(std::uint64_t value) {
+    while (value >= 0x80) {
+      m_data.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+    m_data.push_back(static_cast<char>(value));
+    return *this;
+  }
+
+  BinaryWriter &writeSigned(std::int64_t value) {
+    return writeVarint((static_cast<std::uint64_t>(value) << 1) ^
+                       static_cast<std::uint64_t>(value >> 63));
+  }
+
+  BinaryWriter &writeString(std::string_view value) {
+    writeVarint(value.size());
+    m_data.append(value);
+    return *this;
+  }
+
+  BinaryWriter &writeBool(bool value) {
+    m_data.push_back(value ? '\1' : '\0');
+    return *this;
+  }
+
+  /**
+   * @brief Takes the encoded data, the writer is empty afterwards.
+   */
+  [[nodiscard]] std::string release() noexcept { return std::move(m_data); }
+
+private:
+  std::string m_data;
+};
+
+/**
+ * @brief Reads fields written by BinaryWriter straight from a package.
+ * @details Strings are returned as views into the package, nothing is
+ * copied. Every read throws std::system_error with qls_errc::invalid_data
+ * if the data is truncated or malformed.
+ */
+class BinaryReader final {
+public:
+  explicit BinaryReader(std::string_view data) noexcept : m_data(data) {}
+  ~BinaryReader() noexcept = default;
+
+  [[nodiscard]] std::uint64_t readVarint() {
+    std::uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      if (m_pos >= m_data.size()) {
+        throw std::system_error(qls_errc::invalid_data);
+      }
+      const auto byte = static_cast<unsigned char>(m_data[m_pos++]);
+      value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    // More than ten bytes can't be a 64 bit number
+    throw std::system_error(qls_errc::invalid_data);
+  }
+
+  [[nodiscard]] std::int64_t readSigned() {
+    const std::uint64_t value = readVarint();
+    return static_cast<std::int64_t>(value >> 1) ^
+           -static_cast<std::int64_t>(value & 1);
+  }
+
+  [[nodiscard]] std::string_view readString() {
+    const std::uint64_t size = readVarint();
+    if (size > m_data.size() - m_pos) {
+      throw std::system_error(qls_errc::invalid_data);
+    }
+    const auto result = m_data.substr(m_pos, static_cast<std::size_t>(size));
+    m_pos += static_cast<std::size_t>(size);
+    return result;
+  }
+
+  [[nodiscard]] bool readBool() {
+    if (m_pos >= m_data.size()) {
+      throw std::system_error(qls_errc::invalid_data);
+    }
+    return m_data[m_pos++] != '\0';
+  }
+
+  /**
+   * @brief Checks if every byte has been read.
+   */
+  [[nodiscard]] bool empty() const noexcept { return m_pos == m_data.size(); }
+
+private:
+  std::string_view m_data;
+  std::size_t m_pos = 0;
+};
+
+} // namespace qls
+
+#endif // !BINARY_CODEC_HPP
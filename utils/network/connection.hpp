@@ -1,29 +1,579 @@
 #ifndef CONNECTION_HPP
 #define CONNECTION_HPP
 
+#include <algorithm>
+#include <array>
 #include <asio.hpp>
 #include <asio/ssl/stream.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "dataPackage.hpp"
+#include "frame.hpp"
+#include "kernelTls.hpp"
+#include "networkEndianness.hpp"
+#include "zstdCodec.hpp"
 
 namespace qls {
 
-template <class T> struct Connection {
-  // Socket used to send and receive data
-  asio::ssl::stream<T> socket;
+/**
+ * @brief The transport independent part of a connection.
+ * @details Owns the send queue and activity stamp shared by TCP and KCP
+ * connections. Users, rooms and the manager only need this interface.
+ */
+struct BasicConnection : public std::enable_shared_from_this<BasicConnection> {
+  // Max bytes waiting in the send queue before new data is refused
+  constexpr static std::size_t default_max_queued_bytes = 16 * 1024 * 1024;
+  // Max data in one fragment of a message sent with async_send_fragmented
+  constexpr static std::size_t default_fragment_size = 64 * 1024;
+
   // Keep the sending and receiving data thread-safe
-  // (but must be kept by hand)
-  // E.g: asio::async_write(socket, asio::buffer(data),
+  // (reads must be bound by hand, writes go through async_send)
+  // E.g: socket.async_read_some(asio::buffer(data),
   // asio::bind_executor(strand, token))
   asio::strand<asio::any_io_executor> strand;
 
+  BasicConnection(const asio::any_io_executor &executor)
+      : strand(asio::make_strand(executor)),
+        m_last_activity(
+            std::chrono::steady_clock::now().time_since_epoch().count()) {}
+  BasicConnection(const BasicConnection &) = delete;
+  BasicConnection(BasicConnection &&) = delete;
+  virtual ~BasicConnection() noexcept = default;
+
+  BasicConnection &operator=(const BasicConnection &) = delete;
+  BasicConnection &operator=(BasicConnection &&) = delete;
+
+  /**
+   * @brief Queues data to be sent to the connection.
+   * @details All data is written by a single writer coroutine on the strand,
+   * which gathers the header and data buffers of every pending frame into one
+   * async_write. Callers never touch the socket, so writes can't overlap on
+   * the ssl stream.
+   * @param data The frame to send, kept alive until it has been written.
+   * Text is replaced by its binary frame if the binary protocol is enabled,
+   * or by its compressed frame if compression is enabled.
+   * @return false if the connection has failed or the queue is full and the
+   * frame was dropped.
+   */
+  bool async_send(FramePtr data) {
+    if (!data || !data->size()) {
+      return true;
+    }
+    if (m_has_failed.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    if (m_binary_protocol.load(std::memory_order_relaxed) &&
+        data->getBinary()) {
+      data = data->getBinary();
+    } else if (m_compression.load(std::memory_order_relaxed)) {
+      if (FramePtr compressed = data->getCompressed(); compressed) {
+        data = std::move(compressed);
+      }
+    }
+
+    const std::size_t size = data->size();
+    if (!reserve_queue(size, 1)) {
+      return false;
+    }
+
+    asio::post(strand, [self = this->shared_from_this(),
+                        data = std::move(data)]() mutable {
+      if (self->m_has_failed) {
+        self->release_queue(data->size(), 1);
+        return;
+      }
+      self->m_send_queue.push_back(std::move(data));
+      self->start_writing();
+    });
+    return true;
+  }
+
+  /**
+   * @brief Queues a large message to be sent as a sequence of fragments.
+   * @details The message is split into packages of at most
+   * default_fragment_size bytes that share the requestID and are numbered by
+   * sequence. The writer makes one fragment of every message per write, so
+   * frames queued in the meantime go out between the fragments instead of
+   * waiting for the whole message. Small messages are sent as one frame.
+   * @param data The data of the message.
+   * @return false if the connection has failed or the queue is full and the
+   * message was dropped.
+   */
+  bool async_send_fragmented(
+      std::string data, DataPackage::DataPackageType type = DataPackage::Text,
+      DataPackage::RequestIDType requestID = 0) {
+    if (m_has_failed.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    if (data.size() > default_fragment_size && type == DataPackage::Text &&
+        m_compression.load(std::memory_order_relaxed)) {
+      // Compress the whole message, not every fragment on its own
+      try {
+        std::string compressed = ZstdCodec::compress(data);
+        if (compressed.size() < data.size()) {
+          data = std::move(compressed);
+          type = DataPackage::CompressedText;
+        }
+      } catch (const std::system_error &) {
+        // Send the message uncompressed
+      }
+    }
+    if (data.size() <= default_fragment_size) {
+      return async_send(
+          Frame::makeFrame(std::move(data), type, 1, 0, requestID));
+    }
+
+    const std::size_t fragment_num =
+        (data.size() + default_fragment_size - 1) / default_fragment_size;
+    const std::size_t size =
+        data.size() + fragment_num * DataPackage::header_size;
+    if (!reserve_queue(size, fragment_num)) {
+      return false;
+    }
+
+    FragmentStream stream{std::move(data), type, requestID,
+                          static_cast<DataPackage::LengthType>(fragment_num)};
+    asio::post(strand, [self = this->shared_from_this(),
+                        stream = std::move(stream)]() mutable {
+      if (self->m_has_failed) {
+        self->release_queue(stream.remaining_bytes(),
+                            stream.remaining_fragments());
+        return;
+      }
+      self->m_fragment_streams.push_back(std::move(stream));
+      self->start_writing();
+    });
+    return true;
+  }
+
+  /**
+   * @brief Makes the fragments of a message while it is being written.
+   * @details Lets a message be sent from a source such as a file without
+   * holding all of it in memory. Awaited on the strand of the connection,
+   * so a source that has to wait for its data should do so asynchronously.
+   */
+  struct FragmentSource {
+    virtual ~FragmentSource() noexcept = default;
+
+    /**
+     * @brief Makes the next fragment.
+     * @details Throwing drops the rest of the message without telling the
+     * peer, so a source that can fail should end with a frame that says so.
+     * @return The fragment, null once the message is complete.
+     */
+    virtual asio::awaitable<FramePtr> async_next_fragment() = 0;
+  };
+
+  /**
+   * @brief Queues a message made by a FragmentSource.
+   * @details Like async_send_fragmented(), one fragment is written at a time
+   * between other frames. Only fragments that have been made count towards
+   * the queue limit. If the source throws, the rest of the message is
+   * dropped.
+   * @param source The source of the fragments.
+   * @return false if the connection has failed.
+   */
+  bool async_send_stream(std::unique_ptr<FragmentSource> source) {
+    if (!source) {
+      return true;
+    }
+    if (m_has_failed.load(std::memory_order_relaxed)) {
+      return false;
+    }
+
+    asio::post(strand, [self = this->shared_from_this(),
+                        source = std::move(source)]() mutable {
+      if (self->m_has_failed) {
+        return;
+      }
+      self->m_fragment_sources.push_back(std::move(source));
+      self->start_writing();
+    });
+    return true;
+  }
+
+  /**
+   * @brief Closes the connection, aborting pending reads.
+   */
+  virtual void close() = 0;
+
+  /**
+   * @brief Gets the number of frames waiting to be written.
+   */
+  [[nodiscard]] std::size_t get_queue_depth() const noexcept {
+    return m_queue_depth.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Gets the number of bytes waiting to be written.
+   */
+  [[nodiscard]] std::size_t get_queued_bytes() const noexcept {
+    return m_queued_bytes.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Records that data has been received from the connection.
+   * @param time_point Time of the activity, usually a coarse clock.
+   */
+  void update_last_activity(
+      std::chrono::steady_clock::time_point time_point) noexcept {
+    m_last_activity.store(time_point.time_since_epoch().count(),
+                          std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Gets the time data was last received from the connection.
+   */
+  [[nodiscard]] std::chrono::steady_clock::time_point
+  get_last_activity() const noexcept {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::steady_clock::duration(
+            m_last_activity.load(std::memory_order_relaxed)));
+  }
+
+  /**
+   * @brief Enables or disables compression of text packages.
+   * @details Compressed packages are sent as CompressedText, see ZstdCodec.
+   * @param compression True if the client can decompress them.
+   */
+  void set_compression(bool compression) noexcept {
+    m_compression.store(compression, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Checks whether text packages are compressed.
+   */
+  [[nodiscard]] bool is_compression_enabled() const noexcept {
+    return m_compression.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Enables or disables the binary protocol for pushed messages.
+   * @details Frames that have a binary encoding are sent as Binary
+   * packages, see Frame::makeTextFrame().
+   * @param binary_protocol True if the client reads Binary packages.
+   */
+  void set_binary_protocol(bool binary_protocol) noexcept {
+    m_binary_protocol.store(binary_protocol, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Checks whether pushed messages use the binary protocol.
+   */
+  [[nodiscard]] bool is_binary_protocol_enabled() const noexcept {
+    return m_binary_protocol.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Enables or disables the compact header of protocol version 2.
+   * @details Applies to every frame written afterwards, except Hello frames.
+   * @param compact_header True once version 2 has been negotiated.
+   */
+  void set_compact_header(bool compact_header) noexcept {
+    m_compact_header.store(compact_header, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Checks whether frames are written with the compact header.
+   */
+  [[nodiscard]] bool is_compact_header_enabled() const noexcept {
+    return m_compact_header.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Enables or disables the CRC32C trailer after every frame.
+   * @details Applies to every frame written afterwards, except Hello frames.
+   * @param checksum True once the client has asked for the capability.
+   */
+  void set_checksum(bool checksum) noexcept {
+    m_checksum.store(checksum, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Checks whether frames are followed by their CRC32C.
+   */
+  [[nodiscard]] bool is_checksum_enabled() const noexcept {
+    return m_checksum.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Sets the heartbeat interval the client agreed to use.
+   * @param interval Time between two heartbeats, zero for the default.
+   */
+  void set_heartbeat_interval(std::chrono::seconds interval) noexcept {
+    m_heartbeat_interval.store(interval.count(), std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Gets the heartbeat interval the client agreed to use.
+   * @return Zero if the client didn't ask for an interval.
+   */
+  [[nodiscard]] std::chrono::seconds get_heartbeat_interval() const noexcept {
+    return std::chrono::seconds(
+        m_heartbeat_interval.load(std::memory_order_relaxed));
+  }
+
+protected:
+  /**
+   * @brief Writes a batch of buffers to the transport.
+   * @details Called on the strand, never concurrently.
+   */
+  virtual asio::awaitable<void>
+  write_buffers(const std::vector<asio::const_buffer> &buffers) = 0;
+
+  /**
+   * @brief Checks that nothing is being written or waiting to be written.
+   * @details Must be called on the strand.
+   */
+  [[nodiscard]] bool is_send_idle() const noexcept {
+    return !m_is_writing && m_send_queue.empty() &&
+           m_fragment_streams.empty() && m_fragment_sources.empty();
+  }
+
+private:
+  // A message sent with async_send_fragmented, split as it is written
+  struct FragmentStream {
+    std::string data;
+    DataPackage::DataPackageType type;
+    DataPackage::RequestIDType requestID;
+    DataPackage::LengthType sequenceSize;
+    DataPackage::LengthType sequence = 0;
+
+    FramePtr next_fragment() {
+      const std::size_t offset = sequence * default_fragment_size;
+      return Frame::makeFrame(data.substr(offset, default_fragment_size), type,
+                              sequenceSize, sequence++, requestID);
+    }
+
+    [[nodiscard]] bool is_finished() const noexcept {
+      return sequence == sequenceSize;
+    }
+
+    [[nodiscard]] std::size_t remaining_fragments() const noexcept {
+      return sequenceSize - sequence;
+    }
+
+    [[nodiscard]] std::size_t remaining_bytes() const noexcept {
+      const std::size_t offset =
+          std::min(sequence * default_fragment_size, data.size());
+      return data.size() - offset +
+             remaining_fragments() * DataPackage::header_size;
+    }
+  };
+
+  bool reserve_queue(std::size_t bytes, std::size_t frames) noexcept {
+    if (m_queued_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes >
+        default_max_queued_bytes) {
+      m_queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+      return false;
+    }
+    m_queue_depth.fetch_add(frames, std::memory_order_relaxed);
+    return true;
+  }
+
+  void release_queue(std::size_t bytes, std::size_t frames) noexcept {
+    m_queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    m_queue_depth.fetch_sub(frames, std::memory_order_relaxed);
+  }
+
+  // Must be called on the strand
+  void start_writing() {
+    if (!m_is_writing) {
+      m_is_writing = true;
+      asio::co_spawn(strand, write_loop(), asio::detached);
+    }
+  }
+
+  asio::awaitable<void> write_loop() {
+    auto self = this->shared_from_this();
+    std::vector<FramePtr> batch;
+    std::vector<asio::const_buffer> buffers;
+    std::vector<std::array<char, DataPackage::checksum_size>> trailers;
+    try {
+      while (!m_send_queue.empty() || !m_fragment_streams.empty() ||
+             !m_fragment_sources.empty()) {
+        // Take everything queued so far and write it in one go
+        batch.assign(std::make_move_iterator(m_send_queue.begin()),
+                     std::make_move_iterator(m_send_queue.end()));
+        m_send_queue.clear();
+        // Add the next fragment of every large message
+        for (auto iter = m_fragment_streams.begin();
+             iter != m_fragment_streams.end();) {
+          batch.push_back(iter->next_fragment());
+          if (iter->is_finished()) {
+            iter = m_fragment_streams.erase(iter);
+          } else {
+            ++iter;
+          }
+        }
+        // Sources may be added while one is awaited, so use indices
+        for (std::size_t i = 0; i < m_fragment_sources.size();) {
+          FramePtr fragment = co_await make_fragment(*m_fragment_sources[i]);
+          if (!fragment) {
+            m_fragment_sources.erase(m_fragment_sources.begin() +
+                                     static_cast<std::ptrdiff_t>(i));
+            continue;
+          }
+          // Made on demand, so it is only counted now
+          m_queued_bytes.fetch_add(fragment->size(), std::memory_order_relaxed);
+          m_queue_depth.fetch_add(1, std::memory_order_relaxed);
+          batch.push_back(std::move(fragment));
+          ++i;
+        }
+        if (batch.empty()) {
+          continue;
+        }
+
+        std::size_t bytes = 0;
+        buffers.clear();
+        const bool compact = m_compact_header.load(std::memory_order_relaxed);
+        const bool checksum = m_checksum.load(std::memory_order_relaxed);
+        // Sized up front, buffers point into it
+        trailers.resize(batch.size());
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+          const auto &data = batch[i];
+          for (const auto &buffer : data->buffers(compact)) {
+            if (buffer.size()) {
+              buffers.push_back(buffer);
+            }
+          }
+          if (checksum && data->getType() != DataPackage::Hello) {
+            storeNetworkEndianness(trailers[i].data(),
+                                   data->getChecksum(compact));
+            buffers.push_back(asio::buffer(trailers[i]));
+          }
+          bytes += data->size();
+        }
+        co_await write_buffers(buffers);
+
+        release_queue(bytes, batch.size());
+        batch.clear();
+      }
+    } catch (const std::system_error &) {
+      // The connection is broken, drop everything that is left
+      m_has_failed = true;
+      for (const auto &data : batch) {
+        release_queue(data->size(), 1);
+      }
+      for (const auto &data : m_send_queue) {
+        release_queue(data->size(), 1);
+      }
+      m_send_queue.clear();
+      for (const auto &stream : m_fragment_streams) {
+        release_queue(stream.remaining_bytes(), stream.remaining_fragments());
+      }
+      m_fragment_streams.clear();
+      m_fragment_sources.clear();
+    }
+    m_is_writing = false;
+  }
+
+  static asio::awaitable<FramePtr> make_fragment(FragmentSource &source) {
+    try {
+      co_return co_await source.async_next_fragment();
+    } catch (...) {
+      // Only this message is lost, not the connection
+      co_return nullptr;
+    }
+  }
+
+  // Only accessed on the strand
+  std::deque<FramePtr> m_send_queue;
+  std::vector<FragmentStream> m_fragment_streams;
+  std::vector<std::unique_ptr<FragmentSource>> m_fragment_sources;
+  bool m_is_writing = false;
+
+  std::atomic<std::size_t> m_queue_depth = 0;
+  std::atomic<std::size_t> m_queued_bytes = 0;
+  std::atomic<bool> m_has_failed = false;
+  std::atomic<std::chrono::steady_clock::rep> m_last_activity;
+  std::atomic<std::chrono::seconds::rep> m_heartbeat_interval = 0;
+  std::atomic<bool> m_compression = false;
+  std::atomic<bool> m_binary_protocol = false;
+  std::atomic<bool> m_compact_header = false;
+  std::atomic<bool> m_checksum = false;
+};
+
+/**
+ * @brief A TLS connection over a stream transport.
+ * @tparam T The transport, e.g. asio::ip::tcp::socket or KcpStream.
+ */
+template <class T> struct Connection final : public BasicConnection {
+  // Socket used to send and receive data
+  asio::ssl::stream<T> socket;
+
   template <class U>
   Connection(U &&lsocket, asio::ssl::context &context)
-      : socket(std::forward<U>(lsocket), context),
-        strand(asio::make_strand(socket.get_executor())) {}
+      : BasicConnection(lsocket.get_executor()),
+        socket(std::forward<U>(lsocket), context) {}
 
   ~Connection() noexcept {
     std::error_code errorc;
+    if (m_kernel_tls_tx) {
+      // OpenSSL's record sequence is stale, don't send close_notify with it
+      errorc = socket.lowest_layer().close(errorc);
+      return;
+    }
     errorc = socket.shutdown(errorc);
   }
+
+  void close() override {
+    asio::post(strand, [self = this->shared_from_this(), this]() {
+      std::error_code errorc;
+      errorc = socket.lowest_layer().close(errorc);
+    });
+  }
+
+  /**
+   * @brief Hands encryption of outgoing data to the kernel (kTLS).
+   * @details Must be called right after the handshake of a connection tracked
+   * with trackKernelTls(). Falls back to OpenSSL if the kernel or cipher
+   * doesn't support kTLS. Received data is still decrypted by OpenSSL.
+   * @return true if kTLS is active for outgoing data.
+   */
+  asio::awaitable<bool> enable_kernel_tls_tx() {
+    // Switch keys on the strand, so no write can be in progress
+    co_return co_await asio::co_spawn(strand, do_enable_kernel_tls_tx(),
+                                      asio::use_awaitable);
+  }
+
+  /**
+   * @brief Checks whether outgoing data is encrypted by the kernel.
+   */
+  [[nodiscard]] bool is_kernel_tls_enabled() const noexcept {
+    return m_kernel_tls_tx;
+  }
+
+protected:
+  asio::awaitable<void>
+  write_buffers(const std::vector<asio::const_buffer> &buffers) override {
+    if (m_kernel_tls_tx) {
+      // The kernel encrypts plaintext written to the TCP socket
+      co_await asio::async_write(socket.next_layer(), buffers,
+                                 asio::use_awaitable);
+    } else {
+      co_await asio::async_write(socket, buffers, asio::use_awaitable);
+    }
+  }
+
+private:
+  asio::awaitable<bool> do_enable_kernel_tls_tx() {
+    auto self = this->shared_from_this();
+    if (!m_kernel_tls_tx && is_send_idle()) {
+      m_kernel_tls_tx = enableKernelTlsTx(socket.native_handle(),
+                                          socket.next_layer().native_handle());
+    }
+    co_return m_kernel_tls_tx.load();
+  }
+
+  std::atomic<bool> m_kernel_tls_tx = false;
 };
 
 } // namespace qls
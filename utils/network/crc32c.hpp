@@ -0,0 +1,212 @@
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#define QLS_CRC32C_X86
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define QLS_CRC32C_ARM
+#endif
+
+namespace qls {
+
+namespace detail {
+
+#if defined(QLS_CRC32C_X86) && !defined(_MSC_VER)
+#define QLS_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define QLS_TARGET_SSE42
+#endif
+
+// Table of the reflected Castagnoli polynomial for the portable version
+inline constexpr std::array<std::uint32_t, 256> crc32c_table = []() {
+  std::array<std::uint32_t, 256> table{};
+  for (std::uint32_t i = 0; i < 256; ++i) {
+    std::uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0x82f63b78U & (0U - (crc & 1)));
+    }
+    table[i] = crc;
+  }
+  return table;
+}();
+
+inline std::uint32_t crc32cPortable(std::uint32_t crc, const char *data,
+                                    std::size_t size) noexcept {
+  for (std::size_t i = 0; i < size; ++i) {
+    crc = crc32c_table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^
+          (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(QLS_CRC32C_X86) || defined(QLS_CRC32C_ARM)
+// The crc instruction has a latency of three cycles but can start every
+// cycle, so long data is checksummed as three interleaved blocks. The
+// checksums of the blocks are joined by shifting them over the length of a
+// block, which is a linear operator over GF(2) applied with byte tables.
+inline constexpr std::size_t crc32c_long_block = 8192;
+inline constexpr std::size_t crc32c_short_block = 256;
+
+using Crc32cShiftTable = std::array<std::array<std::uint32_t, 256>, 4>;
+
+constexpr std::uint32_t gf2MatrixTimes(const std::array<std::uint32_t, 32> &mat,
+                                       std::uint32_t vec) {
+  std::uint32_t sum = 0;
+  for (std::size_t i = 0; vec; vec >>= 1, ++i) {
+    if (vec & 1) {
+      sum ^= mat[i];
+    }
+  }
+  return sum;
+}
+
+constexpr Crc32cShiftTable makeCrc32cShiftTable(std::size_t size) {
+  // Operator for one zero bit, squared until it covers size bytes
+  std::array<std::uint32_t, 32> op{};
+  op[0] = 0x82f63b78U;
+  for (std::size_t i = 1; i < 32; ++i) {
+    op[i] = 1U << (i - 1);
+  }
+  for (std::size_t bits = 1; bits < size * 8; bits *= 2) {
+    std::array<std::uint32_t, 32> square{};
+    for (std::size_t i = 0; i < 32; ++i) {
+      square[i] = gf2MatrixTimes(op, op[i]);
+    }
+    op = square;
+  }
+
+  Crc32cShiftTable table{};
+  for (std::uint32_t i = 0; i < 256; ++i) {
+    for (std::size_t j = 0; j < 4; ++j) {
+      table[j][i] = gf2MatrixTimes(op, i << (8 * j));
+    }
+  }
+  return table;
+}
+
+inline constexpr Crc32cShiftTable crc32c_long_shift =
+    makeCrc32cShiftTable(crc32c_long_block);
+inline constexpr Crc32cShiftTable crc32c_short_shift =
+    makeCrc32cShiftTable(crc32c_short_block);
+
+inline std::uint32_t crc32cShift(const Crc32cShiftTable &table,
+                                 std::uint32_t crc) noexcept {
+  return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+         table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+inline std::uint64_t loadWord(const char *data) noexcept {
+  std::uint64_t word;
+  std::memcpy(&word, data, sizeof(word));
+  return word;
+}
+#endif
+
+#if defined(QLS_CRC32C_X86)
+QLS_TARGET_SSE42 inline std::uint32_t
+crc32cHardware(std::uint32_t crc, const char *data, std::size_t size) noexcept {
+  std::uint64_t crc0 = crc;
+  for (const std::size_t block : {crc32c_long_block, crc32c_short_block}) {
+    const auto &shift =
+        block == crc32c_long_block ? crc32c_long_shift : crc32c_short_shift;
+    for (; size >= block * 3; data += block * 3, size -= block * 3) {
+      std::uint64_t crc1 = 0;
+      std::uint64_t crc2 = 0;
+      for (std::size_t i = 0; i < block; i += 8) {
+        crc0 = _mm_crc32_u64(crc0, loadWord(data + i));
+        crc1 = _mm_crc32_u64(crc1, loadWord(data + block + i));
+        crc2 = _mm_crc32_u64(crc2, loadWord(data + block * 2 + i));
+      }
+      crc0 = crc32cShift(shift, static_cast<std::uint32_t>(crc0)) ^ crc1;
+      crc0 = crc32cShift(shift, static_cast<std::uint32_t>(crc0)) ^ crc2;
+    }
+  }
+  for (; size >= 8; data += 8, size -= 8) {
+    crc0 = _mm_crc32_u64(crc0, loadWord(data));
+  }
+  crc = static_cast<std::uint32_t>(crc0);
+  for (; size; ++data, --size) {
+    crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data));
+  }
+  return crc;
+}
+
+inline bool hasHardwareCrc32c() noexcept {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+#else
+  return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif defined(QLS_CRC32C_ARM)
+inline std::uint32_t crc32cHardware(std::uint32_t crc, const char *data,
+                                    std::size_t size) noexcept {
+  for (const std::size_t block : {crc32c_long_block, crc32c_short_block}) {
+    const auto &shift =
+        block == crc32c_long_block ? crc32c_long_shift : crc32c_short_shift;
+    for (; size >= block * 3; data += block * 3, size -= block * 3) {
+      std::uint32_t crc1 = 0;
+      std::uint32_t crc2 = 0;
+      for (std::size_t i = 0; i < block; i += 8) {
+        crc = __crc32cd(crc, loadWord(data + i));
+        crc1 = __crc32cd(crc1, loadWord(data + block + i));
+        crc2 = __crc32cd(crc2, loadWord(data + block * 2 + i));
+      }
+      crc = crc32cShift(shift, crc) ^ crc1;
+      crc = crc32cShift(shift, crc) ^ crc2;
+    }
+  }
+  for (; size >= 8; data += 8, size -= 8) {
+    crc = __crc32cd(crc, loadWord(data));
+  }
+  for (; size; ++data, --size) {
+    crc = __crc32cb(crc, static_cast<std::uint8_t>(*data));
+  }
+  return crc;
+}
+
+// The compiler was told the CPU has the CRC extension
+inline bool hasHardwareCrc32c() noexcept { return true; }
+#endif
+
+#undef QLS_TARGET_SSE42
+
+} // namespace detail
+
+/**
+ * @brief Computes the CRC32C (Castagnoli) checksum of data.
+ * @details Uses the SSE4.2 crc32 instruction on x86-64 CPUs that have it
+ * and the ARMv8 CRC instructions when the compiler targets them, otherwise
+ * a table. Checksums can be chained by passing the previous result.
+ * @param data The data to checksum.
+ * @param crc The checksum of the data before, 0 to start.
+ * @return The checksum.
+ */
+[[nodiscard]] inline std::uint32_t crc32c(std::string_view data,
+                                          std::uint32_t crc = 0) noexcept {
+  crc = ~crc;
+#if defined(QLS_CRC32C_X86) || defined(QLS_CRC32C_ARM)
+  static const bool has_hardware = detail::hasHardwareCrc32c();
+  if (has_hardware) {
+    return ~detail::crc32cHardware(crc, data.data(), data.size());
+  }
+#endif
+  return ~detail::crc32cPortable(crc, data.data(), data.size());
+}
+
+} // namespace qls
+
+#endif // !CRC32C_HPP
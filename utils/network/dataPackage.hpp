@@ -1,8 +1,10 @@
 #ifndef DATA_PACKAGE_H
 #define DATA_PACKAGE_H
 
+#include <array>
 #include <cstdint>
 #include <cstring>
+#include <limits>
 #include <memory>
 #include <memory_resource>
 #include <string>
@@ -11,9 +13,43 @@
 
 #include "networkEndianness.hpp"
 #include "qls_error.h"
+#include "threadLocalPool.hpp"
 
 namespace qls {
 
+namespace detail {
+
+// LEB128 varints of the compact header
+
+inline std::size_t storeVarint(char *data, std::uint64_t value) noexcept {
+  std::size_t size = 0;
+  while (value >= 0x80) {
+    data[size++] = static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  data[size++] = static_cast<char>(value);
+  return size;
+}
+
+// Returns the number of bytes read, 0 if the varint is incomplete
+inline std::size_t loadVarint(std::string_view data, std::uint64_t &value,
+                              std::size_t max_size = 10) {
+  value = 0;
+  for (std::size_t i = 0; i < data.size() && i < max_size; ++i) {
+    const auto byte = static_cast<unsigned char>(data[i]);
+    value |= static_cast<std::uint64_t>(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80)) {
+      return i + 1;
+    }
+  }
+  if (data.size() >= max_size) {
+    throw std::system_error(qls_errc::invalid_data);
+  }
+  return 0;
+}
+
+} // namespace detail
+
 /**
  * @class DataPackage
  * @brief Represents a data package with metadata and binary data.
@@ -29,9 +65,34 @@ public:
     Text = 1,
     Binary = 2,
     FileStream = 3,
-    HeartBeat = 4
+    HeartBeat = 4,
+    CompressedText = 5, ///< Text compressed by ZstdCodec
+    Hello = 6           ///< Negotiates the protocol, always a v1 header
   };
 
+  /// Size of the header of a data package
+  constexpr static std::size_t header_size =
+      sizeof(LengthType) * 4 + sizeof(RequestIDType);
+  /// Header of a data package in network endianness
+  using HeaderBuffer = std::array<char, header_size>;
+
+  /// Newest protocol version, 2 uses the compact header
+  constexpr static std::uint64_t protocol_version = 2;
+  /// Largest size of a compact header: varint length, type, varint
+  /// requestID and the two varint sequence fields of a fragment
+  constexpr static std::size_t max_compact_header_size = 5 + 1 + 10 + 5 + 5;
+  /// Compact header, only as long as its fields need
+  using CompactHeaderBuffer = std::array<char, max_compact_header_size>;
+  /// Set in the type byte of a compact header if sequence fields follow
+  constexpr static std::uint8_t compact_fragment_flag = 0x80;
+  /// Capability of a Hello package: every later package is followed by
+  /// the CRC32C of the package in network endianness
+  constexpr static std::uint64_t capability_checksum = 1;
+  /// Capabilities the server grants when a client asks for them
+  constexpr static std::uint64_t supported_capabilities = capability_checksum;
+  /// Size of the checksum trailer
+  constexpr static std::size_t checksum_size = sizeof(std::uint32_t);
+
 private:
 #pragma pack(1)
   LengthType length = 0; ///< Length of the data package.
@@ -50,7 +111,7 @@ public:
       if (ptr != nullptr) {
         std::size_t length = ptr->length;
         ptr->~DataPackage();
-        DataPackage::local_datapack_sync_pool.deallocate(ptr, length);
+        thread_local_pool_resource()->deallocate(ptr, length);
       }
     }
   };
@@ -73,7 +134,7 @@ public:
               LengthType sequenceSize = 1, LengthType sequence = 0,
               RequestIDType requestID = 0) {
     const std::size_t lenth = sizeof(DataPackage) + data.size();
-    void *mem = local_datapack_sync_pool.allocate(lenth);
+    void *mem = thread_local_pool_resource()->allocate(lenth);
     std::memset(mem, 0, lenth);
     std::unique_ptr<DataPackage, DataPackageDeleter> package(
         static_cast<DataPackage *>(mem));
@@ -86,6 +147,76 @@ public:
     return package;
   }
 
+  /**
+   * @brief Encodes only the header of a data package.
+   * @details The header can be sent together with the data as a separate
+   * buffer, so the data never has to be copied into a package.
+   * @param data_size Size of the data following the header.
+   * @return The header in network endianness.
+   */
+  [[nodiscard]] static HeaderBuffer
+  makeHeader(std::size_t data_size,
+             DataPackageType type = DataPackageType::Unknown,
+             LengthType sequenceSize = 1, LengthType sequence = 0,
+             RequestIDType requestID = 0) {
+    if (data_size > std::numeric_limits<LengthType>::max() - header_size) {
+      throw std::system_error(qls_errc::data_too_large);
+    }
+
+    HeaderBuffer header;
+    char *iter = header.data();
+    storeNetworkEndianness(iter,
+                           static_cast<LengthType>(header_size + data_size));
+    iter += sizeof(LengthType);
+    storeNetworkEndianness(iter, static_cast<LengthType>(type));
+    iter += sizeof(LengthType);
+    storeNetworkEndianness(iter, sequenceSize);
+    iter += sizeof(LengthType);
+    storeNetworkEndianness(iter, sequence);
+    iter += sizeof(LengthType);
+    storeNetworkEndianness(iter, requestID);
+    return header;
+  }
+
+  /**
+   * @brief Encodes a compact (protocol version 2) header.
+   * @details The length is the varint size of everything after it, followed
+   * by one type byte and the varint requestID. sequenceSize and sequence are
+   * only encoded for fragments, which set compact_fragment_flag in the type
+   * byte. A heartbeat takes three bytes instead of header_size.
+   * @param[out] header Buffer the header is written to.
+   * @param data_size Size of the data following the header.
+   * @return Size of the header.
+   */
+  static std::size_t makeCompactHeader(CompactHeaderBuffer &header,
+                                       std::size_t data_size,
+                                       DataPackageType type = Unknown,
+                                       LengthType sequenceSize = 1,
+                                       LengthType sequence = 0,
+                                       RequestIDType requestID = 0) {
+    // Encode the fields after the length first to know their size
+    std::array<char, max_compact_header_size> fields;
+    std::size_t size = 1;
+    fields[0] = static_cast<char>(type);
+    if (sequenceSize > 1) {
+      fields[0] = static_cast<char>(fields[0] | compact_fragment_flag);
+    }
+    size += detail::storeVarint(fields.data() + size,
+                                static_cast<std::uint64_t>(requestID));
+    if (sequenceSize > 1) {
+      size += detail::storeVarint(fields.data() + size, sequenceSize);
+      size += detail::storeVarint(fields.data() + size, sequence);
+    }
+    if (data_size > std::numeric_limits<LengthType>::max() - size) {
+      throw std::system_error(qls_errc::data_too_large);
+    }
+
+    const std::size_t length_size =
+        detail::storeVarint(header.data(), size + data_size);
+    std::memcpy(header.data() + length_size, fields.data(), size);
+    return length_size + size;
+  }
+
   /**
    * @brief Loads a data package from binary data.
    * @param data Binary data representing a data package.
@@ -112,7 +243,7 @@ public:
     }
 
     // Allocate memory and construct the DataPackage
-    void *mem = local_datapack_sync_pool.allocate(size);
+    void *mem = thread_local_pool_resource()->allocate(size);
     std::memset(mem, 0, size);
     std::unique_ptr<DataPackage, DataPackageDeleter> package(
         static_cast<DataPackage *>(mem));
@@ -244,15 +375,197 @@ public:
     buffer.assign(reinterpret_cast<const char *>(this->data),
                   this->getDataSize());
   }
-
-private:
-  inline static std::pmr::synchronized_pool_resource local_datapack_sync_pool =
-      {};
 };
 
+static_assert(sizeof(DataPackage) == DataPackage::header_size);
+
 using DataPackagePtr =
     std::unique_ptr<DataPackage, DataPackage::DataPackageDeleter>;
 
+/**
+ * @class DataPackageView
+ * @brief Non-owning view of a data package in a receive buffer.
+ * @details The header is decoded in place and the data is exposed as a view,
+ * so nothing is allocated or copied. The view is only valid while the
+ * underlying buffer is.
+ */
+class DataPackageView final {
+public:
+  using LengthType = DataPackage::LengthType;
+  using RequestIDType = DataPackage::RequestIDType;
+  using DataPackageType = DataPackage::DataPackageType;
+
+  /// Size of the header of a data package
+  constexpr static std::size_t header_size = DataPackage::header_size;
+  /// Largest varint size of the length of a compact header
+  constexpr static std::size_t max_compact_length_size = 5;
+
+  DataPackageType type = DataPackage::Unknown; ///< Type of the data package.
+  LengthType sequenceSize = 1;                 ///< Sequence size.
+  LengthType sequence = 0;     ///< Sequence number of the data package.
+  RequestIDType requestID = 0; ///< Request ID associated with the package.
+
+  /**
+   * @brief Decodes a data package without copying it.
+   * @param data Binary data representing a data package.
+   * @return View of the data package.
+   */
+  [[nodiscard]] static DataPackageView fromString(std::string_view data) {
+    // Check if the package data is too small
+    if (data.size() < header_size) {
+      throw std::system_error(qls_errc::data_too_small);
+    }
+
+    // Error handling if data package length does not match actual size
+    const char *header = data.data();
+    if (loadNetworkEndianness<LengthType>(header) != data.size()) {
+      throw std::system_error(qls_errc::invalid_data);
+    }
+    header += sizeof(LengthType);
+
+    DataPackageView view;
+    view.m_package = data;
+    view.type = static_cast<DataPackageType>(
+        loadNetworkEndianness<LengthType>(header));
+    header += sizeof(LengthType);
+    view.sequenceSize = loadNetworkEndianness<LengthType>(header);
+    header += sizeof(LengthType);
+    view.sequence = loadNetworkEndianness<LengthType>(header);
+    header += sizeof(LengthType);
+    view.requestID = loadNetworkEndianness<RequestIDType>(header);
+    return view;
+  }
+
+  /**
+   * @brief Decodes a data package with a compact header without copying it.
+   * @param data Binary data representing a data package, see
+   * DataPackage::makeCompactHeader().
+   * @return View of the data package.
+   */
+  [[nodiscard]] static DataPackageView
+  fromCompactString(std::string_view data) {
+    std::uint64_t value = 0;
+    std::size_t pos =
+        detail::loadVarint(data, value, max_compact_length_size);
+    if (!pos || value != data.size() - pos || pos == data.size()) {
+      throw std::system_error(qls_errc::invalid_data);
+    }
+
+    DataPackageView view;
+    view.m_package = data;
+    const auto type_byte = static_cast<std::uint8_t>(data[pos++]);
+    view.type = static_cast<DataPackageType>(
+        type_byte & ~DataPackage::compact_fragment_flag);
+    view.requestID =
+        static_cast<RequestIDType>(loadField(data, pos, value, 10));
+    if (type_byte & DataPackage::compact_fragment_flag) {
+      view.sequenceSize =
+          static_cast<LengthType>(loadField(data, pos, value, 5));
+      view.sequence = static_cast<LengthType>(loadField(data, pos, value, 5));
+    }
+    view.m_header_size = pos;
+    return view;
+  }
+
+  /**
+   * @brief Reads only the type of a data package.
+   * @details Lets frequent packages such as heartbeats be told apart without
+   * decoding the rest of the header. The length is not checked.
+   * @param data Binary data representing a data package.
+   * @return Type of the data package, Unknown if the header is incomplete.
+   */
+  [[nodiscard]] static DataPackageType
+  peekType(std::string_view data) noexcept {
+    if (data.size() < header_size) {
+      return DataPackage::Unknown;
+    }
+    return static_cast<DataPackageType>(
+        loadNetworkEndianness<LengthType>(data.data() + sizeof(LengthType)));
+  }
+
+  /**
+   * @brief Reads only the type of a data package with a compact header.
+   * @param data Binary data representing a data package.
+   * @return Type of the data package, Unknown if the header is incomplete.
+   */
+  [[nodiscard]] static DataPackageType
+  peekCompactType(std::string_view data) noexcept {
+    // The length is at most max_compact_length_size bytes
+    for (std::size_t i = 0; i < data.size() && i < max_compact_length_size;
+         ++i) {
+      if (!(static_cast<unsigned char>(data[i]) & 0x80)) {
+        if (i + 1 >= data.size()) {
+          return DataPackage::Unknown;
+        }
+        return static_cast<DataPackageType>(
+            static_cast<std::uint8_t>(data[i + 1]) &
+            ~DataPackage::compact_fragment_flag);
+      }
+    }
+    return DataPackage::Unknown;
+  }
+
+  /**
+   * @brief Gets the size of this data package.
+   * @return Size of this data package.
+   */
+  [[nodiscard]] std::size_t getPackageSize() const noexcept {
+    return m_package.size();
+  }
+
+  /**
+   * @brief Gets the whole data package, header included.
+   * @return View of this data package.
+   */
+  [[nodiscard]] std::string_view getPackage() const noexcept {
+    return m_package;
+  }
+
+  /**
+   * @brief Moves the view to a copy of its data package.
+   * @details The header is not decoded again.
+   * @param package A copy of the data package this view points to.
+   * @return View of the copy.
+   */
+  [[nodiscard]] DataPackageView
+  rebind(std::string_view package) const noexcept {
+    DataPackageView view = *this;
+    view.m_package = package;
+    return view;
+  }
+
+  /**
+   * @brief Gets the size of the original data in this data package.
+   * @return Size of the original data in this data package.
+   */
+  [[nodiscard]] std::size_t getDataSize() const noexcept {
+    return m_package.size() - m_header_size;
+  }
+
+  /**
+   * @brief Gets the original data in this data package.
+   * @return View of the original data in this data package.
+   */
+  [[nodiscard]] std::string_view getData() const noexcept {
+    return m_package.substr(m_header_size);
+  }
+
+private:
+  static std::uint64_t loadField(std::string_view data, std::size_t &pos,
+                                 std::uint64_t &value, std::size_t max_size) {
+    const std::size_t size =
+        detail::loadVarint(data.substr(pos), value, max_size);
+    if (!size) {
+      throw std::system_error(qls_errc::invalid_data);
+    }
+    pos += size;
+    return value;
+  }
+
+  std::string_view m_package;
+  std::size_t m_header_size = header_size;
+};
+
 } // namespace qls
 
 #endif // !DATA_PACKAGE_H
@@ -0,0 +1,122 @@
+#ifndef FRAGMENT_ASSEMBLER_HPP
+#define FRAGMENT_ASSEMBLER_HPP
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+
+#include "dataPackage.hpp"
+#include "qls_error.h"
+
+namespace qls {
+
+/**
+ * @brief Joins packages that were split into fragments.
+ * @details A message is split into sequenceSize packages with the same
+ * requestID and type, numbered by sequence from 0. Fragments of one message
+ * must arrive in order, but fragments of different messages may interleave.
+ * All messages being joined share one budget, so a connection can't make
+ * the server buffer more than that.
+ */
+class FragmentAssembler final {
+public:
+  constexpr static std::size_t default_budget = 8 * 1024 * 1024;
+  constexpr static std::size_t default_max_streams = 16;
+
+  FragmentAssembler(std::size_t budget = default_budget,
+                    std::size_t max_streams = default_max_streams)
+      : m_budget(budget), m_max_streams(max_streams) {}
+  FragmentAssembler(const FragmentAssembler &) = delete;
+  FragmentAssembler(FragmentAssembler &&) = delete;
+  ~FragmentAssembler() noexcept = default;
+
+  FragmentAssembler &operator=(const FragmentAssembler &) = delete;
+  FragmentAssembler &operator=(FragmentAssembler &&) = delete;
+
+  /**
+   * @brief Adds a fragment.
+   * @param fragment A package with sequenceSize greater than 1.
+   * @return The whole message once its last fragment has been added, as a
+   * package with sequenceSize 1. It stays valid until the next call.
+   * @throw std::system_error qls_errc::invalid_data if the fragment doesn't
+   * continue its message, qls_errc::data_too_large if the budget or the
+   * number of messages is exceeded.
+   */
+  [[nodiscard]] std::optional<DataPackageView>
+  push(const DataPackageView &fragment) {
+    auto iter = m_streams.find(fragment.requestID);
+    if (iter == m_streams.end()) {
+      if (fragment.sequence != 0) {
+        throw std::system_error(qls_errc::invalid_data);
+      }
+      if (m_streams.size() >= m_max_streams) {
+        throw std::system_error(qls_errc::data_too_large);
+      }
+      iter = m_streams.try_emplace(fragment.requestID).first;
+      iter->second.type = fragment.type;
+      iter->second.sequenceSize = fragment.sequenceSize;
+      // Leave room for the header of the whole message
+      iter->second.data.resize(DataPackage::header_size);
+    }
+
+    Stream &stream = iter->second;
+    if (fragment.type != stream.type ||
+        fragment.sequenceSize != stream.sequenceSize ||
+        fragment.sequence != stream.next_sequence) {
+      discard(iter);
+      throw std::system_error(qls_errc::invalid_data);
+    }
+    const std::string_view data = fragment.getData();
+    if (data.size() > m_budget - m_used) {
+      discard(iter);
+      throw std::system_error(qls_errc::data_too_large);
+    }
+    stream.data.append(data);
+    m_used += data.size();
+    if (++stream.next_sequence < stream.sequenceSize) {
+      return std::nullopt;
+    }
+
+    // The last fragment, hand out the whole message as one package
+    m_completed = std::move(stream.data);
+    const auto header = DataPackage::makeHeader(
+        m_completed.size() - DataPackage::header_size, stream.type, 1, 0,
+        fragment.requestID);
+    m_completed.replace(0, header.size(), header.data(), header.size());
+    m_used -= m_completed.size() - DataPackage::header_size;
+    m_streams.erase(iter);
+    return DataPackageView::fromString(m_completed);
+  }
+
+  /**
+   * @brief Gets the number of bytes buffered for unfinished messages.
+   */
+  [[nodiscard]] std::size_t get_used() const noexcept { return m_used; }
+
+private:
+  struct Stream {
+    DataPackage::DataPackageType type = DataPackage::Unknown;
+    DataPackage::LengthType sequenceSize = 0;
+    DataPackage::LengthType next_sequence = 0;
+    std::string data;
+  };
+
+  using StreamMap = std::unordered_map<DataPackage::RequestIDType, Stream>;
+
+  void discard(StreamMap::iterator iter) noexcept {
+    m_used -= iter->second.data.size() - DataPackage::header_size;
+    m_streams.erase(iter);
+  }
+
+  const std::size_t m_budget;
+  const std::size_t m_max_streams;
+  std::size_t m_used = 0;
+  StreamMap m_streams;
+  std::string m_completed;
+};
+
+} // namespace qls
+
+#endif // !FRAGMENT_ASSEMBLER_HPP
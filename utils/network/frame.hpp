@@ -0,0 +1,277 @@
+#ifndef FRAME_HPP
+#define FRAME_HPP
+
+#include <array>
+#include <asio.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include "crc32c.hpp"
+#include "dataPackage.hpp"
+#include "networkEndianness.hpp"
+#include "zstdCodec.hpp"
+
+namespace qls {
+
+class Frame;
+
+using FramePtr = std::shared_ptr<const Frame>;
+
+/**
+ * @brief An immutable data package ready to be sent.
+ * @details The header is encoded into a small inline buffer and the data is
+ * kept in its own string, so building a frame never copies the data into a
+ * package. buffers() hands both out as a scatter-gather buffer sequence.
+ * The compact header of protocol version 2 is encoded as well, so one frame
+ * can be shared by connections of either version.
+ */
+class Frame final {
+public:
+  /**
+   * @brief Builds a frame from data and header fields.
+   * @param data The data of the package, moved into the frame.
+   */
+  Frame(std::string data,
+        DataPackage::DataPackageType type = DataPackage::Unknown,
+        DataPackage::LengthType sequenceSize = 1,
+        DataPackage::LengthType sequence = 0,
+        DataPackage::RequestIDType requestID = 0)
+      : m_header(DataPackage::makeHeader(data.size(), type, sequenceSize,
+                                         sequence, requestID)),
+        m_header_size(DataPackage::header_size), m_data(std::move(data)) {
+    makeCompactHeader(type, sequenceSize, sequence, requestID);
+  }
+
+  Frame(const Frame &) = delete;
+  Frame(Frame &&) = delete;
+  Frame &operator=(const Frame &) = delete;
+  Frame &operator=(Frame &&) = delete;
+
+  /**
+   * @brief Makes a shared frame from data and header fields.
+   * @param data The data of the package, moved into the frame.
+   * @return Shared pointer to the frame.
+   */
+  [[nodiscard]] static FramePtr
+  makeFrame(std::string data,
+            DataPackage::DataPackageType type = DataPackage::Unknown,
+            DataPackage::LengthType sequenceSize = 1,
+            DataPackage::LengthType sequence = 0,
+            DataPackage::RequestIDType requestID = 0) {
+    return std::make_shared<const Frame>(std::move(data), type, sequenceSize,
+                                         sequence, requestID);
+  }
+
+  /**
+   * @brief Makes a shared text frame that also has a binary encoding.
+   * @details Connections using the binary protocol send the binary frame
+   * instead, so a push to a group is encoded once in each format.
+   * @param text The JSON text of the package.
+   * @param binary The same message in the binary command encoding.
+   * @return Shared pointer to the text frame.
+   */
+  [[nodiscard]] static FramePtr makeTextFrame(std::string text,
+                                              std::string binary) {
+    return std::make_shared<const Frame>(
+        binary_tag{}, std::move(text),
+        makeFrame(std::move(binary), DataPackage::Binary));
+  }
+
+  /**
+   * @brief Makes a shared frame from an already encoded package.
+   * @param package The whole package including its header.
+   * @return Shared pointer to the frame.
+   */
+  [[nodiscard]] static FramePtr makeEncodedFrame(std::string package) {
+    return std::make_shared<const Frame>(encoded_tag{}, std::move(package));
+  }
+
+  /**
+   * @brief Gets the frame as a buffer sequence of header and data.
+   * @details The buffers stay valid as long as the frame is alive.
+   * @param compact True to use the compact header of protocol version 2.
+   * Hello frames always use the version 1 header.
+   */
+  [[nodiscard]] std::array<asio::const_buffer, 2>
+  buffers(bool compact = false) const noexcept {
+    if (compact) {
+      return {asio::buffer(m_compact_header.data(), m_compact_header_size),
+              asio::buffer(m_data.data() + m_compact_data_offset,
+                           m_data.size() - m_compact_data_offset)};
+    }
+    return {asio::buffer(m_header.data(), m_header_size),
+            asio::buffer(m_data)};
+  }
+
+  /**
+   * @brief Gets the size of the whole package in bytes.
+   * @details The size with the version 1 header, which is never smaller than
+   * the compact one.
+   */
+  [[nodiscard]] std::size_t size() const noexcept {
+    return m_header_size + m_data.size();
+  }
+
+  /**
+   * @brief Gets the encoded header, empty for already encoded packages.
+   */
+  [[nodiscard]] std::string_view getHeader() const noexcept {
+    return {m_header.data(), m_header_size};
+  }
+
+  /**
+   * @brief Gets the data following the header.
+   */
+  [[nodiscard]] std::string_view getData() const noexcept { return m_data; }
+
+  /**
+   * @brief Gets the type of the package, Unknown for invalid packages.
+   */
+  [[nodiscard]] DataPackage::DataPackageType getType() const noexcept {
+    return m_type;
+  }
+
+  /**
+   * @brief Gets the CRC32C of the frame as buffers() hands it out.
+   * @details Computed on first use for each header, so a frame shared by
+   * many connections is checksummed once.
+   * @param compact True for the compact header of protocol version 2.
+   */
+  [[nodiscard]] std::uint32_t getChecksum(bool compact = false) const {
+    auto &checksum = m_checksums[compact ? 1 : 0];
+    std::call_once(checksum.flag, [&]() {
+      const auto frame = buffers(compact);
+      checksum.value = crc32c(
+          {static_cast<const char *>(frame[1].data()), frame[1].size()},
+          crc32c({static_cast<const char *>(frame[0].data()),
+                  frame[0].size()}));
+    });
+    return checksum.value;
+  }
+
+  /**
+   * @brief Gets the binary encoding of this frame, null if it has none.
+   */
+  [[nodiscard]] const FramePtr &getBinary() const noexcept { return m_binary; }
+
+  /**
+   * @brief Gets this frame as a CompressedText package.
+   * @details Only text packages are compressed. The compressed frame is made
+   * on first use and shared by every connection that sends this frame, so a
+   * message to a large group is compressed once.
+   * @return The compressed frame, null if compressing isn't worth it.
+   */
+  [[nodiscard]] FramePtr getCompressed() const {
+    std::call_once(m_compressed_flag, [this]() {
+      if (!m_header_size || m_data.size() < ZstdCodec::min_compress_size ||
+          DataPackageView::peekType(getHeader()) != DataPackage::Text) {
+        return;
+      }
+      try {
+        std::string data = ZstdCodec::compress(m_data);
+        if (data.size() < m_data.size()) {
+          m_compressed = std::make_shared<const Frame>(compressed_tag{}, *this,
+                                                       std::move(data));
+        }
+      } catch (const std::system_error &) {
+        // Send the frame uncompressed
+      }
+    });
+    return m_compressed;
+  }
+
+private:
+  struct encoded_tag {};
+  struct compressed_tag {};
+  struct binary_tag {};
+
+public:
+  // Used by makeEncodedFrame() through make_shared
+  Frame(encoded_tag, std::string package)
+      : m_header{}, m_header_size(0), m_data(std::move(package)) {
+    try {
+      // Re-encode the header of the package for compact connections
+      const auto view = DataPackageView::fromString(m_data);
+      m_type = view.type;
+      if (view.type != DataPackage::Hello) {
+        m_compact_data_offset = DataPackage::header_size;
+        makeCompactHeader(view.type, view.sequenceSize, view.sequence,
+                          view.requestID);
+      }
+    } catch (const std::system_error &) {
+      // Not a valid package, sent as it is
+    }
+  }
+
+  // Used by makeTextFrame() through make_shared
+  Frame(binary_tag, std::string text, FramePtr binary)
+      : Frame(std::move(text), DataPackage::Text) {
+    m_binary = std::move(binary);
+  }
+
+  // Used by getCompressed() through make_shared, keeps the other header fields
+  Frame(compressed_tag, const Frame &frame, std::string data)
+      : m_header(frame.m_header), m_header_size(DataPackage::header_size),
+        m_data(std::move(data)) {
+    using LengthType = DataPackage::LengthType;
+    char *iter = m_header.data();
+    const auto length = static_cast<LengthType>(m_header_size + m_data.size());
+    storeNetworkEndianness(iter, length);
+    iter += sizeof(LengthType);
+    storeNetworkEndianness(iter, static_cast<LengthType>(
+                                     DataPackage::CompressedText));
+    iter += sizeof(LengthType);
+    const auto sequenceSize = loadNetworkEndianness<LengthType>(iter);
+    iter += sizeof(LengthType);
+    const auto sequence = loadNetworkEndianness<LengthType>(iter);
+    iter += sizeof(LengthType);
+    makeCompactHeader(DataPackage::CompressedText, sequenceSize, sequence,
+                      loadNetworkEndianness<DataPackage::RequestIDType>(iter));
+  }
+
+private:
+  void makeCompactHeader(DataPackage::DataPackageType type,
+                         DataPackage::LengthType sequenceSize,
+                         DataPackage::LengthType sequence,
+                         DataPackage::RequestIDType requestID) {
+    m_type = type;
+    if (type == DataPackage::Hello) {
+      // Negotiation happens before either side uses the compact header
+      std::memcpy(m_compact_header.data(), m_header.data(),
+                  DataPackage::header_size);
+      m_compact_header_size = DataPackage::header_size;
+      return;
+    }
+    m_compact_header_size = DataPackage::makeCompactHeader(
+        m_compact_header, m_data.size() - m_compact_data_offset, type,
+        sequenceSize, sequence, requestID);
+  }
+
+  struct Checksum {
+    std::once_flag flag;
+    std::uint32_t value = 0;
+  };
+
+  DataPackage::HeaderBuffer m_header;
+  std::size_t m_header_size;
+  DataPackage::DataPackageType m_type = DataPackage::Unknown;
+  std::string m_data;
+  DataPackage::CompactHeaderBuffer m_compact_header;
+  std::size_t m_compact_header_size = 0;
+  std::size_t m_compact_data_offset = 0;
+  FramePtr m_binary;
+
+  mutable std::once_flag m_compressed_flag;
+  mutable FramePtr m_compressed;
+  mutable std::array<Checksum, 2> m_checksums;
+};
+
+} // namespace qls
+
+#endif // !FRAME_HPP
@@ -0,0 +1,661 @@
+#ifndef KCP_STREAM_HPP
+#define KCP_STREAM_HPP
+
+#include <ikcp.h>
+
+#include <algorithm>
+#include <array>
+#include <asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
+
+/*
+ * KCP over UDP.
+ *
+ * One UDP socket is shared by all KCP sessions of a listener. A session is
+ * identified by the remote endpoint and the conv id of its segments. The
+ * listener's receive loop hands datagrams to the owning session, and every
+ * session runs the KCP state machine on its own strand. Segments produced by
+ * one flush of a session are sent with a single sendmmsg() where available.
+ *
+ * The source address of a UDP datagram can be spoofed. Until the remote side
+ * has acknowledged a segment, proving that it receives what is sent to it, a
+ * session sends at most three times the bytes it received, so a forged
+ * first segment can't make the server flood another host with its TLS
+ * handshake.
+ *
+ * KcpStream puts a session behind the AsyncReadStream/AsyncWriteStream
+ * interface, so it can be wrapped in asio::ssl::stream and carry the same
+ * DataPackage framing as a TCP connection.
+ */
+
+namespace qls {
+
+namespace detail {
+
+class KcpSession;
+
+/**
+ * @brief The UDP socket and session table shared by a listener's sessions.
+ */
+class KcpSocketCore final {
+public:
+  using SessionKey = std::pair<asio::ip::udp::endpoint, std::uint32_t>;
+
+  KcpSocketCore(asio::ip::udp::socket socket) : m_socket(std::move(socket)) {}
+
+  /**
+   * @brief Sends datagrams to an endpoint in as few system calls as possible.
+   * @details Called from the strands of many sessions at once. Datagrams the
+   * socket can't take right now are dropped, KCP retransmits them.
+   */
+  void send(const asio::ip::udp::endpoint &endpoint,
+            std::span<const asio::const_buffer> datagrams) {
+#if defined(__linux__)
+    constexpr std::size_t batch_size = 64;
+    std::array<mmsghdr, batch_size> messages;
+    std::array<iovec, batch_size> iovecs;
+    const int fd = m_socket.native_handle();
+    while (!datagrams.empty()) {
+      const std::size_t count = std::min(datagrams.size(), batch_size);
+      for (std::size_t i = 0; i < count; ++i) {
+        iovecs[i].iov_base = const_cast<void *>(datagrams[i].data());
+        iovecs[i].iov_len = datagrams[i].size();
+        messages[i] = {};
+        messages[i].msg_hdr.msg_name = const_cast<sockaddr *>(endpoint.data());
+        messages[i].msg_hdr.msg_namelen =
+            static_cast<socklen_t>(endpoint.size());
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+      }
+      const int sent = ::sendmmsg(fd, messages.data(),
+                                  static_cast<unsigned int>(count),
+                                  MSG_DONTWAIT);
+      if (sent <= 0) {
+        return;
+      }
+      datagrams = datagrams.subspan(static_cast<std::size_t>(sent));
+    }
+#else
+    std::lock_guard lock(m_send_mutex);
+    for (const auto &datagram : datagrams) {
+      std::error_code errorc;
+      m_socket.send_to(datagram, endpoint, 0, errorc);
+      if (errorc) {
+        return;
+      }
+    }
+#endif
+  }
+
+  std::shared_ptr<KcpSession> find(const SessionKey &key) const {
+    std::lock_guard lock(m_session_map_mutex);
+    auto iter = m_session_map.find(key);
+    return iter == m_session_map.cend() ? nullptr : iter->second.lock();
+  }
+
+  void add(const SessionKey &key, const std::shared_ptr<KcpSession> &session) {
+    std::lock_guard lock(m_session_map_mutex);
+    m_session_map[key] = session;
+  }
+
+  void remove(const SessionKey &key) {
+    std::lock_guard lock(m_session_map_mutex);
+    m_session_map.erase(key);
+  }
+
+  asio::ip::udp::socket &socket() noexcept { return m_socket; }
+
+private:
+  asio::ip::udp::socket m_socket;
+#if !defined(__linux__)
+  std::mutex m_send_mutex;
+#endif
+  std::map<SessionKey, std::weak_ptr<KcpSession>> m_session_map;
+  mutable std::mutex m_session_map_mutex;
+};
+
+/**
+ * @brief One KCP session, driven on its own strand.
+ */
+class KcpSession final : public std::enable_shared_from_this<KcpSession> {
+public:
+  using Handler =
+      asio::any_completion_handler<void(std::error_code, std::size_t)>;
+
+  constexpr static int send_window = 256;
+  constexpr static int receive_window = 256;
+  // Segments waiting to be acknowledged before writes are held back
+  constexpr static int max_waiting_segments = send_window * 2;
+  // Bytes sent per byte received until the remote address is validated
+  constexpr static std::size_t max_unvalidated_amplification = 3;
+
+  KcpSession(const asio::any_io_executor &executor,
+             std::shared_ptr<KcpSocketCore> core,
+             asio::ip::udp::endpoint endpoint, std::uint32_t conv)
+      : m_executor(executor), m_strand(asio::make_strand(executor)),
+        m_timer(m_strand), m_core(std::move(core)),
+        m_endpoint(std::move(endpoint)), m_conv(conv),
+        m_kcp(ikcp_create(conv, this)) {
+    if (m_kcp == nullptr) {
+      throw std::bad_alloc();
+    }
+    m_kcp->stream = 1;
+    ikcp_setoutput(m_kcp, &KcpSession::output);
+    ikcp_nodelay(m_kcp, 1, 10, 2, 1);
+    ikcp_wndsize(m_kcp, send_window, receive_window);
+  }
+
+  KcpSession(const KcpSession &) = delete;
+  KcpSession(KcpSession &&) = delete;
+  ~KcpSession() noexcept { ikcp_release(m_kcp); }
+
+  KcpSession &operator=(const KcpSession &) = delete;
+  KcpSession &operator=(KcpSession &&) = delete;
+
+  /**
+   * @brief Starts the update timer of the session.
+   */
+  void start() { asio::co_spawn(m_strand, update_loop(), asio::detached); }
+
+  /**
+   * @brief Feeds a datagram received from the remote endpoint.
+   */
+  void input(std::string datagram) {
+    asio::post(m_strand, [self = shared_from_this(),
+                          datagram = std::move(datagram)]() {
+      if (self->m_closed) {
+        return;
+      }
+      self->m_bytes_received += datagram.size();
+      ikcp_input(self->m_kcp, datagram.data(),
+                 static_cast<long>(datagram.size()));
+      self->deliver_read();
+      self->deliver_write();
+      self->request_flush();
+    });
+  }
+
+  void async_read_some(asio::mutable_buffer buffer, Handler handler) {
+    asio::post(m_strand, [self = shared_from_this(), buffer,
+                          handler = std::move(handler)]() mutable {
+      if (self->m_closed || self->m_read_handler) {
+        self->complete(std::move(handler), self->closed_error(), 0);
+        return;
+      }
+      self->m_read_buffer = buffer;
+      self->m_read_handler = std::move(handler);
+      self->deliver_read();
+    });
+  }
+
+  void async_write_some(std::vector<asio::const_buffer> buffers,
+                        Handler handler) {
+    asio::post(m_strand, [self = shared_from_this(),
+                          buffers = std::move(buffers),
+                          handler = std::move(handler)]() mutable {
+      if (self->m_closed || self->m_write_handler) {
+        self->complete(std::move(handler), self->closed_error(), 0);
+        return;
+      }
+      self->m_write_buffers = std::move(buffers);
+      self->m_write_handler = std::move(handler);
+      self->deliver_write();
+    });
+  }
+
+  /**
+   * @brief Closes the session and fails pending operations.
+   */
+  void close(std::error_code errorc = asio::error::operation_aborted) {
+    asio::post(m_strand, [self = shared_from_this(), errorc]() {
+      self->do_close(errorc);
+    });
+  }
+
+  [[nodiscard]] const asio::any_io_executor &get_executor() const noexcept {
+    return m_executor;
+  }
+
+  [[nodiscard]] const asio::ip::udp::endpoint &
+  remote_endpoint() const noexcept {
+    return m_endpoint;
+  }
+
+private:
+  static int output(const char *data, int size, ikcpcb *, void *user) {
+    auto *self = static_cast<KcpSession *>(user);
+    self->m_output_sizes.push_back(static_cast<std::size_t>(size));
+    self->m_output.insert(self->m_output.end(), data, data + size);
+    return 0;
+  }
+
+  static std::uint32_t current_ms() noexcept {
+    return static_cast<std::uint32_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+  std::error_code closed_error() const noexcept {
+    return m_close_error ? m_close_error
+                         : std::error_code(asio::error::operation_aborted);
+  }
+
+  void complete(Handler handler, std::error_code errorc, std::size_t size) {
+    asio::post(m_strand, asio::append(std::move(handler), errorc, size));
+  }
+
+  // Sends everything KCP produced since the last call in one batch
+  void send_output() {
+    if (m_output_sizes.empty()) {
+      return;
+    }
+    // An acknowledged segment proves the remote address is real
+    m_validated = m_validated || m_kcp->snd_una != 0;
+    std::vector<asio::const_buffer> datagrams;
+    datagrams.reserve(m_output_sizes.size());
+    std::size_t offset = 0;
+    for (std::size_t size : m_output_sizes) {
+      if (!m_validated) {
+        // Datagrams over the budget are dropped, KCP retransmits them once
+        // more data arrived or the address was validated
+        if (m_bytes_sent + size >
+            m_bytes_received * max_unvalidated_amplification) {
+          break;
+        }
+        m_bytes_sent += size;
+      }
+      datagrams.emplace_back(m_output.data() + offset, size);
+      offset += size;
+    }
+    if (!datagrams.empty()) {
+      m_core->send(m_endpoint, datagrams);
+    }
+    m_output.clear();
+    m_output_sizes.clear();
+  }
+
+  // Flushes once after the work already queued on the strand, so segments
+  // and acks caused by several datagrams leave in the same batch
+  void request_flush() {
+    if (m_flush_pending) {
+      return;
+    }
+    m_flush_pending = true;
+    asio::post(m_strand, [self = shared_from_this()]() {
+      self->m_flush_pending = false;
+      if (self->m_closed) {
+        return;
+      }
+      ikcp_flush(self->m_kcp);
+      self->send_output();
+      if (self->m_sleeping && !self->is_idle()) {
+        // Segments are in flight, let the timer handle retransmission
+        self->m_timer.cancel();
+      }
+    });
+  }
+
+  bool is_idle() const noexcept {
+    return ikcp_waitsnd(m_kcp) == 0 && m_kcp->ackcount == 0 &&
+           m_kcp->probe == 0;
+  }
+
+  void deliver_read() {
+    if (!m_read_handler) {
+      return;
+    }
+    if (m_received_offset == m_received.size()) {
+      const int size = ikcp_peeksize(m_kcp);
+      if (size < 0) {
+        return;
+      }
+      m_received.resize(static_cast<std::size_t>(size));
+      m_received_offset = 0;
+      ikcp_recv(m_kcp, m_received.data(), size);
+      // The receive window may have opened, tell the remote side
+      request_flush();
+    }
+
+    const std::size_t size = std::min(m_read_buffer.size(),
+                                      m_received.size() - m_received_offset);
+    std::memcpy(m_read_buffer.data(), m_received.data() + m_received_offset,
+                size);
+    m_received_offset += size;
+    complete(std::move(*m_read_handler), {}, size);
+    m_read_handler.reset();
+  }
+
+  void deliver_write() {
+    if (!m_write_handler) {
+      return;
+    }
+    // ikcp_send() rejects data that needs more fragments than the receive
+    // window of the remote side can hold
+    const std::size_t max_chunk = static_cast<std::size_t>(m_kcp->mss) * 64;
+    std::size_t sent = 0;
+    for (const auto &buffer : m_write_buffers) {
+      std::size_t offset = 0;
+      while (offset < buffer.size() &&
+             ikcp_waitsnd(m_kcp) < max_waiting_segments) {
+        const std::size_t size = std::min(max_chunk, buffer.size() - offset);
+        ikcp_send(m_kcp, static_cast<const char *>(buffer.data()) + offset,
+                  static_cast<int>(size));
+        offset += size;
+      }
+      sent += offset;
+      if (offset < buffer.size()) {
+        break;
+      }
+    }
+    if (sent == 0 && asio::buffer_size(m_write_buffers) != 0) {
+      // Wait for the remote side to acknowledge segments
+      return;
+    }
+    complete(std::move(*m_write_handler), {}, sent);
+    m_write_handler.reset();
+    m_write_buffers.clear();
+    request_flush();
+  }
+
+  void do_close(std::error_code errorc) {
+    if (m_closed) {
+      return;
+    }
+    m_closed = true;
+    m_close_error = errorc;
+    m_timer.cancel();
+    m_core->remove({m_endpoint, m_conv});
+    if (m_read_handler) {
+      complete(std::move(*m_read_handler), errorc, 0);
+      m_read_handler.reset();
+    }
+    if (m_write_handler) {
+      complete(std::move(*m_write_handler), errorc, 0);
+      m_write_handler.reset();
+    }
+  }
+
+  asio::awaitable<void> update_loop() {
+    auto self = shared_from_this();
+    while (!m_closed) {
+      const std::uint32_t now = current_ms();
+      ikcp_update(m_kcp, now);
+      send_output();
+      if (m_kcp->state == static_cast<IUINT32>(-1)) {
+        // Too many retransmissions, the remote side is gone
+        do_close(asio::error::timed_out);
+        break;
+      }
+      deliver_write();
+
+      // Idle sessions sleep until there is something to send
+      m_sleeping = is_idle();
+      if (m_sleeping) {
+        m_timer.expires_at(asio::steady_timer::time_point::max());
+      } else {
+        m_timer.expires_after(
+            std::chrono::milliseconds(ikcp_check(m_kcp, now) - now));
+      }
+      co_await m_timer.async_wait(asio::as_tuple(asio::use_awaitable));
+    }
+  }
+
+  asio::any_io_executor m_executor;
+  asio::strand<asio::any_io_executor> m_strand;
+  asio::steady_timer m_timer;
+  std::shared_ptr<KcpSocketCore> m_core;
+  const asio::ip::udp::endpoint m_endpoint;
+  const std::uint32_t m_conv;
+  ikcpcb *m_kcp;
+
+  // Everything below is only accessed on m_strand
+  std::vector<char> m_output;              ///< Datagrams of the next batch.
+  std::vector<std::size_t> m_output_sizes; ///< Sizes of those datagrams.
+  std::vector<char> m_received;
+  std::size_t m_received_offset = 0;
+  asio::mutable_buffer m_read_buffer;
+  std::optional<Handler> m_read_handler;
+  std::vector<asio::const_buffer> m_write_buffers;
+  std::optional<Handler> m_write_handler;
+  // Bytes exchanged while the remote address wasn't validated
+  std::size_t m_bytes_received = 0;
+  std::size_t m_bytes_sent = 0;
+  bool m_validated = false;
+  bool m_flush_pending = false;
+  bool m_sleeping = false;
+  bool m_closed = false;
+  std::error_code m_close_error;
+};
+
+} // namespace detail
+
+/**
+ * @brief A reliable byte stream over a KCP session.
+ * @details Meets the AsyncReadStream and AsyncWriteStream requirements, so it
+ * can be the next layer of asio::ssl::stream. The session is closed when the
+ * stream is destroyed.
+ */
+class KcpStream final {
+public:
+  using executor_type = asio::any_io_executor;
+  using lowest_layer_type = KcpStream;
+  using endpoint_type = asio::ip::udp::endpoint;
+
+  KcpStream(std::shared_ptr<detail::KcpSession> session)
+      : m_session(std::move(session)) {}
+  KcpStream(const KcpStream &) = delete;
+  KcpStream(KcpStream &&) noexcept = default;
+  ~KcpStream() noexcept {
+    if (m_session) {
+      m_session->close();
+    }
+  }
+
+  KcpStream &operator=(const KcpStream &) = delete;
+  KcpStream &operator=(KcpStream &&other) noexcept {
+    if (this != &other) {
+      if (m_session) {
+        m_session->close();
+      }
+      m_session = std::move(other.m_session);
+    }
+    return *this;
+  }
+
+  [[nodiscard]] executor_type get_executor() const noexcept {
+    return m_session->get_executor();
+  }
+
+  lowest_layer_type &lowest_layer() noexcept { return *this; }
+  const lowest_layer_type &lowest_layer() const noexcept { return *this; }
+
+  [[nodiscard]] endpoint_type remote_endpoint() const {
+    return m_session->remote_endpoint();
+  }
+
+  /**
+   * @brief Closes the session, pending operations fail with
+   * operation_aborted.
+   */
+  std::error_code close(std::error_code &errorc) {
+    errorc.clear();
+    if (m_session) {
+      m_session->close();
+    }
+    return errorc;
+  }
+
+  template <class MutableBufferSequence, class ReadToken>
+  auto async_read_some(const MutableBufferSequence &buffers,
+                       ReadToken &&token) {
+    return asio::async_initiate<ReadToken,
+                                void(std::error_code, std::size_t)>(
+        [](auto handler, std::shared_ptr<detail::KcpSession> session,
+           asio::mutable_buffer buffer) {
+          session->async_read_some(buffer, std::move(handler));
+        },
+        token, m_session, firstBuffer<asio::mutable_buffer>(buffers));
+  }
+
+  template <class ConstBufferSequence, class WriteToken>
+  auto async_write_some(const ConstBufferSequence &buffers,
+                        WriteToken &&token) {
+    return asio::async_initiate<WriteToken,
+                                void(std::error_code, std::size_t)>(
+        [](auto handler, std::shared_ptr<detail::KcpSession> session,
+           std::vector<asio::const_buffer> buffers) {
+          session->async_write_some(std::move(buffers), std::move(handler));
+        },
+        token, m_session,
+        std::vector<asio::const_buffer>(asio::buffer_sequence_begin(buffers),
+                                        asio::buffer_sequence_end(buffers)));
+  }
+
+  // Blocking operations are not supported, they fail immediately
+  template <class MutableBufferSequence>
+  std::size_t read_some(const MutableBufferSequence &,
+                        std::error_code &errorc) {
+    errorc = asio::error::operation_not_supported;
+    return 0;
+  }
+
+  template <class ConstBufferSequence>
+  std::size_t write_some(const ConstBufferSequence &,
+                         std::error_code &errorc) {
+    errorc = asio::error::operation_not_supported;
+    return 0;
+  }
+
+private:
+  template <class Buffer, class BufferSequence>
+  static Buffer firstBuffer(const BufferSequence &buffers) {
+    for (auto iter = asio::buffer_sequence_begin(buffers);
+         iter != asio::buffer_sequence_end(buffers); ++iter) {
+      if (Buffer(*iter).size()) {
+        return Buffer(*iter);
+      }
+    }
+    return Buffer();
+  }
+
+  std::shared_ptr<detail::KcpSession> m_session;
+};
+
+/**
+ * @brief Accepts KCP sessions on a UDP port.
+ */
+class KcpListener final {
+public:
+  using ExecutorPicker = std::function<asio::any_io_executor()>;
+  using AllowHandler = std::function<bool(const asio::ip::udp::endpoint &)>;
+  using AcceptHandler = std::function<void(KcpStream)>;
+
+  constexpr static std::size_t max_datagram_size = 64 * 1024;
+
+  /**
+   * @param socket Bound UDP socket to receive datagrams on.
+   * @param pick_executor Picks the executor a new session runs on.
+   * @param allow Decides whether a new session may be created.
+   */
+  KcpListener(asio::ip::udp::socket socket, ExecutorPicker pick_executor,
+              AllowHandler allow)
+      : m_core(std::make_shared<detail::KcpSocketCore>(std::move(socket))),
+        m_pick_executor(std::move(pick_executor)), m_allow(std::move(allow)) {}
+
+  KcpListener(const KcpListener &) = delete;
+  KcpListener(KcpListener &&) = delete;
+  ~KcpListener() noexcept = default;
+
+  KcpListener &operator=(const KcpListener &) = delete;
+  KcpListener &operator=(KcpListener &&) = delete;
+
+  /**
+   * @brief Receives datagrams until the socket is closed.
+   * @param on_accept Called with the stream of every new session.
+   */
+  asio::awaitable<void> listen(AcceptHandler on_accept) {
+    std::vector<char> buffer(max_datagram_size);
+    asio::ip::udp::endpoint endpoint;
+    while (m_core->socket().is_open()) {
+      auto [errorc, size] = co_await m_core->socket().async_receive_from(
+          asio::buffer(buffer), endpoint,
+          asio::as_tuple(asio::use_awaitable));
+      if (errorc == asio::error::operation_aborted) {
+        co_return;
+      }
+      if (errorc || size < header_size) {
+        continue;
+      }
+
+      const std::string_view datagram(buffer.data(), size);
+      const detail::KcpSocketCore::SessionKey key{
+          endpoint, ikcp_getconv(datagram.data())};
+      if (auto session = m_core->find(key); session) {
+        session->input(std::string(datagram));
+        continue;
+      }
+      if (!isSessionStart(datagram) || (m_allow && !m_allow(endpoint))) {
+        continue;
+      }
+
+      auto session = std::make_shared<detail::KcpSession>(
+          m_pick_executor ? m_pick_executor() : m_core->socket().get_executor(),
+          m_core, endpoint, key.second);
+      m_core->add(key, session);
+      session->start();
+      session->input(std::string(datagram));
+      on_accept(KcpStream(std::move(session)));
+    }
+  }
+
+  /**
+   * @brief Stops receiving, existing sessions keep their sent data.
+   */
+  void close() {
+    std::error_code errorc;
+    m_core->socket().close(errorc);
+  }
+
+private:
+  // conv, cmd, frg, wnd, ts, sn, una, len
+  constexpr static std::size_t header_size = 24;
+  constexpr static std::uint8_t command_push = 81;
+
+  // Only the first data segment of a session may create it, anything else
+  // from an unknown endpoint is dropped without a reply. The new session
+  // limits what it sends until the endpoint is validated.
+  static bool isSessionStart(std::string_view datagram) noexcept {
+    std::uint32_t sequence = 0;
+    std::memcpy(&sequence, datagram.data() + 12, sizeof(sequence));
+    return static_cast<std::uint8_t>(datagram[4]) == command_push &&
+           sequence == 0;
+  }
+
+  std::shared_ptr<detail::KcpSocketCore> m_core;
+  ExecutorPicker m_pick_executor;
+  AllowHandler m_allow;
+};
+
+} // namespace qls
+
+#endif // !KCP_STREAM_HPP
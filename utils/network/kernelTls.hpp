@@ -0,0 +1,356 @@
+#ifndef KERNEL_TLS_HPP
+#define KERNEL_TLS_HPP
+
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__linux__) && __has_include(<linux/tls.h>)
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#define QLS_HAS_KERNEL_TLS 1
+#else
+#define QLS_HAS_KERNEL_TLS 0
+#endif
+
+#include "networkEndianness.hpp"
+
+/*
+ * Kernel TLS (kTLS) transmit offload.
+ *
+ * asio::ssl::stream drives OpenSSL through a memory BIO pair, so OpenSSL's
+ * own SSL_OP_ENABLE_KTLS never sees the socket. Instead the server traffic
+ * secret is captured through the key log callback and the number of records
+ * OpenSSL wrote with it is counted through the message callback. After the
+ * handshake the write key is derived from the secret and handed to the
+ * kernel together with the record sequence number. From then on plaintext
+ * written to the TCP socket is encrypted by the kernel, while received data
+ * still goes through OpenSSL.
+ *
+ * OpenSSL never learns that it lost the write side. A record it writes
+ * afterwards, such as the answer to a KeyUpdate or an alert, would be
+ * encrypted a second time by the kernel with a stale sequence number, and a
+ * KeyUpdate would change keys the kernel doesn't know about. The message
+ * callback therefore stays installed and cuts the connection as soon as
+ * OpenSSL writes anything or receives a post-handshake message or alert.
+ */
+
+namespace qls {
+
+/**
+ * @brief Transmit keys of a TLS 1.3 connection.
+ */
+struct KernelTlsTxKeys {
+  int cipher = 0; ///< TLS_CIPHER_* of linux/tls.h, 0 if unknown.
+  std::size_t key_size = 0;
+  std::array<unsigned char, 32> key{};
+  std::array<unsigned char, 12> iv{};
+  std::uint64_t sequence = 0;
+
+  ~KernelTlsTxKeys() noexcept { OPENSSL_cleanse(this, sizeof(*this)); }
+};
+
+namespace detail {
+
+constexpr int kernel_tls_aes_gcm_128 = 51;
+constexpr int kernel_tls_aes_gcm_256 = 52;
+constexpr int kernel_tls_chacha20_poly1305 = 54;
+
+struct KernelTlsState {
+  std::array<unsigned char, EVP_MAX_MD_SIZE> secret{};
+  std::size_t secret_size = 0;
+  std::uint64_t write_sequence = 0;
+  bool has_secret = false;
+  // The TCP socket once the kernel encrypts its records, -1 before
+  int tx_socket = -1;
+
+  ~KernelTlsState() noexcept { OPENSSL_cleanse(this, sizeof(*this)); }
+};
+
+inline int kernelTlsIndex() {
+  static const int index = SSL_get_ex_new_index(
+      0, nullptr, nullptr, nullptr,
+      [](void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *) {
+        delete static_cast<KernelTlsState *>(ptr);
+      });
+  return index;
+}
+
+inline KernelTlsState *getKernelTlsState(const SSL *ssl) {
+  return static_cast<KernelTlsState *>(
+      SSL_get_ex_data(const_cast<SSL *>(ssl), kernelTlsIndex()));
+}
+
+inline void kernelTlsKeylogCallback(const SSL *ssl, const char *line) {
+  constexpr std::string_view label = "SERVER_TRAFFIC_SECRET_0 ";
+  KernelTlsState *state = getKernelTlsState(ssl);
+  std::string_view text(line);
+  if (state == nullptr || !text.starts_with(label)) {
+    return;
+  }
+
+  // "<label> <client random> <secret>", all in hex
+  std::string_view hex = text.substr(text.rfind(' ') + 1);
+  if (hex.size() % 2 || hex.size() / 2 > state->secret.size()) {
+    return;
+  }
+  auto from_hex = [](char chr) -> int {
+    if (chr >= '0' && chr <= '9') {
+      return chr - '0';
+    }
+    if (chr >= 'a' && chr <= 'f') {
+      return chr - 'a' + 10;
+    }
+    if (chr >= 'A' && chr <= 'F') {
+      return chr - 'A' + 10;
+    }
+    return -1;
+  };
+  for (std::size_t i = 0; i < hex.size() / 2; ++i) {
+    int high = from_hex(hex[i * 2]);
+    int low = from_hex(hex[i * 2 + 1]);
+    if (high < 0 || low < 0) {
+      return;
+    }
+    state->secret[i] = static_cast<unsigned char>(high << 4 | low);
+  }
+  state->secret_size = hex.size() / 2;
+  state->write_sequence = 0;
+  state->has_secret = true;
+}
+
+inline void kernelTlsMessageCallback(int write_p, int, int content_type,
+                                     const void *, std::size_t, SSL *ssl,
+                                     void *) {
+  KernelTlsState *state = getKernelTlsState(ssl);
+  if (state == nullptr) {
+    return;
+  }
+  if (state->tx_socket >= 0) {
+    // OpenSSL can't write any more and a KeyUpdate can't be followed, so
+    // nothing may reach the peer: both directions are shut down and the
+    // pending read or write of the connection fails
+    if (write_p || content_type == SSL3_RT_HANDSHAKE ||
+        content_type == SSL3_RT_ALERT) {
+#if QLS_HAS_KERNEL_TLS
+      ::shutdown(state->tx_socket, SHUT_RDWR);
+#endif
+    }
+    return;
+  }
+  // Every record written with the application secret uses one sequence
+  // number; the secret is only logged once the Finished record is written
+  if (write_p && content_type == SSL3_RT_HEADER && state->has_secret) {
+    ++state->write_sequence;
+  }
+}
+
+inline bool hkdfExpandLabel(const char *digest_name,
+                            const unsigned char *secret,
+                            std::size_t secret_size, std::string_view label,
+                            unsigned char *out, std::size_t out_size) {
+  // HkdfLabel of RFC 8446 section 7.1 with an empty context
+  constexpr std::string_view prefix = "tls13 ";
+  std::array<unsigned char, 2 + 1 + 255 + 1> info{};
+  std::size_t info_size = 0;
+  info[info_size++] = static_cast<unsigned char>(out_size >> 8);
+  info[info_size++] = static_cast<unsigned char>(out_size);
+  info[info_size++] = static_cast<unsigned char>(prefix.size() + label.size());
+  std::memcpy(info.data() + info_size, prefix.data(), prefix.size());
+  info_size += prefix.size();
+  std::memcpy(info.data() + info_size, label.data(), label.size());
+  info_size += label.size();
+  info[info_size++] = 0;
+
+  EVP_KDF *kdf = EVP_KDF_fetch(nullptr, OSSL_KDF_NAME_HKDF, nullptr);
+  if (kdf == nullptr) {
+    return false;
+  }
+  EVP_KDF_CTX *kdf_context = EVP_KDF_CTX_new(kdf);
+  EVP_KDF_free(kdf);
+  if (kdf_context == nullptr) {
+    return false;
+  }
+
+  int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+                                       const_cast<char *>(digest_name), 0),
+      OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY,
+                                        const_cast<unsigned char *>(secret),
+                                        secret_size),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info.data(),
+                                        info_size),
+      OSSL_PARAM_construct_end()};
+  const bool result =
+      EVP_KDF_derive(kdf_context, out, out_size, params) == 1;
+  EVP_KDF_CTX_free(kdf_context);
+  return result;
+}
+
+} // namespace detail
+
+/**
+ * @brief Prepares a server context for kTLS.
+ * @details Installs the key log callback that captures traffic secrets of
+ * connections tracked with trackKernelTls().
+ */
+inline void prepareKernelTls(SSL_CTX *ssl_context) {
+  SSL_CTX_set_keylog_callback(ssl_context, &detail::kernelTlsKeylogCallback);
+}
+
+/**
+ * @brief Starts tracking the keys of a connection.
+ * @details Must be called before the handshake.
+ * @return false if the connection can't be tracked.
+ */
+inline bool trackKernelTls(SSL *ssl) {
+  if (!QLS_HAS_KERNEL_TLS || ssl == nullptr) {
+    return false;
+  }
+  auto *state = new detail::KernelTlsState;
+  if (!SSL_set_ex_data(ssl, detail::kernelTlsIndex(), state)) {
+    delete state;
+    return false;
+  }
+  SSL_set_msg_callback(ssl, &detail::kernelTlsMessageCallback);
+  return true;
+}
+
+/**
+ * @brief Derives the transmit keys of a tracked connection.
+ * @details Must be called after the handshake and before anything else is
+ * written through OpenSSL.
+ * @return false if the protocol, cipher or tracking state is unsupported.
+ */
+inline bool getKernelTlsTxKeys(const SSL *ssl, KernelTlsTxKeys &keys) {
+  const detail::KernelTlsState *state = detail::getKernelTlsState(ssl);
+  if (state == nullptr || !state->has_secret ||
+      SSL_version(ssl) != TLS1_3_VERSION) {
+    return false;
+  }
+
+  const SSL_CIPHER *cipher = SSL_get_current_cipher(ssl);
+  if (cipher == nullptr) {
+    return false;
+  }
+  switch (SSL_CIPHER_get_id(cipher)) {
+  case TLS1_3_CK_AES_128_GCM_SHA256:
+    keys.cipher = detail::kernel_tls_aes_gcm_128;
+    keys.key_size = 16;
+    break;
+  case TLS1_3_CK_AES_256_GCM_SHA384:
+    keys.cipher = detail::kernel_tls_aes_gcm_256;
+    keys.key_size = 32;
+    break;
+  case TLS1_3_CK_CHACHA20_POLY1305_SHA256:
+    keys.cipher = detail::kernel_tls_chacha20_poly1305;
+    keys.key_size = 32;
+    break;
+  default:
+    return false;
+  }
+
+  const EVP_MD *digest = SSL_CIPHER_get_handshake_digest(cipher);
+  if (digest == nullptr ||
+      !detail::hkdfExpandLabel(EVP_MD_get0_name(digest), state->secret.data(),
+                               state->secret_size, "key", keys.key.data(),
+                               keys.key_size) ||
+      !detail::hkdfExpandLabel(EVP_MD_get0_name(digest), state->secret.data(),
+                               state->secret_size, "iv", keys.iv.data(),
+                               keys.iv.size())) {
+    return false;
+  }
+  keys.sequence = state->write_sequence;
+  return true;
+}
+
+/**
+ * @brief Hands the transmit side of a connection to the kernel.
+ * @details Falls back, returning false, if the kernel has no tls module or
+ * doesn't support the cipher. Once this returns true every byte written to
+ * the TCP socket is sent as TLS application data, and nothing may be written
+ * through OpenSSL any more: the connection is shut down if OpenSSL writes a
+ * record or receives a KeyUpdate or an alert.
+ * @param ssl The connection, tracked since before its handshake.
+ * @param native_socket The TCP socket of the connection.
+ * @return true if kTLS transmit is active.
+ */
+inline bool enableKernelTlsTx(SSL *ssl, int native_socket) {
+#if QLS_HAS_KERNEL_TLS
+  KernelTlsTxKeys keys;
+  if (!getKernelTlsTxKeys(ssl, keys)) {
+    return false;
+  }
+
+  const std::uint64_t sequence = swapNetworkEndianness(keys.sequence);
+  auto enable = [native_socket](auto &crypto_info) {
+    return setsockopt(native_socket, SOL_TCP, TCP_ULP, "tls",
+                      sizeof("tls")) == 0 &&
+           setsockopt(native_socket, SOL_TLS, TLS_TX, &crypto_info,
+                      sizeof(crypto_info)) == 0;
+  };
+  bool result = false;
+  if (keys.cipher == TLS_CIPHER_AES_GCM_128) {
+    tls12_crypto_info_aes_gcm_128 crypto_info{};
+    crypto_info.info.version = TLS_1_3_VERSION;
+    crypto_info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    std::memcpy(crypto_info.key, keys.key.data(), sizeof(crypto_info.key));
+    std::memcpy(crypto_info.salt, keys.iv.data(), sizeof(crypto_info.salt));
+    std::memcpy(crypto_info.iv, keys.iv.data() + sizeof(crypto_info.salt),
+                sizeof(crypto_info.iv));
+    std::memcpy(crypto_info.rec_seq, &sequence, sizeof(crypto_info.rec_seq));
+    result = enable(crypto_info);
+    OPENSSL_cleanse(&crypto_info, sizeof(crypto_info));
+  } else if (keys.cipher == TLS_CIPHER_AES_GCM_256) {
+    tls12_crypto_info_aes_gcm_256 crypto_info{};
+    crypto_info.info.version = TLS_1_3_VERSION;
+    crypto_info.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    std::memcpy(crypto_info.key, keys.key.data(), sizeof(crypto_info.key));
+    std::memcpy(crypto_info.salt, keys.iv.data(), sizeof(crypto_info.salt));
+    std::memcpy(crypto_info.iv, keys.iv.data() + sizeof(crypto_info.salt),
+                sizeof(crypto_info.iv));
+    std::memcpy(crypto_info.rec_seq, &sequence, sizeof(crypto_info.rec_seq));
+    result = enable(crypto_info);
+    OPENSSL_cleanse(&crypto_info, sizeof(crypto_info));
+  } else if (keys.cipher == TLS_CIPHER_CHACHA20_POLY1305) {
+    tls12_crypto_info_chacha20_poly1305 crypto_info{};
+    crypto_info.info.version = TLS_1_3_VERSION;
+    crypto_info.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+    std::memcpy(crypto_info.key, keys.key.data(), sizeof(crypto_info.key));
+    std::memcpy(crypto_info.iv, keys.iv.data(), sizeof(crypto_info.iv));
+    std::memcpy(crypto_info.rec_seq, &sequence, sizeof(crypto_info.rec_seq));
+    result = enable(crypto_info);
+    OPENSSL_cleanse(&crypto_info, sizeof(crypto_info));
+  }
+
+  if (result) {
+    // The secret isn't needed any more, the message callback now watches
+    // for records OpenSSL must not handle
+    if (auto *state = detail::getKernelTlsState(ssl); state != nullptr) {
+      OPENSSL_cleanse(state->secret.data(), state->secret.size());
+      state->has_secret = false;
+      state->tx_socket = native_socket;
+    }
+  }
+  return result;
+#else
+  (void)ssl;
+  (void)native_socket;
+  return false;
+#endif
+}
+
+} // namespace qls
+
+#endif // !KERNEL_TLS_HPP
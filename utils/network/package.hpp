@@ -1,137 +1,310 @@
 #ifndef PACKAGE_H
 #define PACKAGE_H
 
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <memory_resource>
+#include <span>
 #include <string>
 #include <string_view>
 #include <system_error>
 #include <type_traits>
+#include <utility>
 
+#include "dataPackage.hpp"
 #include "networkEndianness.hpp"
 #include "qls_error.h"
+#include "threadLocalPool.hpp"
 
 namespace qls {
 
 /**
  * @brief A class to handle data packages.
+ * @details Received bytes are stored in a linear buffer with a read and a
+ * write cursor. Data is read straight into the free space behind the write
+ * cursor (writableBuffer() + commit()) and complete frames are handed out as
+ * views (readView()). Frames never wrap around the end of the buffer, so the
+ * unread tail is moved to the front with memmove once less than half of the
+ * buffer is free behind it. The buffer grows only when a single frame doesn't
+ * fit, and never beyond the maximum frame length. Frames start either with a
+ * fixed length of type T or, in compact mode, with a varint length of the
+ * rest of the frame, and may be followed by a trailer of fixed size the
+ * length doesn't count.
  */
 template <class T>
   requires std::is_integral_v<T>
 class Package final {
 public:
-  Package() : m_buffer(&local_sync_package_pool) {}
-  ~Package() noexcept = default;
+  constexpr static std::size_t default_buffer_capacity = 16 * 1024;
+  constexpr static std::size_t default_max_frame_length = 1024 * 1024;
+
+  Package(std::size_t max_frame_length = default_max_frame_length)
+      : m_max_frame_length(std::max(max_frame_length, sizeof(T))) {}
+  ~Package() noexcept { release(); }
 
   Package(const Package &) = delete;
-  Package(Package &&) = default;
+  Package(Package &&package) noexcept
+      : m_buffer(std::exchange(package.m_buffer, nullptr)),
+        m_capacity(std::exchange(package.m_capacity, 0)),
+        m_begin(std::exchange(package.m_begin, 0)),
+        m_end(std::exchange(package.m_end, 0)),
+        m_max_frame_length(package.m_max_frame_length),
+        m_compact_length(package.m_compact_length),
+        m_trailer_size(package.m_trailer_size) {}
 
   Package &operator=(const Package &) = delete;
-  Package &operator=(Package &&) noexcept = default;
+  Package &operator=(Package &&package) noexcept {
+    if (this == &package) {
+      return *this;
+    }
+    release();
+    m_buffer = std::exchange(package.m_buffer, nullptr);
+    m_capacity = std::exchange(package.m_capacity, 0);
+    m_begin = std::exchange(package.m_begin, 0);
+    m_end = std::exchange(package.m_end, 0);
+    m_max_frame_length = package.m_max_frame_length;
+    m_compact_length = package.m_compact_length;
+    m_trailer_size = package.m_trailer_size;
+    return *this;
+  }
+
+  /**
+   * @brief Gets the free space of the buffer to receive data into.
+   * @details Views returned by readView() are invalidated.
+   * @return The free space, never empty.
+   * @throw std::system_error qls_errc::data_too_large if the pending frame
+   * is longer than the maximum frame length.
+   */
+  [[nodiscard]] std::span<char> writableBuffer() {
+    if (m_begin == m_end) {
+      m_begin = m_end = 0;
+    }
+
+    // Make sure the pending frame fits in the buffer
+    std::size_t required = default_buffer_capacity;
+    if (lengthPrefixSize()) {
+      required = std::max(required, checkedFirstMsgLength());
+    }
+    required = std::min(std::max(required, m_end - m_begin + 1),
+                        std::max(m_max_frame_length, m_end - m_begin + 1));
+    if (m_capacity < required) {
+      reserve(required);
+    }
+
+    // Frames must stay contiguous, so the unread bytes are moved to the
+    // front instead of wrapping once the tail gets too small
+    if (m_begin != 0 && m_capacity - m_end < m_capacity / 2) {
+      std::memmove(m_buffer, m_buffer + m_begin, m_end - m_begin);
+      m_end -= m_begin;
+      m_begin = 0;
+    }
+    return {m_buffer + m_end, m_capacity - m_end};
+  }
+
+  /**
+   * @brief Marks bytes received into writableBuffer() as written.
+   * @param size Number of bytes received.
+   */
+  void commit(std::size_t size) {
+    if (size > m_capacity - m_end) {
+      throw std::system_error(qls_errc::data_too_large);
+    }
+    m_end += size;
+  }
 
   /**
    * @brief Writes data into the class.
    * @param data The binary data to write.
    */
-  void write(std::string_view data) { m_buffer += data; }
+  void write(std::string_view data) {
+    while (!data.empty()) {
+      auto free_space = writableBuffer();
+      std::size_t size = std::min(free_space.size(), data.size());
+      std::memcpy(free_space.data(), data.data(), size);
+      commit(size);
+      data.remove_prefix(size);
+    }
+  }
 
   /**
    * @brief Checks if data can be read from the package.
    * @return true if data can be read, false otherwise.
+   * @throw std::system_error qls_errc::data_too_large if the first frame is
+   * longer than the maximum frame length.
    */
   [[nodiscard]] bool canRead() const {
-    if (m_buffer.size() < sizeof(T)) {
+    if (!lengthPrefixSize()) {
       return false;
     }
-
-    T length = 0;
-    std::memcpy(&length, m_buffer.c_str(), sizeof(T));
-    length = qls::swapNetworkEndianness(length);
-    return length <= m_buffer.size();
+    return checkedFirstMsgLength() <= m_end - m_begin;
   }
 
   /**
    * @brief Gets the length of the first message in the package.
-   * @return The length of the first message.
+   * @return The length of the first message including its trailer.
    */
   [[nodiscard]] std::size_t firstMsgLength() const {
-    if (m_buffer.size() < sizeof(T)) {
+    const std::size_t prefix_size = lengthPrefixSize();
+    if (!prefix_size) {
       return 0;
     }
+    if (m_compact_length) {
+      // The varint counts the bytes after itself
+      std::uint64_t length = 0;
+      detail::loadVarint(readBuffer(), length, compact_length_size);
+      return prefix_size + static_cast<std::size_t>(length) + m_trailer_size;
+    }
 
     T length = 0;
-    std::memcpy(&length, m_buffer.c_str(), sizeof(T));
+    std::memcpy(&length, m_buffer + m_begin, sizeof(T));
     length = qls::swapNetworkEndianness(length);
-    return std::size_t(length);
+    return std::size_t(length) + m_trailer_size;
   }
 
   /**
-   * @brief Reads a data package.
-   * @return The data package.
+   * @brief Reads a data package without copying it.
+   * @return View of the data package, valid until the next call to write()
+   * or writableBuffer().
    */
-  [[nodiscard]] std::string read() {
+  [[nodiscard]] std::string_view readView() {
     if (!canRead()) {
       throw std::system_error(qls_errc::incomplete_package);
     }
-    if (!firstMsgLength()) {
+    std::size_t length = firstMsgLength();
+    if (!length) {
       throw std::system_error(qls_errc::empty_length);
     }
 
-    std::string result = {m_buffer.begin(),
-                          m_buffer.begin() + firstMsgLength()};
-    m_buffer.erase(0, firstMsgLength());
-
+    std::string_view result(m_buffer + m_begin, length);
+    m_begin += length;
     return result;
   }
 
+  /**
+   * @brief Reads a data package.
+   * @return The data package.
+   */
+  [[nodiscard]] std::string read() { return std::string(readView()); }
+
   /**
    * @brief Retrieves the original data by populating the provided buffer.
    * @param buffer The target string to store the data.
    */
-  void read(std::string &buffer) {
-    if (!canRead()) {
-      throw std::system_error(qls_errc::incomplete_package);
-    }
-    if (!firstMsgLength()) {
-      throw std::system_error(qls_errc::empty_length);
-    }
-
-    buffer.assign(m_buffer.begin(), m_buffer.begin() + firstMsgLength());
-    m_buffer.erase(0, firstMsgLength());
-  }
+  void read(std::string &buffer) { buffer.assign(readView()); }
 
   /**
    * @brief Retrieves the original data by populating the provided buffer.
    * @param buffer The target string to store the data.
    */
-  void read(std::pmr::string &buffer) {
-    if (!canRead()) {
-      throw std::system_error(qls_errc::incomplete_package);
-    }
-    if (!firstMsgLength()) {
-      throw std::system_error(qls_errc::empty_length);
-    }
-
-    buffer.assign(m_buffer.begin(), m_buffer.begin() + firstMsgLength());
-    m_buffer.erase(0, firstMsgLength());
-  }
+  void read(std::pmr::string &buffer) { buffer.assign(readView()); }
 
   /**
    * @brief Reads the buffer data in the package.
    * @return The buffer as a string.
    */
-  [[nodiscard]] std::string_view readBuffer() const { return m_buffer; }
+  [[nodiscard]] std::string_view readBuffer() const {
+    return {m_buffer + m_begin, m_end - m_begin};
+  }
 
   /**
    * @brief Sets the buffer with the given data.
    * @param buffer The data to set in the buffer.
    */
-  void setBuffer(std::string_view buffer) { m_buffer = buffer; }
+  void setBuffer(std::string_view buffer) {
+    m_begin = m_end = 0;
+    write(buffer);
+  }
+
+  /**
+   * @brief Gets the maximum length of a single frame.
+   */
+  [[nodiscard]] std::size_t getMaxFrameLength() const noexcept {
+    return m_max_frame_length;
+  }
+
+  /**
+   * @brief Sets the maximum length of a single frame.
+   * @param max_frame_length Longer frames are rejected once their header has
+   * been received.
+   */
+  void setMaxFrameLength(std::size_t max_frame_length) noexcept {
+    m_max_frame_length = std::max(max_frame_length, sizeof(T));
+  }
+
+  /**
+   * @brief Switches between fixed and varint frame lengths.
+   * @details Takes effect from the next unread frame on, so it can be
+   * switched right after a frame that negotiated the format has been read.
+   * @param compact_length True if frames start with a varint length.
+   */
+  void setCompactLength(bool compact_length) noexcept {
+    m_compact_length = compact_length;
+  }
+
+  /**
+   * @brief Sets the size of the trailer that follows every frame.
+   * @details Takes effect from the next unread frame on. readView() returns
+   * frames with their trailer.
+   * @param trailer_size Size of the trailer, 0 for none.
+   */
+  void setTrailerSize(std::size_t trailer_size) noexcept {
+    m_trailer_size = trailer_size;
+  }
 
 private:
-  std::pmr::string m_buffer;
-  static inline std::pmr::synchronized_pool_resource local_sync_package_pool =
-      {};
+  /// Bytes a varint of type T takes at most
+  constexpr static std::size_t compact_length_size = (sizeof(T) * 8 + 6) / 7;
+
+  // Size of the length at the front of the first frame, 0 if incomplete
+  [[nodiscard]] std::size_t lengthPrefixSize() const {
+    if (!m_compact_length) {
+      return m_end - m_begin >= sizeof(T) ? sizeof(T) : 0;
+    }
+    std::uint64_t length = 0;
+    return detail::loadVarint(readBuffer(), length, compact_length_size);
+  }
+
+  [[nodiscard]] std::size_t checkedFirstMsgLength() const {
+    std::size_t length = firstMsgLength();
+    if (length > m_max_frame_length) {
+      throw std::system_error(qls_errc::data_too_large);
+    }
+    return length;
+  }
+
+  void reserve(std::size_t capacity) {
+    capacity = std::bit_ceil(capacity);
+    char *buffer = static_cast<char *>(thread_local_pool_resource()->allocate(
+        capacity, alignof(std::max_align_t)));
+    if (m_buffer != nullptr) {
+      std::memcpy(buffer, m_buffer + m_begin, m_end - m_begin);
+    }
+    m_end -= m_begin;
+    m_begin = 0;
+    release();
+    m_buffer = buffer;
+    m_capacity = capacity;
+  }
+
+  void release() noexcept {
+    if (m_buffer != nullptr) {
+      thread_local_pool_resource()->deallocate(m_buffer, m_capacity,
+                                               alignof(std::max_align_t));
+      m_buffer = nullptr;
+      m_capacity = 0;
+    }
+  }
+
+  char *m_buffer = nullptr;
+  std::size_t m_capacity = 0;
+  std::size_t m_begin = 0;
+  std::size_t m_end = 0;
+  std::size_t m_max_frame_length;
+  bool m_compact_length = false;
+  std::size_t m_trailer_size = 0;
 };
 
 } // namespace qls
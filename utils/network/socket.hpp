@@ -3,11 +3,12 @@
 
 #include <asio.hpp>
 #include <asio/ssl.hpp>
-#include <kcp.hpp>
+
+#include "kcpStream.hpp"
 
 namespace qls {
 using Socket = asio::ssl::stream<asio::ip::tcp::socket>;
-using KCPSocket = asio::ssl::stream<moon::kcp::connection>;
+using KCPSocket = asio::ssl::stream<KcpStream>;
 } // namespace qls
 
 #endif // !SOCKET_H
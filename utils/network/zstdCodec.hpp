@@ -0,0 +1,153 @@
+#ifndef ZSTD_CODEC_HPP
+#define ZSTD_CODEC_HPP
+
+#include <zstd.h>
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "qls_error.h"
+
+namespace qls {
+
+namespace detail {
+
+// Raw content dictionary, zstd copies matches from it as if it had been sent
+// right before every package. The most common fragments are at the end, where
+// the offsets are shortest. Clients must use exactly the same bytes.
+inline constexpr std::string_view zstd_json_dictionary =
+    R"({"state":"error","message":"You haven't logged in!"})"
+    R"({"state":"error","message":"Unknown error occured!"})"
+    R"({"state":"success","message":"Successfully logged in!"})"
+    R"({"state":"success","message":"Successfully getting result!",)"
+    R"("result":{"friend_list":[],"group_list":[],"has_user":false,)"
+    R"("verification_type":1,"user_id":10000,"groupid":10000,"userid":10000)"
+    R"({"type":"added_friend","type":"added_friend_verfication",)"
+    R"("type":"added_group","type":"added_group_verification",)"
+    R"("type":"rejected_to_add_friend","type":"rejected_to_add_group",)"
+    R"("type":"removed_friend","type":"group_removed",)"
+    R"("type":"group_leave_member","type":"private_tip_message",)"
+    R"("type":"group_tip_message","type":"private_message",)"
+    R"({"data":{"user_id":10000,"message":""},"type":"private_message"})"
+    R"({"data":{"group_id":10000,"message":"","user_id":10000},)"
+    R"("type":"group_message"})";
+
+} // namespace detail
+
+/**
+ * @brief Compresses text packages with a dictionary shared with the clients.
+ * @details JSON packages are only a few hundred bytes long, too short for
+ * zstd to find much to reuse within one package. The dictionary holds the
+ * keys and values that repeat in every package, so each package compresses
+ * well on its own and needs no state per connection.
+ */
+class ZstdCodec final {
+public:
+  /// Name a client asks for at login, changes whenever the dictionary does
+  constexpr static std::string_view name = "zstd-json-1";
+  constexpr static int default_level = 3;
+  /// Data shorter than this is not worth compressing
+  constexpr static std::size_t min_compress_size = 64;
+
+  ZstdCodec() = delete;
+
+  /**
+   * @brief Compresses data with the shared dictionary.
+   * @param data The data to compress.
+   * @return A zstd frame that records the size of the original data.
+   * @throw std::system_error qls_errc::compression_failed on failure.
+   */
+  [[nodiscard]] static std::string compress(std::string_view data) {
+    thread_local std::unique_ptr<ZSTD_CCtx, ContextDeleter> context(
+        ZSTD_createCCtx());
+    const ZSTD_CDict *dictionary = getCompressDictionary();
+    if (!context || dictionary == nullptr) {
+      throw std::system_error(qls_errc::compression_failed);
+    }
+
+    std::string result(ZSTD_compressBound(data.size()), '\0');
+    const std::size_t size = ZSTD_compress_usingCDict(
+        context.get(), result.data(), result.size(), data.data(), data.size(),
+        dictionary);
+    if (ZSTD_isError(size)) {
+      throw std::system_error(qls_errc::compression_failed);
+    }
+    result.resize(size);
+    return result;
+  }
+
+  /**
+   * @brief Decompresses data made by compress().
+   * @param data The zstd frame.
+   * @param max_size Largest size of the original data that is accepted.
+   * @return The original data.
+   * @throw std::system_error qls_errc::invalid_data if the frame is broken,
+   * qls_errc::data_too_large if the original data is too large.
+   */
+  [[nodiscard]] static std::string decompress(std::string_view data,
+                                              std::size_t max_size) {
+    const unsigned long long content_size =
+        ZSTD_getFrameContentSize(data.data(), data.size());
+    if (content_size == ZSTD_CONTENTSIZE_ERROR ||
+        content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+      throw std::system_error(qls_errc::invalid_data);
+    }
+    if (content_size > max_size) {
+      throw std::system_error(qls_errc::data_too_large);
+    }
+
+    thread_local std::unique_ptr<ZSTD_DCtx, ContextDeleter> context(
+        ZSTD_createDCtx());
+    const ZSTD_DDict *dictionary = getDecompressDictionary();
+    if (!context || dictionary == nullptr) {
+      throw std::system_error(qls_errc::compression_failed);
+    }
+
+    std::string result(static_cast<std::size_t>(content_size), '\0');
+    const std::size_t size = ZSTD_decompress_usingDDict(
+        context.get(), result.data(), result.size(), data.data(), data.size(),
+        dictionary);
+    if (ZSTD_isError(size) || size != result.size()) {
+      throw std::system_error(qls_errc::invalid_data);
+    }
+    return result;
+  }
+
+private:
+  struct ContextDeleter {
+    void operator()(ZSTD_CCtx *context) const noexcept {
+      ZSTD_freeCCtx(context);
+    }
+    void operator()(ZSTD_DCtx *context) const noexcept {
+      ZSTD_freeDCtx(context);
+    }
+    void operator()(ZSTD_CDict *dictionary) const noexcept {
+      ZSTD_freeCDict(dictionary);
+    }
+    void operator()(ZSTD_DDict *dictionary) const noexcept {
+      ZSTD_freeDDict(dictionary);
+    }
+  };
+
+  // The dictionaries are digested once and shared by all threads
+  static const ZSTD_CDict *getCompressDictionary() {
+    static const std::unique_ptr<ZSTD_CDict, ContextDeleter> dictionary(
+        ZSTD_createCDict(detail::zstd_json_dictionary.data(),
+                         detail::zstd_json_dictionary.size(), default_level));
+    return dictionary.get();
+  }
+
+  static const ZSTD_DDict *getDecompressDictionary() {
+    static const std::unique_ptr<ZSTD_DDict, ContextDeleter> dictionary(
+        ZSTD_createDDict(detail::zstd_json_dictionary.data(),
+                         detail::zstd_json_dictionary.size()));
+    return dictionary.get();
+  }
+};
+
+} // namespace qls
+
+#endif // !ZSTD_CODEC_HPP
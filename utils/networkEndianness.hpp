@@ -4,6 +4,7 @@
 #include <bit>
 #include <concepts>
 #include <cstddef>
+#include <cstring>
 
 namespace qls {
 
@@ -18,11 +19,15 @@ namespace qls {
 template <typename T>
   requires std::integral<T>
 [[nodiscard]] constexpr T swapEndianness(T value) {
+#if defined(__cpp_lib_byteswap)
+  return std::byteswap(value);
+#else
   T result = 0;
   for (std::size_t i = 0; i < sizeof(value); ++i) {
     result = (result << 8) | ((value >> (8 * i)) & 0xFF);
   }
   return result;
+#endif
 }
 
 /// @brief Convert if the network endianness is different from local system
@@ -38,6 +43,29 @@ template <typename T>
   return value;
 }
 
+/// @brief Read an integral stored in network endianness
+/// @tparam T Type of integral
+/// @param data Pointer to at least sizeof(T) bytes, may be unaligned
+/// @return Integral of local endianness
+template <typename T>
+  requires std::integral<T>
+[[nodiscard]] inline T loadNetworkEndianness(const void *data) {
+  T value = 0;
+  std::memcpy(&value, data, sizeof(T));
+  return swapNetworkEndianness(value);
+}
+
+/// @brief Write an integral in network endianness
+/// @tparam T Type of integral
+/// @param data Pointer to at least sizeof(T) bytes, may be unaligned
+/// @param value Integral of local endianness
+template <typename T>
+  requires std::integral<T>
+inline void storeNetworkEndianness(void *data, T value) {
+  value = swapNetworkEndianness(value);
+  std::memcpy(data, &value, sizeof(T));
+}
+
 } // namespace qls
 
 #endif // !NETWORK_ENDIANNESS_HPP
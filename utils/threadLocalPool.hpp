@@ -0,0 +1,163 @@
+#ifndef THREAD_LOCAL_POOL_HPP
+#define THREAD_LOCAL_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+namespace qls {
+
+namespace detail {
+
+struct ThreadLocalPoolState;
+
+/**
+ * @brief Header in front of every block handed out by the pool.
+ * @details Records the owning pool so the block can be returned to it from
+ * any thread, and the size needed to give it back to the pool later.
+ */
+struct ThreadLocalPoolBlock {
+  ThreadLocalPoolState *owner;
+  ThreadLocalPoolBlock *next;
+  std::size_t size;
+  std::size_t alignment;
+};
+
+/**
+ * @brief Pool owned by one thread.
+ * @details Only the owning thread touches the pool itself. Blocks freed by
+ * other threads are pushed onto a lock-free list and given back to the pool
+ * by the owner the next time it allocates. The state lives until the owner
+ * thread has exited and every block has been freed.
+ */
+struct ThreadLocalPoolState {
+  std::pmr::unsynchronized_pool_resource pool;
+  std::atomic<ThreadLocalPoolBlock *> remote_free = nullptr;
+  // One reference for the owner thread and one for every live block
+  std::atomic<std::size_t> references = 1;
+
+  void pushRemote(ThreadLocalPoolBlock *block) noexcept {
+    block->next = remote_free.load(std::memory_order_relaxed);
+    while (!remote_free.compare_exchange_weak(block->next, block,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed)) {
+    }
+  }
+
+  void drainRemote() noexcept {
+    if (remote_free.load(std::memory_order_relaxed) == nullptr) {
+      return;
+    }
+    ThreadLocalPoolBlock *block =
+        remote_free.exchange(nullptr, std::memory_order_acquire);
+    while (block != nullptr) {
+      ThreadLocalPoolBlock *next = block->next;
+      pool.deallocate(block, block->size, block->alignment);
+      block = next;
+    }
+  }
+
+  void release() noexcept {
+    if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+};
+
+inline thread_local ThreadLocalPoolState *local_pool_state = nullptr;
+inline thread_local bool local_pool_destroyed = false;
+
+struct ThreadLocalPoolHolder {
+  ThreadLocalPoolHolder() : state(new ThreadLocalPoolState) {
+    local_pool_state = state;
+  }
+
+  ~ThreadLocalPoolHolder() noexcept {
+    local_pool_state = nullptr;
+    local_pool_destroyed = true;
+    state->drainRemote();
+    state->release();
+  }
+
+  ThreadLocalPoolState *state;
+};
+
+} // namespace detail
+
+/**
+ * @brief A memory resource backed by a pool per thread.
+ * @details Allocations never take a lock: they are served from an
+ * unsynchronized pool owned by the calling thread. Blocks may be freed on any
+ * thread; a block freed by a thread other than its owner is handed back to the
+ * owner through a lock-free list.
+ */
+class ThreadLocalPoolResource final : public std::pmr::memory_resource {
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+    const std::size_t offset = headerOffset(alignment);
+    const std::size_t size = bytes + offset;
+    alignment = std::max(alignment, alignof(detail::ThreadLocalPoolBlock));
+
+    detail::ThreadLocalPoolState *state = localState();
+    bool orphan = false;
+    if (state == nullptr) {
+      // The thread is exiting, use a pool nobody owns
+      state = new detail::ThreadLocalPoolState;
+      orphan = true;
+    }
+    state->drainRemote();
+
+    void *mem = state->pool.allocate(size, alignment);
+    state->references.fetch_add(1, std::memory_order_relaxed);
+    new (mem) detail::ThreadLocalPoolBlock{state, nullptr, size, alignment};
+    if (orphan) {
+      state->release();
+    }
+    return static_cast<std::byte *>(mem) + offset;
+  }
+
+  void do_deallocate(void *ptr, std::size_t, std::size_t alignment) override {
+    auto *block = reinterpret_cast<detail::ThreadLocalPoolBlock *>(
+        static_cast<std::byte *>(ptr) - headerOffset(alignment));
+    detail::ThreadLocalPoolState *owner = block->owner;
+    if (owner == detail::local_pool_state) {
+      owner->pool.deallocate(block, block->size, block->alignment);
+    } else {
+      owner->pushRemote(block);
+    }
+    owner->release();
+  }
+
+  bool do_is_equal(
+      const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+
+private:
+  static std::size_t headerOffset(std::size_t alignment) noexcept {
+    return std::max(sizeof(detail::ThreadLocalPoolBlock), alignment);
+  }
+
+  static detail::ThreadLocalPoolState *localState() {
+    if (detail::local_pool_state == nullptr && !detail::local_pool_destroyed) {
+      thread_local detail::ThreadLocalPoolHolder holder;
+    }
+    return detail::local_pool_state;
+  }
+};
+
+/**
+ * @brief Gets the process-wide thread-local pool resource.
+ * @return Pointer to the resource, valid for the whole program.
+ */
+inline std::pmr::memory_resource *thread_local_pool_resource() noexcept {
+  // Never destroyed, blocks may still be freed during static destruction
+  static ThreadLocalPoolResource *resource = new ThreadLocalPoolResource;
+  return resource;
+}
+
+} // namespace qls
+
+#endif // !THREAD_LOCAL_POOL_HPP
@@ -0,0 +1,161 @@
+#ifndef TIMING_WHEEL_HPP
+#define TIMING_WHEEL_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace qls {
+
+/**
+ * @brief A hierarchical timing wheel for coarse timeouts.
+ * @details Timers are bucketed by their expiry tick into levels of 64 slots,
+ * each level covering 64 times the range of the one below it. Adding a timer
+ * and firing the due slot are O(1); timers in higher levels are moved down
+ * once when their slot comes up. The wheel doesn't run by itself: the owner
+ * calls tick() periodically, e.g. from one steady_timer per io_context.
+ *
+ * Timers can't be cancelled, so callbacks should hold weak references and
+ * check whether the work is still needed when they fire.
+ */
+class TimingWheel final {
+public:
+  using clock = std::chrono::steady_clock;
+  using Callback = std::function<void()>;
+
+  constexpr static std::chrono::milliseconds default_tick_duration =
+      std::chrono::milliseconds(500);
+
+  TimingWheel(clock::duration tick_duration = default_tick_duration)
+      : m_tick_duration(tick_duration), m_start(clock::now()), m_ticks(0),
+        m_now(m_start.time_since_epoch().count()) {}
+
+  TimingWheel(const TimingWheel &) = delete;
+  TimingWheel(TimingWheel &&) = delete;
+  ~TimingWheel() noexcept = default;
+
+  TimingWheel &operator=(const TimingWheel &) = delete;
+  TimingWheel &operator=(TimingWheel &&) = delete;
+
+  /**
+   * @brief Adds a timer.
+   * @param delay Time until the callback runs, rounded up to whole ticks.
+   * @param callback Function called from tick() once the timer expires.
+   */
+  void add(clock::duration delay, Callback callback) {
+    const auto due = clock::now() - m_start + std::max(delay, {});
+    auto expiry = static_cast<std::uint64_t>(
+        (due + m_tick_duration - clock::duration(1)) / m_tick_duration);
+
+    std::lock_guard lock(m_mutex);
+    expiry = std::clamp<std::uint64_t>(expiry, m_ticks + 1,
+                                       m_ticks + max_delay_ticks);
+    insert({expiry, std::move(callback)});
+  }
+
+  /**
+   * @brief Advances the wheel to the current time and runs expired timers.
+   * @details Callbacks run on the calling thread without the wheel being
+   * locked, so they may add new timers.
+   */
+  void tick() {
+    const auto now = clock::now();
+    const auto target = static_cast<std::uint64_t>((now - m_start) /
+                                                   m_tick_duration);
+    m_now.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+
+    std::vector<Timer> expired;
+    {
+      std::lock_guard lock(m_mutex);
+      while (m_ticks < target) {
+        ++m_ticks;
+        // Move the timers of higher levels whose slot has come up down
+        for (std::size_t level = 1; level < level_num; ++level) {
+          if (m_ticks & ((std::uint64_t(1) << (slot_bits * level)) - 1)) {
+            break;
+          }
+          auto &slot = m_levels[level][slotIndex(m_ticks, level)];
+          std::vector<Timer> timers = std::move(slot);
+          slot.clear();
+          for (auto &timer : timers) {
+            insert(std::move(timer));
+          }
+        }
+        auto &slot = m_levels[0][slotIndex(m_ticks, 0)];
+        std::move(slot.begin(), slot.end(), std::back_inserter(expired));
+        slot.clear();
+      }
+    }
+
+    for (auto &timer : expired) {
+      timer.callback();
+    }
+  }
+
+  /**
+   * @brief Gets the time of the last tick.
+   * @details Cheaper than clock::now() and precise enough for idle checks.
+   */
+  [[nodiscard]] clock::time_point now() const noexcept {
+    return clock::time_point(
+        clock::duration(m_now.load(std::memory_order_relaxed)));
+  }
+
+  /**
+   * @brief Gets the duration of a tick.
+   */
+  [[nodiscard]] clock::duration get_tick_duration() const noexcept {
+    return m_tick_duration;
+  }
+
+private:
+  constexpr static std::size_t slot_bits = 6;
+  constexpr static std::size_t slot_num = std::size_t(1) << slot_bits;
+  constexpr static std::size_t level_num = 4;
+  constexpr static std::uint64_t max_delay_ticks =
+      (std::uint64_t(1) << (slot_bits * level_num)) - 1;
+
+  struct Timer {
+    std::uint64_t expiry;
+    Callback callback;
+  };
+
+  static std::size_t slotIndex(std::uint64_t ticks,
+                               std::size_t level) noexcept {
+    return static_cast<std::size_t>(ticks >> (slot_bits * level)) &
+           (slot_num - 1);
+  }
+
+  // Must be called with m_mutex held
+  void insert(Timer timer) {
+    const std::uint64_t delta =
+        timer.expiry > m_ticks ? timer.expiry - m_ticks : 0;
+    std::size_t level = 0;
+    while (level + 1 < level_num &&
+           delta >= (std::uint64_t(1) << (slot_bits * (level + 1)))) {
+      ++level;
+    }
+    // Timers that are already due go into the slot fired by this tick
+    const std::uint64_t expiry = delta ? timer.expiry : m_ticks;
+    m_levels[level][slotIndex(expiry, level)].push_back(std::move(timer));
+  }
+
+  const clock::duration m_tick_duration;
+  const clock::time_point m_start;
+  std::uint64_t m_ticks;              ///< Ticks since m_start, under m_mutex.
+  std::atomic<clock::rep> m_now;      ///< Time of the last tick.
+  std::array<std::array<std::vector<Timer>, slot_num>, level_num> m_levels;
+  std::mutex m_mutex;
+};
+
+} // namespace qls
+
+#endif // !TIMING_WHEEL_HPP
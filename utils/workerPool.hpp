@@ -0,0 +1,149 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <algorithm>
+#include <asio.hpp>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "qls_error.h"
+
+namespace qls {
+
+/**
+ * @brief A bounded pool of threads for work that mustn't run on io threads.
+ * @details Hashing passwords, touching the disk or waiting for the database
+ * would stall every socket of an io_context, so such work is run here and
+ * the caller is resumed on its own executor afterwards. The number of tasks
+ * queued or running is limited: once the limit is reached new tasks are
+ * rejected with qls_errc::server_busy instead of piling up.
+ */
+class WorkerPool final {
+public:
+  constexpr static std::size_t default_max_queue_depth = 1024;
+
+  WorkerPool() = default;
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool(WorkerPool &&) = delete;
+  ~WorkerPool() noexcept { stop(); }
+
+  WorkerPool &operator=(const WorkerPool &) = delete;
+  WorkerPool &operator=(WorkerPool &&) = delete;
+
+  /**
+   * @brief Starts the threads of the pool.
+   * @details Until then tasks run inline on the caller.
+   * @param thread_num Number of threads, at least one.
+   * @param max_queue_depth Maximum number of tasks queued or running.
+   */
+  void init(std::size_t thread_num,
+            std::size_t max_queue_depth = default_max_queue_depth) {
+    m_max_queue_depth = std::max<std::size_t>(max_queue_depth, 1);
+    m_pool = std::make_unique<asio::thread_pool>(
+        std::max<std::size_t>(thread_num, 1));
+  }
+
+  /**
+   * @brief Stops the threads, tasks that haven't started are dropped.
+   */
+  void stop() noexcept {
+    if (m_pool) {
+      m_pool->stop();
+      m_pool->join();
+    }
+  }
+
+  /**
+   * @brief Runs a function on the pool.
+   * @details The awaiting coroutine is resumed on its own executor.
+   * Exceptions thrown by the function are rethrown to the caller.
+   * @param function Function called without arguments.
+   * @return The result of the function.
+   * @throw std::system_error with qls_errc::server_busy if the maximum
+   * number of tasks is reached.
+   */
+  template <typename Function>
+  asio::awaitable<std::invoke_result_t<Function &>>
+  async_run(Function function) {
+    using Result = std::invoke_result_t<Function &>;
+    if (!m_pool) {
+      co_return function();
+    }
+
+    const std::size_t depth =
+        m_queue_depth.fetch_add(1, std::memory_order_relaxed);
+    if (depth >= m_max_queue_depth) {
+      m_queue_depth.fetch_sub(1, std::memory_order_relaxed);
+      m_rejected_tasks.fetch_add(1, std::memory_order_relaxed);
+      throw std::system_error(qls_errc::server_busy);
+    }
+    std::size_t peak = m_peak_queue_depth.load(std::memory_order_relaxed);
+    while (peak <= depth &&
+           !m_peak_queue_depth.compare_exchange_weak(
+               peak, depth + 1, std::memory_order_relaxed)) {
+    }
+
+    co_return co_await asio::co_spawn(
+        m_pool->get_executor(),
+        [this, function = std::move(function)]() mutable
+        -> asio::awaitable<Result> {
+          // The task stops counting once it has run, even if it threw
+          struct TaskGuard {
+            WorkerPool &pool;
+            ~TaskGuard() noexcept {
+              pool.m_queue_depth.fetch_sub(1, std::memory_order_relaxed);
+              pool.m_completed_tasks.fetch_add(1, std::memory_order_relaxed);
+            }
+          } guard{*this};
+          co_return function();
+        },
+        asio::use_awaitable);
+  }
+
+  /**
+   * @brief Gets the number of tasks queued or running.
+   */
+  [[nodiscard]] std::size_t get_queue_depth() const noexcept {
+    return m_queue_depth.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Gets the peak number of tasks queued or running since the last
+   * call and starts a new period.
+   */
+  [[nodiscard]] std::size_t take_peak_queue_depth() noexcept {
+    return m_peak_queue_depth.exchange(
+        m_queue_depth.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Gets the number of tasks rejected because the pool was full.
+   */
+  [[nodiscard]] std::size_t get_rejected_tasks() const noexcept {
+    return m_rejected_tasks.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Gets the number of tasks that have run.
+   */
+  [[nodiscard]] std::size_t get_completed_tasks() const noexcept {
+    return m_completed_tasks.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::unique_ptr<asio::thread_pool> m_pool;
+  std::size_t m_max_queue_depth = default_max_queue_depth;
+  std::atomic<std::size_t> m_queue_depth = 0;
+  std::atomic<std::size_t> m_peak_queue_depth = 0;
+  std::atomic<std::size_t> m_rejected_tasks = 0;
+  std::atomic<std::size_t> m_completed_tasks = 0;
+};
+
+} // namespace qls
+
+#endif // !WORKER_POOL_HPP